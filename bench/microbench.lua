@@ -0,0 +1,44 @@
+--
+-- Lua binding microbenchmarks, run by radbench (make microbench).
+-- radbench.run (name, iterations, fn) times fn (iterations) and counts
+-- its allocations, radbench.port is an in-process server that accepts
+-- every request, radbench.snapshot the dictionary snapshot given with -s.
+--
+
+require 'radius';
+
+local N = radbench.iterations;
+
+if radbench.snapshot then
+  radius.dictionary { snapshot = radbench.snapshot };
+end
+
+local auth = radius.auth.new ();
+auth:setServer ("127.0.0.1", radbench.port, radbench.secret);
+auth:setUsername ("bench");
+auth:setPassword ("bench");
+assert (auth:send () == 1, auth:getLastErrMsg ());
+
+-- Builds a { name, opr, value } table per call
+radbench.run ("lua_get_attribute", N, function (n)
+  for i = 1, n do
+    auth:getAttribute ("Session-Timeout");
+  end
+end);
+
+radbench.run ("lua_get_value", N, function (n)
+  for i = 1, n do
+    auth:getValue ("Session-Timeout");
+  end
+end);
+
+auth = nil;
+collectgarbage ();
+
+-- Object creation, including the dictionary initialization and the GC
+radbench.run ("lua_auth_new", N / 100, function (n)
+  for i = 1, n do
+    radius.auth.new ();
+  end
+  collectgarbage ();
+end);
@@ -0,0 +1,671 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/**
+ * Microbenchmarks of the per-packet costs of the client: attribute set
+ * and get, request encoding, reply decoding and the Lua binding. Run with
+ * "make microbench", see bench/Makefile.am.
+ *
+ * Results are printed one per line, tab separated:
+ *   name  ns/op  allocations/op  iterations
+ * With a baseline (-b) every line gets the baseline ns/op, the change in
+ * percent and OK or REGRESSION appended.
+ **/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "radiusclient.h"
+#include "radiusdict.h"
+
+#define RADBENCH_SECRET      "testing123"
+#define RADBENCH_MAX         64
+#define RADBENCH_BATCH       16
+#define RADBENCH_ITERATIONS  200000
+#define RADBENCH_THRESHOLD   10.0
+
+typedef struct _RADBenchResult {
+  char          name[32];
+  double        ns_op;
+  double        allocs_op;
+  unsigned long iterations;
+} RADBenchResult;
+
+static struct {
+  RADBenchResult results[RADBENCH_MAX];
+  int            n;
+  int            port;
+  volatile int   counting;
+  unsigned long  allocs;
+  unsigned long  allocs0;
+  struct timespec t0;
+  double         ns;
+  unsigned long  nallocs;
+} bench;
+
+/* Internal declaration */
+
+static void bench_reset  (void);
+static void bench_begin  (void);
+static void bench_end    (void);
+static void bench_report (const char *name, unsigned long iterations);
+static int  bench_compare (const char *file, double threshold);
+static int  bench_save    (const char *file);
+
+static RADIUS_PACKET *request_new (void);
+static void  reply_attrs     (VALUE_PAIR **vps);
+static int   responder_start (void);
+static void *responder       (void *arg);
+
+static void bench_attr_set      (unsigned long n);
+static void bench_attr_get      (unsigned long n);
+static void bench_encode_sign   (unsigned long n);
+static void bench_verify_decode (unsigned long n);
+static int  bench_lua           (const char *script, const char *snapshot,
+                                 unsigned long n);
+static int  lua_bench_run       (lua_State *L);
+
+/**
+ * Count allocations by interposing the allocator, glibc exports the real
+ * one under another name. Elsewhere allocations are reported as -1.
+ **/
+#ifdef __GLIBC__
+#define RADBENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+  if (bench.counting)
+    __sync_fetch_and_add (&bench.allocs, 1);
+
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (bench.counting)
+    __sync_fetch_and_add (&bench.allocs, 1);
+
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (bench.counting)
+    __sync_fetch_and_add (&bench.allocs, 1);
+
+  return __libc_realloc (ptr, size);
+}
+#endif
+
+/* Implementation */
+
+int
+main (int argc, char **argv)
+{
+  const char *script   = NULL;
+  const char *baseline = NULL;
+  const char *save     = NULL;
+  const char *errmsg   = NULL;
+  const char *snapshot = NULL;
+  unsigned long n  = RADBENCH_ITERATIONS;
+  double threshold = RADBENCH_THRESHOLD;
+  int opt;
+  int res = 0;
+
+  while ((opt = getopt (argc, argv, "n:l:b:o:t:s:h")) != -1)
+    {
+      switch (opt)
+        {
+          case 'n':
+            n = strtoul (optarg, NULL, 10);
+            break;
+
+          case 'l':
+            script = optarg;
+            break;
+
+          case 'b':
+            baseline = optarg;
+            break;
+
+          case 'o':
+            save = optarg;
+            break;
+
+          case 't':
+            threshold = atof (optarg);
+            break;
+
+          case 's':
+            snapshot = optarg;
+            break;
+
+          default:
+            fprintf (stderr, "Usage: %s [-n iterations] [-l bench.lua] "
+                     "[-o save.tsv] [-b baseline.tsv] [-t percent] "
+                     "[-s snapshot]\n",
+                     argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+  if (n < RADBENCH_BATCH)
+    n = RADBENCH_BATCH;
+
+  raddict_configure (NULL, NULL, snapshot);
+
+  /* Held for the whole run, clients come and go */
+  if (raddict_acquire (&errmsg) == RADIUSCLIENT_ERR)
+    {
+      fprintf (stderr, "%s: %s\n", errmsg, fr_strerror ());
+      return 2;
+    }
+
+  if (responder_start () < 0)
+    return 2;
+
+  /* Attribute lists are O(n) to append to, keep them request sized */
+  bench_attr_set (n / 4);
+  bench_attr_get (n);
+  bench_encode_sign (n);
+  bench_verify_decode (n);
+
+  if (script && (bench_lua (script, snapshot, n) < 0))
+    res = 2;
+
+  if (save && (bench_save (save) < 0))
+    res = 2;
+
+  if (baseline && (bench_compare (baseline, threshold) > 0) && !res)
+    res = 1;
+
+  return res;
+}
+
+static void
+bench_reset (void)
+{
+  bench.ns      = 0;
+  bench.nallocs = 0;
+}
+
+static void
+bench_begin (void)
+{
+  bench.allocs0  = bench.allocs;
+  bench.counting = 1;
+  clock_gettime (CLOCK_MONOTONIC, &bench.t0);
+}
+
+static void
+bench_end (void)
+{
+  struct timespec t1;
+
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  bench.counting = 0;
+
+  bench.ns += (t1.tv_sec - bench.t0.tv_sec) * 1e9 +
+              (t1.tv_nsec - bench.t0.tv_nsec);
+  bench.nallocs += bench.allocs - bench.allocs0;
+}
+
+static void
+bench_report (const char *name, unsigned long iterations)
+{
+  RADBenchResult *r = NULL;
+
+  if ((bench.n >= RADBENCH_MAX) || (iterations == 0))
+    return;
+
+  r = &bench.results[bench.n++];
+
+  snprintf (r->name, sizeof (r->name), "%s", name);
+  r->ns_op      = bench.ns / iterations;
+#ifdef RADBENCH_COUNT_ALLOCS
+  r->allocs_op  = (double) bench.nallocs / iterations;
+#else
+  r->allocs_op  = -1;
+#endif
+  r->iterations = iterations;
+
+  fprintf (stdout, "%s\t%.1f\t%.2f\t%lu\n", r->name, r->ns_op,
+           r->allocs_op, r->iterations);
+  fflush (stdout);
+
+  bench_reset ();
+}
+
+static int
+bench_save (const char *file)
+{
+  FILE *fp = fopen (file, "w");
+  int i;
+
+  if (!fp)
+    {
+      fprintf (stderr, "Could not write %s\n", file);
+      return -1;
+    }
+
+  fprintf (fp, "# name\tns/op\tallocs/op\titerations\n");
+
+  for (i = 0; i < bench.n; i++)
+    {
+      fprintf (fp, "%s\t%.1f\t%.2f\t%lu\n", bench.results[i].name,
+               bench.results[i].ns_op, bench.results[i].allocs_op,
+               bench.results[i].iterations);
+    }
+
+  fclose (fp);
+
+  return 0;
+}
+
+/**
+ * Time is noisy, it must get worse by more than threshold percent to be
+ * flagged. Allocations are exact, any increase is a regression.
+ * Returns the number of regressions, -1 when the baseline is unreadable.
+ **/
+static int
+bench_compare (const char *file, double threshold)
+{
+  FILE *fp = fopen (file, "r");
+  char line[256];
+  char name[32];
+  double ns_op, allocs_op, delta;
+  int regressions = 0;
+  int i;
+
+  if (!fp)
+    {
+      fprintf (stderr, "Could not read baseline %s\n", file);
+      return -1;
+    }
+
+  fprintf (stdout, "# name\tns/op\tallocs/op\titerations\t"
+           "base ns/op\tchange %%\tstatus\n");
+
+  while (fgets (line, sizeof (line), fp))
+    {
+      if ((line[0] == '#') ||
+          (sscanf (line, "%31s %lf %lf", name, &ns_op, &allocs_op) != 3))
+        continue;
+
+      for (i = 0; i < bench.n; i++)
+        {
+          RADBenchResult *r = &bench.results[i];
+          int regression;
+
+          if (strcmp (r->name, name) != 0)
+            continue;
+
+          delta = ns_op > 0 ? (r->ns_op - ns_op) * 100 / ns_op : 0;
+          regression = (delta > threshold) ||
+                       (r->allocs_op > allocs_op + 0.005);
+
+          fprintf (stdout, "%s\t%.1f\t%.2f\t%lu\t%.1f\t%+.1f\t%s\n",
+                   r->name, r->ns_op, r->allocs_op, r->iterations, ns_op,
+                   delta, regression ? "REGRESSION" : "OK");
+
+          regressions += regression;
+        }
+    }
+
+  fclose (fp);
+
+  return regressions;
+}
+
+/* C benchmarks */
+
+static void
+bench_attr_set (unsigned long n)
+{
+  RADIUSClientCtrl **clients = NULL;
+  unsigned long nclients = n / RADBENCH_BATCH;
+  unsigned long i, j;
+
+  /* The API can't clear attributes, use a fresh client per batch */
+  clients = calloc (nclients, sizeof (RADIUSClientCtrl *));
+
+  for (i = 0; i < nclients; i++)
+    {
+      clients[i] = malloc (radclient_ctrl_size ());
+      radclient_ctrl_init (clients[i]);
+
+      bench_begin ();
+      for (j = 0; j < RADBENCH_BATCH; j++)
+        radclient_attr_set (clients[i], "NAS-Port", "42");
+      bench_end ();
+    }
+
+  bench_report ("attr_set", nclients * RADBENCH_BATCH);
+
+  for (i = 0; i < nclients; i++)
+    {
+      bench_begin ();
+      for (j = 0; j < RADBENCH_BATCH; j++)
+        radclient_attr_set_number (clients[i], "Session-Timeout", j);
+      bench_end ();
+    }
+
+  bench_report ("attr_set_number", nclients * RADBENCH_BATCH);
+
+  for (i = 0; i < nclients; i++)
+    {
+      radclient_ctrl_free (clients[i]);
+      free (clients[i]);
+    }
+
+  free (clients);
+}
+
+static void
+bench_attr_get (unsigned long n)
+{
+  RADIUSClientCtrl *c = malloc (radclient_ctrl_size ());
+  const uint8_t *octets = NULL;
+  size_t octets_len;
+  const char *opr = NULL;
+  char value[1024];
+  double number;
+  int kind;
+  unsigned long i;
+
+  radclient_ctrl_init (c);
+  radclient_server_set (c, "127.0.0.1", bench.port, RADBENCH_SECRET);
+  radclient_attr_set (c, "User-Name", "bench");
+  radclient_attr_set (c, "User-Password", "bench");
+
+  if (radclient_send (c, RADIUSCLIENT_AUTH_REQ) != RADIUSCLIENT_OK)
+    {
+      fprintf (stderr, "attr_get: %s\n", radclient_get_last_err_msg (c));
+      goto done;
+    }
+
+  bench_begin ();
+  for (i = 0; i < n; i++)
+    radclient_attr_get (c, "Session-Timeout", value, sizeof (value), &opr);
+  bench_end ();
+
+  bench_report ("attr_get", n);
+
+  bench_begin ();
+  for (i = 0; i < n; i++)
+    radclient_attr_get_value (c, "Session-Timeout", &kind, &number,
+                              &octets, &octets_len);
+  bench_end ();
+
+  bench_report ("attr_get_value", n);
+
+done:
+  radclient_ctrl_free (c);
+  free (c);
+}
+
+static void
+bench_encode_sign (unsigned long n)
+{
+  RADIUS_PACKET *request = request_new ();
+  unsigned long i;
+
+  bench_begin ();
+  for (i = 0; i < n; i++)
+    {
+      free (request->data);
+      request->data = NULL;
+      request->data_len = 0;
+
+      rad_encode (request, NULL, RADBENCH_SECRET);
+      rad_sign (request, NULL, RADBENCH_SECRET);
+    }
+  bench_end ();
+
+  bench_report ("encode_sign", n);
+
+  rad_free (&request);
+}
+
+static void
+bench_verify_decode (unsigned long n)
+{
+  RADIUS_PACKET *request = request_new ();
+  RADIUS_PACKET *reply   = rad_alloc (0);
+  RADIUS_PACKET *packet  = rad_alloc (0);
+  unsigned long i;
+
+  rad_encode (request, NULL, RADBENCH_SECRET);
+  rad_sign (request, NULL, RADBENCH_SECRET);
+
+  reply->code = PW_AUTHENTICATION_ACK;
+  reply->id   = request->id;
+  reply_attrs (&reply->vps);
+
+  rad_encode (reply, request, RADBENCH_SECRET);
+  rad_sign (reply, request, RADBENCH_SECRET);
+
+  /* What rad_recv would have handed over */
+  packet->code     = reply->code;
+  packet->id       = reply->id;
+  packet->data_len = reply->data_len;
+  packet->data     = malloc (reply->data_len);
+  memcpy (packet->data, reply->data, reply->data_len);
+
+  bench_begin ();
+  for (i = 0; i < n; i++)
+    {
+      pairfree (&packet->vps);
+
+      if ((rad_verify (packet, request, RADBENCH_SECRET) < 0) ||
+          (rad_decode (packet, request, RADBENCH_SECRET) < 0))
+        {
+          bench.counting = 0;
+          fprintf (stderr, "verify_decode: %s\n", fr_strerror ());
+          goto done;
+        }
+    }
+  bench_end ();
+
+  bench_report ("verify_decode", n);
+
+done:
+  bench_reset ();
+  rad_free (&packet);
+  rad_free (&reply);
+  rad_free (&request);
+}
+
+/* Lua benchmarks */
+
+static int
+bench_lua (const char *script, const char *snapshot, unsigned long n)
+{
+  lua_State *L = luaL_newstate ();
+  int res = 0;
+
+  luaL_openlibs (L);
+
+  lua_newtable (L);
+  lua_pushcfunction (L, lua_bench_run);
+  lua_setfield (L, -2, "run");
+  lua_pushinteger (L, bench.port);
+  lua_setfield (L, -2, "port");
+  lua_pushstring (L, RADBENCH_SECRET);
+  lua_setfield (L, -2, "secret");
+  lua_pushnumber (L, n);
+  lua_setfield (L, -2, "iterations");
+  lua_pushstring (L, snapshot);
+  lua_setfield (L, -2, "snapshot");
+  lua_setglobal (L, "radbench");
+
+  if (luaL_dofile (L, script) != 0)
+    {
+      fprintf (stderr, "%s\n", lua_tostring (L, -1));
+      res = -1;
+    }
+
+  lua_close (L);
+
+  return res;
+}
+
+/**
+ * radbench.run (name, iterations, fn) times fn (iterations), which does
+ * the looping itself.
+ **/
+static int
+lua_bench_run (lua_State *L)
+{
+  const char *name = luaL_checkstring (L, 1);
+  lua_Number  n    = luaL_checknumber (L, 2);
+
+  luaL_checktype (L, 3, LUA_TFUNCTION);
+
+  if (n < 1)
+    n = 1;
+
+  lua_pushvalue (L, 3);
+  lua_pushnumber (L, (unsigned long) n);
+
+  bench_begin ();
+  lua_call (L, 1, 0);
+  bench_end ();
+
+  bench_report (name, (unsigned long) n);
+
+  return 0;
+}
+
+/* In-process server, answers every request with an accept */
+
+static RADIUS_PACKET *
+request_new (void)
+{
+  RADIUS_PACKET *request = rad_alloc (1);
+
+  request->code = PW_AUTHENTICATION_REQUEST;
+  request->id   = 1;
+  ip_hton ("127.0.0.1", AF_INET, &request->dst_ipaddr);
+  request->dst_port = PW_AUTH_UDP_PORT;
+
+  pairadd (&request->vps, pairmake ("User-Name", "bench", T_OP_EQ));
+  pairadd (&request->vps, pairmake ("User-Password", "bench", T_OP_EQ));
+  pairadd (&request->vps, pairmake ("NAS-IP-Address", "192.168.1.1",
+                                    T_OP_EQ));
+  pairadd (&request->vps, pairmake ("NAS-Port", "42", T_OP_EQ));
+  pairadd (&request->vps, pairmake ("Service-Type", "Framed-User",
+                                    T_OP_EQ));
+  pairadd (&request->vps, pairmake ("Called-Station-Id",
+                                    "00-11-22-33-44-55:bench", T_OP_EQ));
+  pairadd (&request->vps, pairmake ("Calling-Station-Id",
+                                    "66-77-88-99-AA-BB", T_OP_EQ));
+
+  return request;
+}
+
+static void
+reply_attrs (VALUE_PAIR **vps)
+{
+  pairadd (vps, pairmake ("Reply-Message", "Welcome", T_OP_EQ));
+  pairadd (vps, pairmake ("Session-Timeout", "3600", T_OP_EQ));
+  pairadd (vps, pairmake ("Idle-Timeout", "600", T_OP_EQ));
+  pairadd (vps, pairmake ("Framed-IP-Address", "10.0.0.1", T_OP_EQ));
+  pairadd (vps, pairmake ("Class", "bench", T_OP_EQ));
+}
+
+static int
+responder_start (void)
+{
+  static int sockfd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  fr_ipaddr_t ipaddr;
+  pthread_t thread;
+
+  ip_hton ("127.0.0.1", AF_INET, &ipaddr);
+
+  sockfd = fr_socket (&ipaddr, 0);
+  if ((sockfd < 0) ||
+      (getsockname (sockfd, (struct sockaddr *) &addr, &addr_len) < 0))
+    {
+      fprintf (stderr, "Could not create the responder socket\n");
+      return -1;
+    }
+
+  bench.port = ntohs (((struct sockaddr_in *) &addr)->sin_port);
+
+  if (pthread_create (&thread, NULL, responder, &sockfd) != 0)
+    return -1;
+
+  pthread_detach (thread);
+
+  return 0;
+}
+
+static void *
+responder (void *arg)
+{
+  int sockfd = *(int *) arg;
+  RADIUS_PACKET *request = NULL;
+  RADIUS_PACKET *reply   = NULL;
+
+  for (;;)
+    {
+      request = rad_recv (sockfd, 0);
+      if (!request)
+        continue;
+
+      reply = rad_alloc (0);
+      reply->sockfd     = sockfd;
+      reply->code       = request->code == PW_AUTHENTICATION_REQUEST ?
+                            PW_AUTHENTICATION_ACK : PW_ACCOUNTING_RESPONSE;
+      reply->id         = request->id;
+      reply->src_ipaddr = request->dst_ipaddr;
+      reply->src_port   = request->dst_port;
+      reply->dst_ipaddr = request->src_ipaddr;
+      reply->dst_port   = request->src_port;
+
+      if (reply->code == PW_AUTHENTICATION_ACK)
+        reply_attrs (&reply->vps);
+
+      rad_send (reply, request, RADBENCH_SECRET);
+
+      rad_free (&reply);
+      rad_free (&request);
+    }
+
+  return NULL;
+}
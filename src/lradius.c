@@ -21,12 +21,31 @@
 #include <lauxlib.h>
 #include "lradius.h"
 #include "radiusclient.h"
+#include "radiusacct.h"
+#include "radiuscache.h"
+#include "radiusdest.h"
+#include "radiuspacer.h"
+#include "radiusproxy.h"
+#include "radiusdispatch.h"
+#include "radiusshard.h"
+#include "radiusserver.h"
+#include "radiusdict.h"
 
 /**
  * LUA Helper
  */
 
-static void setfield (lua_State *L, const char *index, const char *value);
+static void     setfield   (lua_State *L, const char *index,
+                            const char *value);
+static uint64_t getcounter (lua_State *L, int index, const char *field);
+static int      getintfield (lua_State *L, int index, const char *field,
+                             int def);
+static lua_Number getnumfield (lua_State *L, int index, const char *field,
+                               lua_Number def);
+static void     setnumfield (lua_State *L, const char *index,
+                             lua_Number value);
+static void     setintfield (lua_State *L, const char *index, int value);
+static RADIUSServer *server_arg (lua_State *L, int index);
 
 /**
  * LUA RADIUS API
@@ -36,23 +55,98 @@ static void setfield (lua_State *L, const char *index, const char *value);
 static int  lradius_server_set (lua_State *L, const char *name);
 static int  lradius_attr_set   (lua_State *L, const char *name);
 static int  lradius_attr_get   (lua_State *L, const char *name);
+static int  lradius_attr_set_raw (lua_State *L, const char *name);
 static void lradius_cleanup    (lua_State *L);
 
 static int
 lradius_server_set (lua_State *L, const char *name)
 {
   RADIUSClientCtrl *c  = NULL;
-  const char *hostname = luaL_checkstring (L, 2);
-  int         port     = lua_tointeger (L, 3);
-  const char *secret   = luaL_checkstring (L, 4);
+  RADIUSServer **server = NULL;
+  const char *hostname = NULL;
+  int         port     = 0;
+  const char *secret   = NULL;
+  int         opts     = 5;
 
   if (!name)
     return 0;
 
   c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, name);
 
+  /* setServer (server [, options]) shares a radius.server object */
+  if (lua_isuserdata (L, 2))
+    {
+      server = (RADIUSServer **)luaL_checkudata (L, 2, LUARADIUS_SERVERNAME);
+      opts = 3;
+    }
+  else
+    {
+      hostname = luaL_checkstring (L, 2);
+      port     = lua_tointeger (L, 3);
+      secret   = luaL_checkstring (L, 4);
+    }
+
+  if (lua_istable (L, opts))
+    {
+      const char *transport = NULL;
+      const char *ca   = NULL;
+      const char *cert = NULL;
+      const char *key  = NULL;
+      int verify = 1;
+
+      lua_getfield (L, opts, "transport");
+      transport = lua_tostring (L, -1);
+      lua_getfield (L, opts, "ca");
+      ca = lua_tostring (L, -1);
+      lua_getfield (L, opts, "cert");
+      cert = lua_tostring (L, -1);
+      lua_getfield (L, opts, "key");
+      key = lua_tostring (L, -1);
+      lua_getfield (L, opts, "verify");
+      if (lua_isboolean (L, -1))
+        verify = lua_toboolean (L, -1);
+
+      if (radclient_transport_set (c, transport, ca, cert, key, verify) ==
+            RADIUSCLIENT_ERR)
+        return luaL_error (L, LUARADIUS_PREFIX"unsupported transport '%s'",
+                           transport);
+
+      lua_pop (L, 5);
+
+      lua_getfield (L, opts, "src");
+      if ((!lua_isnil (L, -1) || (getintfield (L, opts, "src_port", 0) > 0)) &&
+          (radclient_source_set (c, lua_tostring (L, -1),
+                                 getintfield (L, opts, "src_port", 0)) ==
+             RADIUSCLIENT_ERR))
+        return luaL_error (L, LUARADIUS_PREFIX"invalid source address");
+      lua_pop (L, 1);
+
+      /* shards = true or "cpu" for one shard per CPU */
+      lua_getfield (L, opts, "shards");
+      if (!lua_isnil (L, -1) &&
+          !(lua_isboolean (L, -1) && !lua_toboolean (L, -1)))
+        {
+          int flags = 0;
+
+          lua_getfield (L, opts, "reuseport");
+          if (lua_toboolean (L, -1))
+            flags |= RADSHARD_REUSEPORT;
+          lua_getfield (L, opts, "affinity");
+          if (lua_toboolean (L, -1))
+            flags |= RADSHARD_AFFINITY;
+          lua_pop (L, 2);
+
+          radclient_shards_set (c, lua_type (L, -1) == LUA_TNUMBER ?
+                                     lua_tointeger (L, -1) : 0, flags);
+        }
+      lua_pop (L, 1);
+    }
+
   lua_pushinteger (L, 1);
 
+  if (server)
+    return radclient_server_use (c, *server);
+
   return radclient_server_set (c, hostname, port, secret);
 }
 
@@ -61,13 +155,33 @@ lradius_attr_set (lua_State *L, const char *name)
 {
   RADIUSClientCtrl *c  = NULL;
   const char *attr  = luaL_checkstring (L, 2);
-  const char *value = luaL_checkstring (L, 3);
+  const char *value = NULL;
 
   c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, name);
 
+  /* Numbers go straight into the pair, no string round-trip */
+  if (lua_type (L, 3) == LUA_TNUMBER)
+    return radclient_attr_set_number (c, attr, lua_tonumber (L, 3));
+
+  value = luaL_checkstring (L, 3);
+
   return radclient_attr_set (c, attr, value);
 }
 
+static int
+lradius_attr_set_raw (lua_State *L, const char *name)
+{
+  RADIUSClientCtrl *c  = NULL;
+  const char *attr  = luaL_checkstring (L, 2);
+  const char *value = NULL;
+  size_t      len   = 0;
+
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, name);
+  value = luaL_checklstring (L, 3, &len);
+
+  return radclient_attr_set_octets (c, attr, (const uint8_t *) value, len);
+}
+
 static int
 lradius_attr_get (lua_State *L, const char *name)
 {
@@ -94,6 +208,33 @@ lradius_attr_get (lua_State *L, const char *name)
   return 1;
 }
 
+static int
+auth_attr_get_value (lua_State *L)
+{
+  RADIUSClientCtrl *c  = NULL;
+  const char *attr = luaL_checkstring (L, 2);
+  const uint8_t *octets = NULL;
+  size_t octets_len = 0;
+  double number = 0;
+  int    kind   = 0;
+
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, LUARADIUS_AUTHNAME);
+
+  if (radclient_attr_get_value (c, attr, &kind, &number,
+        &octets, &octets_len) != RADIUSCLIENT_OK)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+
+  if (kind == RADIUSCLIENT_VALUE_NUMBER)
+    lua_pushnumber (L, number);
+  else
+    lua_pushlstring (L, (const char *) octets, octets_len);
+
+  return 1;
+}
+
 static void
 lradius_cleanup (lua_State *L)
 {
@@ -157,6 +298,12 @@ auth_attr_get (lua_State *L)
   return lradius_attr_get (L, LUARADIUS_AUTHNAME);
 }
 
+static int
+auth_attr_set_raw (lua_State *L)
+{
+  return lradius_attr_set_raw (L, LUARADIUS_AUTHNAME);
+}
+
 static int
 auth_username_set (lua_State *L)
 {
@@ -219,6 +366,17 @@ auth_get_last_err_msg (lua_State *L)
   return 1;
 }
 
+static int
+auth_get_last_err_code (lua_State *L)
+{
+  RADIUSClientCtrl *c = NULL;
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, LUARADIUS_AUTHNAME);
+
+  lua_pushinteger (L, radclient_get_last_err_code (c));
+
+  return 1;
+}
+
 static int
 auth_gc (lua_State *L)
 {
@@ -226,6 +384,81 @@ auth_gc (lua_State *L)
   return 1;
 }
 
+/**
+ * AUTH CACHE API
+ */
+
+static int
+cache_fconfigure (lua_State *L)
+{
+  const char *attrs[RADCACHE_MAX_KEY_ATTRS];
+  size_t n = 0;
+  int res;
+
+  if (!lua_istable (L, 1))
+    {
+      /* Anything but a table turns the cache off */
+      res = radcache_configure (0, 0, 0, 0, NULL, 0);
+      lua_pushinteger (L, res == RADIUSCLIENT_OK ? 1 : 0);
+      return 1;
+    }
+
+  lua_getfield (L, 1, "attributes");
+  if (lua_istable (L, -1))
+    {
+      for (n = 0; n < RADCACHE_MAX_KEY_ATTRS; n++)
+        {
+          lua_rawgeti (L, -1, n + 1);
+          if (lua_isnil (L, -1))
+            {
+              lua_pop (L, 1);
+              break;
+            }
+
+          if (lua_type (L, -1) != LUA_TSTRING)
+            return luaL_error (L, LUARADIUS_PREFIX"invalid attribute name");
+
+          attrs[n] = lua_tostring (L, -1);
+          lua_pop (L, 1);
+        }
+    }
+
+  res = radcache_configure (getintfield (L, 1, "ttl", 30),
+                            getintfield (L, 1, "reject_ttl", 0),
+                            getintfield (L, 1, "max_entries", 4096),
+                            getintfield (L, 1, "max_bytes", 0),
+                            attrs, n);
+
+  lua_pushinteger (L, res == RADIUSCLIENT_OK ? 1 : 0);
+  return 1;
+}
+
+static int
+cache_fstats (lua_State *L)
+{
+  RADIUSCacheStats stats;
+
+  radcache_stats (&stats);
+
+  lua_createtable (L, 0, 7);
+  setnumfield (L, "hits", stats.hits);
+  setnumfield (L, "misses", stats.misses);
+  setnumfield (L, "inserts", stats.inserts);
+  setnumfield (L, "evictions", stats.evictions);
+  setnumfield (L, "expired", stats.expired);
+  setnumfield (L, "entries", stats.entries);
+  setnumfield (L, "bytes", stats.bytes);
+
+  return 1;
+}
+
+static int
+cache_fflush (lua_State *L)
+{
+  radcache_flush ();
+  return 0;
+}
+
 /**
  * ACCT API
  */
@@ -283,6 +516,12 @@ acct_attr_set (lua_State *L)
   return lradius_attr_set (L, LUARADIUS_ACCTNAME);
 }
 
+static int
+acct_attr_set_raw (lua_State *L)
+{
+  return lradius_attr_set_raw (L, LUARADIUS_ACCTNAME);
+}
+
 static int
 acct_send (lua_State *L)
 {
@@ -301,6 +540,88 @@ acct_send (lua_State *L)
   return 1;
 }
 
+/**
+ * acct:setReplicas ({ server, ... }, "all" | "quorum" | "first") sends
+ * every accounting request to the replicas too, acct:setReplicas () stops.
+ */
+static int
+acct_replicas_set (lua_State *L)
+{
+  static const char *policies[] = { "all", "quorum", "first", NULL };
+  RADIUSClientCtrl *c = NULL;
+  RADIUSServer *server = NULL;
+  int res = RADIUSCLIENT_OK;
+  int i;
+
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, LUARADIUS_ACCTNAME);
+
+  radclient_replica_clear (c);
+
+  if (lua_isnoneornil (L, 2))
+    {
+      lua_pushinteger (L, res);
+      return 1;
+    }
+
+  luaL_checktype (L, 2, LUA_TTABLE);
+
+  for (i = 1; (res == RADIUSCLIENT_OK) && (i <= (int) lua_objlen (L, 2)); i++)
+    {
+      lua_rawgeti (L, 2, i);
+      server = server_arg (L, lua_gettop (L));
+      res = radclient_replica_add (c, server);
+      radserver_unref (server);
+      lua_pop (L, 1);
+    }
+
+  if (res == RADIUSCLIENT_OK)
+    res = radclient_replica_policy (c, luaL_checkoption (L, 3, "all",
+                                                         policies));
+
+  lua_pushinteger (L, res);
+
+  return 1;
+}
+
+/**
+ * Results of the last send per target, the server of the client first.
+ */
+static int
+acct_results_get (lua_State *L)
+{
+  static const char *states[] = { "pending", "ok", "failed" };
+  RADIUSClientCtrl *c = NULL;
+  RADIUSServer *server = NULL;
+  const char *errmsg = NULL;
+  char   host[INET6_ADDRSTRLEN];
+  int    state, code, i;
+  double rtt;
+
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, LUARADIUS_ACCTNAME);
+
+  lua_createtable (L, radclient_target_count (c), 0);
+
+  for (i = 0; i < radclient_target_count (c); i++)
+    {
+      if (radclient_target_result (c, i, &server, &state, &code, &errmsg,
+                                   &rtt) != RADIUSCLIENT_OK)
+        break;
+
+      ip_ntoh (radserver_ipaddr (server), host, sizeof (host));
+
+      lua_createtable (L, 0, 6);
+      setfield (L, "host", host);
+      setintfield (L, "port", radserver_port (server));
+      setfield (L, "state", states[state]);
+      setintfield (L, "code", code);
+      setfield (L, "msg", errmsg);
+      setnumfield (L, "rtt", rtt);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  return 1;
+}
+
 static int
 acct_en_debug (lua_State *L)
 {
@@ -323,6 +644,17 @@ acct_get_last_err_msg (lua_State *L)
   return 1;
 }
 
+static int
+acct_get_last_err_code (lua_State *L)
+{
+  RADIUSClientCtrl *c = NULL;
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, 1, LUARADIUS_ACCTNAME);
+
+  lua_pushinteger (L, radclient_get_last_err_code (c));
+
+  return 1;
+}
+
 static int
 acct_gc (lua_State *L)
 {
@@ -331,114 +663,1450 @@ acct_gc (lua_State *L)
 }
 
 /**
- * Lua Initailize
+ * ACCT SESSION API
  */
 
-LUARADIUS_API int
-luaradius_createmeta (lua_State *L, const char *name, const luaL_reg *methods)
+typedef struct {
+  RADIUSClientCtrl *c;
+  int               ref;
+} LuaRadiusSession;
+
+#define session_data(ls)  ((RADIUSAcctSession *) ((ls) + 1))
+
+/**
+ * radius.acct.session { acct = ..., username = ..., attributes = ... },
+ * nil when an attribute is unknown, encrypted or a Message-Authenticator.
+ */
+static int
+session_fnew (lua_State *L)
 {
-  if (!luaL_newmetatable (L, name))
-    return 0;
+  LuaRadiusSession *ls = NULL;
+  RADIUSClientCtrl *c  = NULL;
+  const char *attrs[LUARADIUS_SESSION_MAX_ATTRS];
+  const char *values[LUARADIUS_SESSION_MAX_ATTRS];
+  uint8_t buf[4096];
+  size_t buf_len = sizeof (buf);
+  size_t n = 0;
 
-  luaL_openlib (L, NULL, methods, 0);
+  luaL_checktype (L, 1, LUA_TTABLE);
 
-  lua_pushliteral (L, "__index");
-  lua_pushvalue (L, -2);
-  lua_settable (L, -3);
+  lua_getfield (L, 1, "acct");
+  c = (RADIUSClientCtrl *)luaL_checkudata (L, -1, LUARADIUS_ACCTNAME);
 
-  lua_pushliteral (L, "__metatable");
-  lua_pushliteral (L, LUARADIUS_PREFIX"you're not allowed to get this "
-                   "metatable");
-  lua_settable (L, -3);
+  lua_getfield (L, 1, "username");
+  if (!lua_isnil (L, -1))
+    {
+      attrs[n] = "User-Name";
+      values[n++] = luaL_checkstring (L, -1);
+    }
+
+  lua_getfield (L, 1, "session_id");
+  if (!lua_isnil (L, -1))
+    {
+      attrs[n] = "Acct-Session-Id";
+      values[n++] = luaL_checkstring (L, -1);
+    }
+
+  lua_getfield (L, 1, "attributes");
+  if (lua_istable (L, -1))
+    {
+      int t = lua_gettop (L);
+
+      luaL_checkstack (L, LUARADIUS_SESSION_MAX_ATTRS + 2,
+                       LUARADIUS_PREFIX"too many attributes");
+
+      lua_pushnil (L);
+      while (lua_next (L, t) != 0)
+        {
+          if (n >= LUARADIUS_SESSION_MAX_ATTRS)
+            return luaL_error (L, LUARADIUS_PREFIX"too many attributes");
+
+          if (lua_type (L, -2) != LUA_TSTRING)
+            return luaL_error (L, LUARADIUS_PREFIX"invalid attribute name");
+
+          /* Leave the value on the stack, it may be a converted number */
+          attrs[n]    = lua_tostring (L, -2);
+          values[n++] = luaL_checkstring (L, -1);
+          lua_pushvalue (L, -2);
+        }
+    }
+
+  if (radacct_attrs_encode (attrs, values, n, buf, &buf_len) ==
+        RADIUSCLIENT_ERR)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+
+  ls = (LuaRadiusSession *)lua_newuserdata (L, sizeof (LuaRadiusSession) +
+                                            radacct_session_size (buf_len));
+  ls->c   = NULL;
+  ls->ref = LUA_NOREF;
+
+  if (radacct_session_init (session_data (ls), buf, buf_len) ==
+        RADIUSCLIENT_ERR)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+
+  luaL_getmetatable (L, LUARADIUS_SESSIONNAME);
+  lua_setmetatable (L, -2);
+
+  /* Keep the accounting client alive as long as the session */
+  lua_getfield (L, 1, "acct");
+  ls->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  ls->c   = c;
 
   return 1;
 }
 
-LUARADIUS_API void
-luaradius_setmeta (lua_State *L, const char *name)
+static int
+session_start (lua_State *L)
 {
-  luaL_getmetatable (L, name);
-  lua_setmetatable (L, -2);
+  LuaRadiusSession *ls = NULL;
+  int res = RADIUSCLIENT_ERR;
+
+  ls = (LuaRadiusSession *)luaL_checkudata (L, 1, LUARADIUS_SESSIONNAME);
+
+  if (radacct_session_active (session_data (ls)))
+    return luaL_error (L, LUARADIUS_PREFIX"session is already started");
+
+  res = radacct_session_start (session_data (ls), ls->c);
+
+  lua_pushinteger (L, res == RADIUSCLIENT_OK ? 1 : 0);
+
+  return 1;
 }
 
-static void
-create_call_table (lua_State *L, const char *name, lua_CFunction creator,
-                   lua_CFunction starter)
+static int
+session_interim (lua_State *L)
 {
-  lua_createtable (L, 0, 1);
-  lua_pushcfunction (L, creator);
-  lua_setfield (L, -2, "new");
+  LuaRadiusSession *ls = NULL;
+  int res = RADIUSCLIENT_ERR;
 
-  lua_createtable (L, 0, 1);
-  lua_pushcfunction (L, starter);
-  lua_setfield (L, -2, "__call");
-  lua_setmetatable (L, -2);
-  lua_setfield (L, -2, name); 
+  ls = (LuaRadiusSession *)luaL_checkudata (L, 1, LUARADIUS_SESSIONNAME);
+
+  if (!radacct_session_active (session_data (ls)))
+    return luaL_error (L, LUARADIUS_PREFIX"session is not started");
+
+  res = radacct_session_interim (session_data (ls), ls->c,
+                                 getcounter (L, 2, "in_octets"),
+                                 getcounter (L, 2, "out_octets"));
+
+  lua_pushinteger (L, res == RADIUSCLIENT_OK ? 1 : 0);
+
+  return 1;
 }
 
-static void
-create_metatables (lua_State *L)
+static int
+session_stop (lua_State *L)
 {
-  struct luaL_reg core_functions[] = {
-    { NULL, NULL }
-  };
+  LuaRadiusSession *ls = NULL;
+  int res   = RADIUSCLIENT_ERR;
+  int cause = 0;
 
-  struct luaL_reg auth_methods[] = {
-    { "__gc", auth_gc },
-    { "setServer", auth_server_set },
-    { "setUsername", auth_username_set },
-    { "setPassword", auth_password_set },
-    { "setAttribute", auth_attr_set },
-    { "getAttribute", auth_attr_get },
-    { "send", auth_send },
-    { "enableDebug", auth_en_debug },
-    { "getLastErrMsg", auth_get_last_err_msg }, 
-    { NULL, NULL }
-  };
+  ls = (LuaRadiusSession *)luaL_checkudata (L, 1, LUARADIUS_SESSIONNAME);
 
-  struct luaL_reg acct_methods[] = {
-    { "__gc", acct_gc },
-    { "setServer", acct_server_set },
-    { "setUsername", acct_username_set },
-    { "setAttribute", acct_attr_set },
-    { "send", acct_send },
-    { "enableDebug", acct_en_debug },
-    { "getLastErrMsg", acct_get_last_err_msg },
-    { NULL, NULL }
-  };
+  if (!radacct_session_active (session_data (ls)))
+    return luaL_error (L, LUARADIUS_PREFIX"session is not started");
 
-  luaL_register (L, LUARADIUS_CORENAME, core_functions);
+  if (lua_istable (L, 2))
+    {
+      lua_getfield (L, 2, "cause");
+      if (lua_type (L, -1) == LUA_TNUMBER)
+        cause = lua_tointeger (L, -1);
+      else if (lua_isstring (L, -1))
+        cause = radacct_cause_value (lua_tostring (L, -1));
+      lua_pop (L, 1);
+    }
 
-#define CALLTABLE(n) create_call_table (L, #n, n##_fnew, n##_f##n)
-  CALLTABLE(auth);
-  CALLTABLE(acct);
+  res = radacct_session_stop (session_data (ls), ls->c,
+                              getcounter (L, 2, "in_octets"),
+                              getcounter (L, 2, "out_octets"), cause);
 
-  luaradius_createmeta (L, LUARADIUS_AUTHNAME, auth_methods);
-  luaradius_createmeta (L, LUARADIUS_ACCTNAME, acct_methods);
+  lua_pushinteger (L, res == RADIUSCLIENT_OK ? 1 : 0);
 
-  lua_pop (L, 3);
+  return 1;
 }
 
-LUARADIUS_API int
-luaopen_radius (lua_State *L)
+static int
+session_gc (lua_State *L)
 {
-  struct luaL_reg core[] = {
-    {NULL, NULL},
-  };
+  LuaRadiusSession *ls = NULL;
 
-  create_metatables (L);
-  luaL_openlib (L, LUARADIUS_CORENAME, core, 0);
-  
-  return 1;
+  ls = (LuaRadiusSession *)luaL_checkudata (L, 1, LUARADIUS_SESSIONNAME);
+
+  luaL_unref (L, LUA_REGISTRYINDEX, ls->ref);
+  ls->ref = LUA_NOREF;
+  ls->c   = NULL;
+
+  return 0;
 }
 
 /**
- * LUA Helper implementation
+ * SERVER API
  */
-static void
-setfield (lua_State *L, const char *index, const char *value)
+
+static int
+server_fnew (lua_State *L)
 {
-  lua_pushstring (L, index);
-  lua_pushstring (L, value);
+  RADIUSServer **server = NULL;
+  const char *hostname = NULL;
+  const char *secret   = NULL;
+  const char *errmsg   = NULL;
+  int port;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  lua_getfield (L, 1, "host");
+  hostname = luaL_checkstring (L, -1);
+  lua_getfield (L, 1, "secret");
+  secret = luaL_checkstring (L, -1);
+  port = getintfield (L, 1, "port", 0);
+
+  server = (RADIUSServer **)lua_newuserdata (L, sizeof (RADIUSServer *));
+  *server = radserver_new (hostname, port, secret,
+                           strchr (hostname, ':') ? AF_INET6 : AF_INET,
+                           &errmsg);
+  if (!*server)
+    return luaL_error (L, LUARADIUS_PREFIX"%s", errmsg);
+
+  luaL_getmetatable (L, LUARADIUS_SERVERNAME);
+  lua_setmetatable (L, -2);
+
+  return 1;
+}
+
+/**
+ * A radius.server or a { host, port, secret } table, returned with a
+ * reference the caller has to drop.
+ */
+static RADIUSServer *
+server_arg (lua_State *L, int index)
+{
+  RADIUSServer *server = NULL;
+  const char *hostname = NULL;
+  const char *errmsg = NULL;
+
+  if (lua_isuserdata (L, index))
+    return radserver_ref (*(RADIUSServer **) luaL_checkudata (L, index,
+                            LUARADIUS_SERVERNAME));
+
+  luaL_checktype (L, index, LUA_TTABLE);
+
+  lua_getfield (L, index, "host");
+  lua_getfield (L, index, "secret");
+  hostname = luaL_checkstring (L, -2);
+  server = radserver_new (hostname, getintfield (L, index, "port", 0),
+                          luaL_checkstring (L, -1),
+                          strchr (hostname, ':') ? AF_INET6 : AF_INET,
+                          &errmsg);
+  lua_pop (L, 2);
+
+  if (!server)
+    luaL_error (L, LUARADIUS_PREFIX"%s", errmsg);
+
+  return server;
+}
+
+static int
+server_gc (lua_State *L)
+{
+  RADIUSServer **server = NULL;
+
+  server = (RADIUSServer **)luaL_checkudata (L, 1, LUARADIUS_SERVERNAME);
+
+  /* Clients using the server keep their own reference */
+  radserver_unref (*server);
+  *server = NULL;
+
+  return 0;
+}
+
+/**
+ * DICTIONARY API
+ */
+
+/**
+ * radius.dictionary { dir = ..., file = ..., snapshot = ... } picks the
+ * dictionary loaded by the first client, radius.dictionary () describes
+ * the loaded one.
+ */
+static int
+dictionary_fconfigure (lua_State *L)
+{
+  RADIUSDictInfo info;
+  char hash[17];
+
+  if (lua_istable (L, 1))
+    {
+      lua_getfield (L, 1, "dir");
+      lua_getfield (L, 1, "file");
+      lua_getfield (L, 1, "snapshot");
+
+      raddict_configure (luaL_optstring (L, -3, NULL),
+                         luaL_optstring (L, -2, NULL),
+                         luaL_optstring (L, -1, NULL));
+      lua_pop (L, 3);
+      return 0;
+    }
+
+  raddict_info (&info);
+
+  lua_newtable (L);
+  lua_pushstring (L, "loaded");
+  lua_pushboolean (L, info.loaded);
+  lua_settable (L, -3);
+
+  if (info.snapshot)
+    {
+      snprintf (hash, sizeof (hash), "%016llx",
+                (unsigned long long) info.hash);
+
+      setfield (L, "snapshot", info.snapshot);
+      setfield (L, "hash", hash);
+      setintfield (L, "vendors", info.vendors);
+      setintfield (L, "attributes", info.attrs);
+      setintfield (L, "values", info.values);
+    }
+
+  return 1;
+}
+
+/**
+ * CIRCUIT BREAKER API
+ */
+
+typedef struct {
+  RADIUSDestInfo *infos;
+  int             count;
+  int             size;
+} LuaRadiusDestSnapshot;
+
+static void
+dest_count (RADIUSDest *d, void *arg)
+{
+  (*(int *) arg)++;
+}
+
+static void
+dest_snapshot_add (RADIUSDest *d, void *arg)
+{
+  LuaRadiusDestSnapshot *snap = (LuaRadiusDestSnapshot *) arg;
+
+  if (snap->count < snap->size)
+    raddest_info (d, &snap->infos[snap->count++]);
+}
+
+/**
+ * Copy the state of every destination into a userdata left on the stack.
+ * No Lua call may run under the registry lock, an error would leave it
+ * locked for good.
+ **/
+static RADIUSDestInfo *
+dest_snapshot (lua_State *L, int *count)
+{
+  LuaRadiusDestSnapshot snap;
+
+  snap.size = 0;
+  raddest_foreach (dest_count, &snap.size);
+
+  snap.infos = (RADIUSDestInfo *)lua_newuserdata (L, snap.size *
+                                                  sizeof (RADIUSDestInfo));
+  snap.count = 0;
+  raddest_foreach (dest_snapshot_add, &snap);
+
+  *count = snap.count;
+
+  return snap.infos;
+}
+
+static void
+breaker_push_info (lua_State *L, const RADIUSDestInfo *info)
+{
+  lua_createtable (L, 0, 7);
+  setfield (L, "host", info->host);
+  setintfield (L, "port", info->port);
+  setfield (L, "state", raddest_state_name (info->state));
+  setintfield (L, "failures", info->failures);
+  setnumfield (L, "trips", info->trips);
+  setnumfield (L, "rejected", info->rejected);
+  setnumfield (L, "changed", info->changed);
+}
+
+static int
+breaker_fconfigure (lua_State *L)
+{
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  raddest_breaker_configure (getintfield (L, 1, "threshold", 5),
+                             getintfield (L, 1, "cooldown", 30));
+
+  return 0;
+}
+
+static int
+breaker_fstate (lua_State *L)
+{
+  const char *host = luaL_checkstring (L, 1);
+  int         port = luaL_checkint (L, 2);
+  RADIUSDest *d    = raddest_lookup (host, port);
+  RADIUSDestInfo info;
+
+  if (d)
+    {
+      raddest_info (d, &info);
+      breaker_push_info (L, &info);
+    }
+  else
+    lua_pushnil (L);
+
+  return 1;
+}
+
+static int
+breaker_flist (lua_State *L)
+{
+  RADIUSDestInfo *infos = NULL;
+  int count, i;
+
+  infos = dest_snapshot (L, &count);
+
+  lua_createtable (L, count, 0);
+  for (i = 0; i < count; i++)
+    {
+      breaker_push_info (L, &infos[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  lua_remove (L, -2);
+
+  return 1;
+}
+
+/**
+ * CONCURRENCY LIMIT API
+ */
+
+static void
+limiter_push_info (lua_State *L, const RADIUSDestInfo *info)
+{
+  lua_createtable (L, 0, 8);
+  setfield (L, "host", info->host);
+  setintfield (L, "port", info->port);
+  setnumfield (L, "limit", info->limit);
+  setintfield (L, "inflight", info->inflight);
+  setintfield (L, "queued", info->queued);
+  setnumfield (L, "rtt", info->rtt);
+  setnumfield (L, "rtt_base", info->rtt_base);
+  setnumfield (L, "limited", info->limited);
+}
+
+/**
+ * radius.limiter.configure{initial=, min=, max=, tolerance=, backoff=,
+ *                          policy="queue"|"fail", max_wait=}
+ * An initial limit of 0 disables it. Missing fields keep the current value.
+ **/
+static int
+limiter_fconfigure (lua_State *L)
+{
+  /* In the order of RADDEST_LIMIT_QUEUE and RADDEST_LIMIT_FAIL */
+  static const char *policies[] = { "queue", "fail", NULL };
+  RADIUSDestLimitConfig config;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  raddest_limit_config_default (&config);
+
+  config.initial   = getintfield (L, 1, "initial", config.initial);
+  config.min       = getintfield (L, 1, "min", config.min);
+  config.max       = getintfield (L, 1, "max", config.max);
+  config.tolerance = getnumfield (L, 1, "tolerance", config.tolerance);
+  config.backoff   = getnumfield (L, 1, "backoff", config.backoff);
+  config.max_wait  = getintfield (L, 1, "max_wait", config.max_wait);
+
+  lua_getfield (L, 1, "policy");
+  if (!lua_isnil (L, -1))
+    config.policy = luaL_checkoption (L, lua_gettop (L), NULL, policies);
+  lua_pop (L, 1);
+
+  raddest_limit_configure (&config);
+
+  return 0;
+}
+
+static int
+limiter_fstats (lua_State *L)
+{
+  const char *host = luaL_checkstring (L, 1);
+  int         port = luaL_checkint (L, 2);
+  RADIUSDest *d    = raddest_lookup (host, port);
+  RADIUSDestInfo info;
+
+  if (d)
+    {
+      raddest_info (d, &info);
+      limiter_push_info (L, &info);
+    }
+  else
+    lua_pushnil (L);
+
+  return 1;
+}
+
+static int
+limiter_flist (lua_State *L)
+{
+  RADIUSDestInfo *infos = NULL;
+  int count, i;
+
+  infos = dest_snapshot (L, &count);
+
+  lua_createtable (L, count, 0);
+  for (i = 0; i < count; i++)
+    {
+      limiter_push_info (L, &infos[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  lua_remove (L, -2);
+
+  return 1;
+}
+
+/**
+ * PACER API
+ */
+
+typedef struct {
+  RADIUSPacerInfo *infos;
+  int              count;
+  int              size;
+} LuaRadiusPacerSnapshot;
+
+static void
+pacer_count (RADIUSPacer *p, void *arg)
+{
+  (*(int *) arg)++;
+}
+
+static void
+pacer_snapshot_add (RADIUSPacer *p, void *arg)
+{
+  LuaRadiusPacerSnapshot *snap = (LuaRadiusPacerSnapshot *) arg;
+
+  if (snap->count < snap->size)
+    radpacer_info (p, &snap->infos[snap->count++]);
+}
+
+/* Same as dest_snapshot, for the pacers */
+static RADIUSPacerInfo *
+pacer_snapshot (lua_State *L, int *count)
+{
+  LuaRadiusPacerSnapshot snap;
+
+  snap.size = 0;
+  radpacer_foreach (pacer_count, &snap.size);
+
+  snap.infos = (RADIUSPacerInfo *)lua_newuserdata (L, snap.size *
+                                                   sizeof (RADIUSPacerInfo));
+  snap.count = 0;
+  radpacer_foreach (pacer_snapshot_add, &snap);
+
+  *count = snap.count;
+
+  return snap.infos;
+}
+
+static void
+pacer_push_info (lua_State *L, const RADIUSPacerInfo *info)
+{
+  int cls;
+
+  lua_createtable (L, 0, 4 + RADPACER_CLASSES);
+  setfield (L, "host", info->host);
+  setnumfield (L, "rate", info->rate);
+  setintfield (L, "burst", info->burst);
+  setnumfield (L, "tokens", info->tokens);
+
+  for (cls = 0; cls < RADPACER_CLASSES; cls++)
+    {
+      lua_createtable (L, 0, 3);
+      setintfield (L, "queued", info->queued[cls]);
+      setnumfield (L, "sent", info->sent[cls]);
+      setnumfield (L, "shed", info->shed[cls]);
+      lua_setfield (L, -2, radpacer_class_name (cls));
+    }
+}
+
+/**
+ * radius.pacer.configure{host=, rate=, burst=, max_wait=,
+ *                        queue={auth=, stop=, start=, interim=}}
+ * Without host it changes the default of every server. Missing fields keep
+ * the default.
+ **/
+static int
+pacer_fconfigure (lua_State *L)
+{
+  RADIUSPacerConfig config;
+  const char *host;
+  int cls;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  radpacer_config_default (&config);
+
+  lua_getfield (L, 1, "host");
+  host = lua_tostring (L, -1);
+  lua_pop (L, 1);
+
+  config.rate     = getnumfield (L, 1, "rate", config.rate);
+  config.burst    = getintfield (L, 1, "burst", config.burst);
+  config.max_wait = getintfield (L, 1, "max_wait", config.max_wait);
+
+  lua_getfield (L, 1, "queue");
+  if (lua_istable (L, -1))
+    {
+      for (cls = 0; cls < RADPACER_CLASSES; cls++)
+        config.queue[cls] = getintfield (L, -1, radpacer_class_name (cls),
+                                         config.queue[cls]);
+    }
+  lua_pop (L, 1);
+
+  lua_pushboolean (L, radpacer_configure (host, &config));
+
+  return 1;
+}
+
+static int
+pacer_fstats (lua_State *L)
+{
+  RADIUSPacer *p = radpacer_lookup (luaL_checkstring (L, 1));
+  RADIUSPacerInfo info;
+
+  if (p)
+    {
+      radpacer_info (p, &info);
+      pacer_push_info (L, &info);
+    }
+  else
+    lua_pushnil (L);
+
+  return 1;
+}
+
+static int
+pacer_flist (lua_State *L)
+{
+  RADIUSPacerInfo *infos = NULL;
+  int count, i;
+
+  infos = pacer_snapshot (L, &count);
+
+  lua_createtable (L, count, 0);
+  for (i = 0; i < count; i++)
+    {
+      pacer_push_info (L, &infos[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  lua_remove (L, -2);
+
+  return 1;
+}
+
+/**
+ * PROXY API
+ */
+
+#define LUARADIUS_PROXY_ERRMSG_SIZE  256
+
+typedef struct {
+  RADIUSProxyRequest *req;
+} LuaRadiusProxyRequest;
+
+typedef struct {
+  RADIUSProxy           *p;
+  lua_State             *L;
+  LuaRadiusProxyRequest *lreq;
+  int                    hook_ref;
+  int                    req_ref;
+  char                   errmsg[LUARADIUS_PROXY_ERRMSG_SIZE];
+} LuaRadiusProxy;
+
+/**
+ * The hook gets the same request object for every packet, it is only
+ * usable while the hook runs. Returning false drops the request, a number
+ * picks the upstream, anything else lets the proxy balance. A hook that
+ * raises an error drops the request too, counted apart in hook_errors.
+ **/
+static int
+proxy_hook (RADIUSProxyRequest *req, void *arg)
+{
+  LuaRadiusProxy *lp = (LuaRadiusProxy *) arg;
+  lua_State *L = lp->L;
+  int route = RADPROXY_ROUTE_DEFAULT;
+
+  lua_rawgeti (L, LUA_REGISTRYINDEX, lp->hook_ref);
+  lua_rawgeti (L, LUA_REGISTRYINDEX, lp->req_ref);
+
+  lp->lreq->req = req;
+
+  if (lua_pcall (L, 1, 1, 0) != 0)
+    {
+      snprintf (lp->errmsg, sizeof (lp->errmsg), "%s", lua_tostring (L, -1));
+      lp->lreq->req = NULL;
+      lua_pop (L, 1);
+      return RADPROXY_ROUTE_ERROR;
+    }
+
+  lp->lreq->req = NULL;
+
+  if (lua_type (L, -1) == LUA_TNUMBER)
+    route = lua_tointeger (L, -1) - 1;
+  else if (lua_isboolean (L, -1) && !lua_toboolean (L, -1))
+    route = RADPROXY_ROUTE_DROP;
+
+  lua_pop (L, 1);
+
+  return route;
+}
+
+static int
+proxy_upstream_add (lua_State *L, LuaRadiusProxy *lp, int index)
+{
+  RADIUSServer *server = server_arg (L, index);
+  int res;
+
+  res = radproxy_upstream_add (lp->p, server);
+  radserver_unref (server);
+
+  return res;
+}
+
+/**
+ * radius.proxy { listen = ..., port = ..., secret = ..., batch = ...,
+ *                timeout = ..., upstreams = { ... }, hook = function }
+ */
+static int
+proxy_fnew (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  const char *listen = NULL;
+  const char *secret = NULL;
+  const char *errmsg = NULL;
+  int upstreams, i;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  lua_getfield (L, 1, "listen");
+  listen = lua_tostring (L, -1);
+  lua_getfield (L, 1, "secret");
+  secret = luaL_checkstring (L, -1);
+
+  lua_getfield (L, 1, "upstreams");
+  luaL_checktype (L, -1, LUA_TTABLE);
+  upstreams = lua_gettop (L);
+
+  lp = (LuaRadiusProxy *)lua_newuserdata (L, sizeof (LuaRadiusProxy));
+  memset (lp, 0, sizeof (LuaRadiusProxy));
+  lp->hook_ref = LUA_NOREF;
+  lp->req_ref  = LUA_NOREF;
+
+  luaL_getmetatable (L, LUARADIUS_PROXYNAME);
+  lua_setmetatable (L, -2);
+
+  lp->p = radproxy_new (listen, getintfield (L, 1, "port", 1812), secret,
+                        getintfield (L, 1, "batch", 0),
+                        getnumfield (L, 1, "timeout", 5) * 1000, &errmsg);
+  if (!lp->p)
+    return luaL_error (L, LUARADIUS_PREFIX"%s", errmsg);
+
+  for (i = 1; i <= (int) lua_objlen (L, upstreams); i++)
+    {
+      lua_rawgeti (L, upstreams, i);
+      if (proxy_upstream_add (L, lp, lua_gettop (L)) == RADIUSCLIENT_ERR)
+        return luaL_error (L, LUARADIUS_PREFIX"cannot add upstream %d", i);
+      lua_pop (L, 1);
+    }
+
+  lua_getfield (L, 1, "hook");
+  if (lua_isfunction (L, -1))
+    {
+      lp->hook_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+      lp->lreq = (LuaRadiusProxyRequest *)lua_newuserdata (L,
+                   sizeof (LuaRadiusProxyRequest));
+      lp->lreq->req = NULL;
+      luaL_getmetatable (L, LUARADIUS_PROXYREQNAME);
+      lua_setmetatable (L, -2);
+      lp->req_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+      radproxy_hook_set (lp->p, proxy_hook, lp);
+    }
+  else
+    lua_pop (L, 1);
+
+  return 1;
+}
+
+/**
+ * proxy:run (timeout) waits up to timeout seconds, forever without one,
+ * and handles what arrived. Returns the number of packets received.
+ */
+static int
+proxy_run (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  int timeout = -1;
+
+  lp = (LuaRadiusProxy *)luaL_checkudata (L, 1, LUARADIUS_PROXYNAME);
+
+  if (lua_type (L, 2) == LUA_TNUMBER)
+    timeout = lua_tonumber (L, 2) * 1000;
+
+  lp->L = L;
+  lua_pushinteger (L, radproxy_run (lp->p, timeout));
+  lp->L = NULL;
+
+  return 1;
+}
+
+static int
+proxy_port (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  lp = (LuaRadiusProxy *)luaL_checkudata (L, 1, LUARADIUS_PROXYNAME);
+
+  lua_pushinteger (L, radproxy_port (lp->p));
+
+  return 1;
+}
+
+static int
+proxy_stats (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  RADIUSProxyStats stats;
+
+  lp = (LuaRadiusProxy *)luaL_checkudata (L, 1, LUARADIUS_PROXYNAME);
+
+  radproxy_stats (lp->p, &stats);
+
+  lua_createtable (L, 0, 9);
+  setintfield (L, "upstreams", radproxy_upstreams (lp->p));
+  setnumfield (L, "received", stats.received);
+  setnumfield (L, "forwarded", stats.forwarded);
+  setnumfield (L, "replied", stats.replied);
+  setnumfield (L, "dropped", stats.dropped);
+  setnumfield (L, "hook_errors", stats.hook_errors);
+  setnumfield (L, "invalid", stats.invalid);
+  setnumfield (L, "busy", stats.busy);
+  setnumfield (L, "timeouts", stats.timeouts);
+
+  return 1;
+}
+
+static int
+proxy_get_last_err_msg (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  lp = (LuaRadiusProxy *)luaL_checkudata (L, 1, LUARADIUS_PROXYNAME);
+
+  lua_pushstring (L, lp->errmsg);
+
+  return 1;
+}
+
+static int
+proxy_gc (lua_State *L)
+{
+  LuaRadiusProxy *lp = NULL;
+  lp = (LuaRadiusProxy *)luaL_checkudata (L, 1, LUARADIUS_PROXYNAME);
+
+  radproxy_free (lp->p);
+  lp->p = NULL;
+
+  luaL_unref (L, LUA_REGISTRYINDEX, lp->hook_ref);
+  luaL_unref (L, LUA_REGISTRYINDEX, lp->req_ref);
+  lp->hook_ref = LUA_NOREF;
+  lp->req_ref  = LUA_NOREF;
+
+  return 0;
+}
+
+static RADIUSProxyRequest *
+proxy_request_check (lua_State *L)
+{
+  LuaRadiusProxyRequest *lreq = NULL;
+
+  lreq = (LuaRadiusProxyRequest *)luaL_checkudata (L, 1,
+                                                   LUARADIUS_PROXYREQNAME);
+  if (!lreq->req)
+    luaL_error (L, LUARADIUS_PREFIX"request used outside of the hook");
+
+  return lreq->req;
+}
+
+static int
+proxy_request_code (lua_State *L)
+{
+  lua_pushinteger (L, radproxy_req_code (proxy_request_check (L)));
+
+  return 1;
+}
+
+static int
+proxy_request_source (lua_State *L)
+{
+  char host[INET6_ADDRSTRLEN];
+  int  port = 0;
+
+  if (radproxy_req_source (proxy_request_check (L), host, sizeof (host),
+                           &port) != RADIUSCLIENT_OK)
+    return 0;
+
+  lua_pushstring (L, host);
+  lua_pushinteger (L, port);
+
+  return 2;
+}
+
+/**
+ * Decoded straight from the received packet: numbers for the integer
+ * types, dotted quads for addresses, raw bytes otherwise.
+ */
+static int
+proxy_request_attr_get (lua_State *L)
+{
+  RADIUSProxyRequest *req = proxy_request_check (L);
+  const uint8_t *value = NULL;
+  size_t value_len = 0;
+  unsigned int attr;
+  uint32_t number = 0;
+  char ip[INET_ADDRSTRLEN];
+  int type;
+  size_t i;
+
+  if ((raddict_attr (luaL_checkstring (L, 2), &attr, &type) !=
+         RADIUSCLIENT_OK) ||
+      (radproxy_req_attr_get (req, attr, &value, &value_len) !=
+         RADIUSCLIENT_OK))
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+
+  switch (type)
+    {
+      case PW_TYPE_INTEGER:
+      case PW_TYPE_DATE:
+      case PW_TYPE_BYTE:
+      case PW_TYPE_SHORT:
+      case PW_TYPE_SIGNED:
+        for (i = 0; (i < value_len) && (i < 4); i++)
+          number = (number << 8) | value[i];
+
+        if (type == PW_TYPE_SIGNED)
+          lua_pushnumber (L, (int32_t) number);
+        else
+          lua_pushnumber (L, number);
+        break;
+
+      case PW_TYPE_IPADDR:
+        if ((value_len == 4) && inet_ntop (AF_INET, value, ip, sizeof (ip)))
+          {
+            lua_pushstring (L, ip);
+            break;
+          }
+        /* fall through */
+
+      default:
+        lua_pushlstring (L, (const char *) value, value_len);
+        break;
+    }
+
+  return 1;
+}
+
+static int
+proxy_request_password (lua_State *L)
+{
+  char buf[256];
+
+  if (radproxy_req_password (proxy_request_check (L), buf, sizeof (buf)) !=
+        RADIUSCLIENT_OK)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+
+  lua_pushstring (L, buf);
+
+  return 1;
+}
+
+static int
+proxy_request_attr_set (lua_State *L)
+{
+  RADIUSProxyRequest *req = proxy_request_check (L);
+
+  lua_pushinteger (L, radproxy_req_attr_set (req, luaL_checkstring (L, 2),
+                                             luaL_checkstring (L, 3)));
+
+  return 1;
+}
+
+static int
+proxy_request_attr_remove (lua_State *L)
+{
+  RADIUSProxyRequest *req = proxy_request_check (L);
+  unsigned int attr;
+  int type;
+
+  if (raddict_attr (luaL_checkstring (L, 2), &attr, &type) !=
+        RADIUSCLIENT_OK)
+    {
+      lua_pushinteger (L, RADIUSCLIENT_ERR);
+      return 1;
+    }
+
+  lua_pushinteger (L, radproxy_req_attr_remove (req, attr));
+
+  return 1;
+}
+
+/**
+ * DISPATCHER API
+ */
+
+typedef struct {
+  RADIUSDispatch *d;
+} LuaRadiusDispatch;
+
+static RADIUSDispatch *
+dispatch_check (lua_State *L)
+{
+  LuaRadiusDispatch *ld = NULL;
+  ld = (LuaRadiusDispatch *)luaL_checkudata (L, 1, LUARADIUS_DISPATCHNAME);
+
+  if (!ld->d)
+    luaL_error (L, LUARADIUS_PREFIX"dispatcher is freed");
+
+  return ld->d;
+}
+
+/**
+ * radius.dispatcher { workers = ..., slots = ..., retries = ... }, to be
+ * created before the workers are forked.
+ */
+static int
+dispatch_fnew (lua_State *L)
+{
+  LuaRadiusDispatch *ld = NULL;
+  const char *errmsg = NULL;
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  ld = (LuaRadiusDispatch *)lua_newuserdata (L, sizeof (LuaRadiusDispatch));
+  ld->d = NULL;
+
+  luaL_getmetatable (L, LUARADIUS_DISPATCHNAME);
+  lua_setmetatable (L, -2);
+
+  ld->d = raddispatch_new (getintfield (L, 1, "workers", 0),
+                           getintfield (L, 1, "slots", 0),
+                           getintfield (L, 1, "retries", 2), &errmsg);
+  if (!ld->d)
+    return luaL_error (L, LUARADIUS_PREFIX"%s", errmsg);
+
+  return 1;
+}
+
+/**
+ * dispatcher:spawn () forks the dispatcher process, returns its pid. The
+ * process keeps the pacer settings of the moment, radius.pacer.configure
+ * must come first. Its pacer never queues: a request that finds no token
+ * fails with RADIUSCLIENT_E_SHED at once, whatever max_wait says.
+ */
+static int
+dispatch_spawn (lua_State *L)
+{
+  pid_t pid = raddispatch_spawn (dispatch_check (L));
+
+  if (pid < 0)
+    lua_pushnil (L);
+  else
+    lua_pushinteger (L, pid);
+
+  return 1;
+}
+
+/**
+ * dispatcher:run (timeout) for a process of its own instead of spawn,
+ * waits up to timeout seconds, forever without one.
+ */
+static int
+dispatch_run (lua_State *L)
+{
+  RADIUSDispatch *d = dispatch_check (L);
+  int timeout = -1;
+
+  if (lua_type (L, 2) == LUA_TNUMBER)
+    timeout = lua_tonumber (L, 2) * 1000;
+
+  lua_pushinteger (L, raddispatch_run (d, timeout));
+
+  return 1;
+}
+
+/**
+ * dispatcher:attach (worker) in the worker process, numbered from 1, the
+ * auth and acct objects of the process then send through the dispatcher.
+ */
+static int
+dispatch_attach (lua_State *L)
+{
+  RADIUSDispatch *d = dispatch_check (L);
+
+  lua_pushinteger (L, raddispatch_attach (d, luaL_checkint (L, 2) - 1));
+
+  return 1;
+}
+
+static int
+dispatch_detach (lua_State *L)
+{
+  dispatch_check (L);
+  raddispatch_detach ();
+
+  return 0;
+}
+
+static int
+dispatch_stats (lua_State *L)
+{
+  RADIUSDispatch *d = dispatch_check (L);
+  RADIUSDispatchStats stats;
+
+  raddispatch_stats (d, &stats);
+
+  lua_createtable (L, 0, 9);
+  setintfield (L, "workers", raddispatch_workers (d));
+  setnumfield (L, "submitted", stats.submitted);
+  setnumfield (L, "completed", stats.completed);
+  setnumfield (L, "retransmits", stats.retransmits);
+  setnumfield (L, "timeouts", stats.timeouts);
+  setnumfield (L, "busy", stats.busy);
+  setnumfield (L, "shed", stats.shed);
+  setnumfield (L, "invalid", stats.invalid);
+  setnumfield (L, "dropped", stats.dropped);
+
+  return 1;
+}
+
+static int
+dispatch_gc (lua_State *L)
+{
+  LuaRadiusDispatch *ld = NULL;
+  ld = (LuaRadiusDispatch *)luaL_checkudata (L, 1, LUARADIUS_DISPATCHNAME);
+
+  raddispatch_free (ld->d);
+  ld->d = NULL;
+
+  return 0;
+}
+
+/**
+ * Lua Initailize
+ */
+
+LUARADIUS_API int
+luaradius_createmeta (lua_State *L, const char *name, const luaL_reg *methods)
+{
+  if (!luaL_newmetatable (L, name))
+    return 0;
+
+  luaL_openlib (L, NULL, methods, 0);
+
+  lua_pushliteral (L, "__index");
+  lua_pushvalue (L, -2);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "__metatable");
+  lua_pushliteral (L, LUARADIUS_PREFIX"you're not allowed to get this "
+                   "metatable");
+  lua_settable (L, -3);
+
+  return 1;
+}
+
+LUARADIUS_API void
+luaradius_setmeta (lua_State *L, const char *name)
+{
+  luaL_getmetatable (L, name);
+  lua_setmetatable (L, -2);
+}
+
+static void
+create_call_table (lua_State *L, const char *name, lua_CFunction creator,
+                   lua_CFunction starter)
+{
+  lua_createtable (L, 0, 1);
+  lua_pushcfunction (L, creator);
+  lua_setfield (L, -2, "new");
+
+  lua_createtable (L, 0, 1);
+  lua_pushcfunction (L, starter);
+  lua_setfield (L, -2, "__call");
+  lua_setmetatable (L, -2);
+  lua_setfield (L, -2, name); 
+}
+
+static void
+create_sub_table (lua_State *L, const char *name, const luaL_reg *functions)
+{
+  lua_newtable (L);
+  luaL_register (L, NULL, functions);
+  lua_setfield (L, -2, name);
+}
+
+static void
+create_metatables (lua_State *L)
+{
+  struct luaL_reg core_functions[] = {
+    { NULL, NULL }
+  };
+
+  struct luaL_reg auth_methods[] = {
+    { "__gc", auth_gc },
+    { "setServer", auth_server_set },
+    { "setUsername", auth_username_set },
+    { "setPassword", auth_password_set },
+    { "setAttribute", auth_attr_set },
+    { "setAttributeRaw", auth_attr_set_raw },
+    { "getAttribute", auth_attr_get },
+    { "getValue", auth_attr_get_value },
+    { "send", auth_send },
+    { "enableDebug", auth_en_debug },
+    { "getLastErrMsg", auth_get_last_err_msg }, 
+    { "getLastErrCode", auth_get_last_err_code },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg acct_methods[] = {
+    { "__gc", acct_gc },
+    { "setServer", acct_server_set },
+    { "setUsername", acct_username_set },
+    { "setAttribute", acct_attr_set },
+    { "setAttributeRaw", acct_attr_set_raw },
+    { "setReplicas", acct_replicas_set },
+    { "getResults", acct_results_get },
+    { "send", acct_send },
+    { "enableDebug", acct_en_debug },
+    { "getLastErrMsg", acct_get_last_err_msg },
+    { "getLastErrCode", acct_get_last_err_code },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg breaker_functions[] = {
+    { "configure", breaker_fconfigure },
+    { "state", breaker_fstate },
+    { "list", breaker_flist },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg limiter_functions[] = {
+    { "configure", limiter_fconfigure },
+    { "stats", limiter_fstats },
+    { "list", limiter_flist },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg pacer_functions[] = {
+    { "configure", pacer_fconfigure },
+    { "stats", pacer_fstats },
+    { "list", pacer_flist },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg server_methods[] = {
+    { "__gc", server_gc },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg proxy_methods[] = {
+    { "__gc", proxy_gc },
+    { "run", proxy_run },
+    { "port", proxy_port },
+    { "stats", proxy_stats },
+    { "getLastErrMsg", proxy_get_last_err_msg },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg proxy_request_methods[] = {
+    { "getCode", proxy_request_code },
+    { "getSource", proxy_request_source },
+    { "getAttribute", proxy_request_attr_get },
+    { "getPassword", proxy_request_password },
+    { "setAttribute", proxy_request_attr_set },
+    { "removeAttribute", proxy_request_attr_remove },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg dispatch_methods[] = {
+    { "__gc", dispatch_gc },
+    { "spawn", dispatch_spawn },
+    { "run", dispatch_run },
+    { "attach", dispatch_attach },
+    { "detach", dispatch_detach },
+    { "stats", dispatch_stats },
+    { NULL, NULL }
+  };
+
+  struct luaL_reg session_methods[] = {
+    { "__gc", session_gc },
+    { "start", session_start },
+    { "interim", session_interim },
+    { "stop", session_stop },
+    { NULL, NULL }
+  };
+
+  luaL_register (L, LUARADIUS_CORENAME, core_functions);
+
+  setintfield (L, "E_NONE", RADIUSCLIENT_E_NONE);
+  setintfield (L, "E_INVALID", RADIUSCLIENT_E_INVALID);
+  setintfield (L, "E_SOCKET", RADIUSCLIENT_E_SOCKET);
+  setintfield (L, "E_TIMEOUT", RADIUSCLIENT_E_TIMEOUT);
+  setintfield (L, "E_UNREACHABLE", RADIUSCLIENT_E_UNREACHABLE);
+  setintfield (L, "E_REPLY", RADIUSCLIENT_E_REPLY);
+  setintfield (L, "E_REJECTED", RADIUSCLIENT_E_REJECTED);
+  setintfield (L, "E_CIRCUIT_OPEN", RADIUSCLIENT_E_CIRCUIT_OPEN);
+  setintfield (L, "E_SHED", RADIUSCLIENT_E_SHED);
+
+  create_sub_table (L, "breaker", breaker_functions);
+  create_sub_table (L, "limiter", limiter_functions);
+  create_sub_table (L, "pacer", pacer_functions);
+
+  lua_pushcfunction (L, server_fnew);
+  lua_setfield (L, -2, "server");
+
+  lua_pushcfunction (L, dictionary_fconfigure);
+  lua_setfield (L, -2, "dictionary");
+
+  lua_pushcfunction (L, proxy_fnew);
+  lua_setfield (L, -2, "proxy");
+
+  lua_pushcfunction (L, dispatch_fnew);
+  lua_setfield (L, -2, "dispatcher");
+
+#define CALLTABLE(n) create_call_table (L, #n, n##_fnew, n##_f##n)
+  CALLTABLE(auth);
+  CALLTABLE(acct);
+
+  lua_getfield (L, -1, "auth");
+  lua_pushcfunction (L, cache_fconfigure);
+  lua_setfield (L, -2, "cache");
+  lua_pushcfunction (L, cache_fstats);
+  lua_setfield (L, -2, "cacheStats");
+  lua_pushcfunction (L, cache_fflush);
+  lua_setfield (L, -2, "cacheFlush");
+  lua_pop (L, 1);
+
+  lua_getfield (L, -1, "acct");
+  lua_pushcfunction (L, session_fnew);
+  lua_setfield (L, -2, "session");
+  lua_pop (L, 1);
+
+  luaradius_createmeta (L, LUARADIUS_AUTHNAME, auth_methods);
+  luaradius_createmeta (L, LUARADIUS_ACCTNAME, acct_methods);
+  luaradius_createmeta (L, LUARADIUS_SESSIONNAME, session_methods);
+  luaradius_createmeta (L, LUARADIUS_SERVERNAME, server_methods);
+  luaradius_createmeta (L, LUARADIUS_PROXYNAME, proxy_methods);
+  luaradius_createmeta (L, LUARADIUS_PROXYREQNAME, proxy_request_methods);
+  luaradius_createmeta (L, LUARADIUS_DISPATCHNAME, dispatch_methods);
+
+  lua_pop (L, 8);
+}
+
+LUARADIUS_API int
+luaopen_radius (lua_State *L)
+{
+  struct luaL_reg core[] = {
+    {NULL, NULL},
+  };
+
+  create_metatables (L);
+  luaL_openlib (L, LUARADIUS_CORENAME, core, 0);
+  
+  return 1;
+}
+
+/**
+ * LUA Helper implementation
+ */
+static void
+setfield (lua_State *L, const char *index, const char *value)
+{
+  lua_pushstring (L, index);
+  lua_pushstring (L, value);
+  lua_settable (L, -3);
+}
+
+static uint64_t
+getcounter (lua_State *L, int index, const char *field)
+{
+  lua_Number value = 0;
+
+  if (!lua_istable (L, index))
+    return 0;
+
+  lua_getfield (L, index, field);
+  value = lua_tonumber (L, -1);
+  lua_pop (L, 1);
+
+  return value > 0 ? (uint64_t) value : 0;
+}
+
+static int
+getintfield (lua_State *L, int index, const char *field, int def)
+{
+  int value = def;
+
+  lua_getfield (L, index, field);
+  if (lua_type (L, -1) == LUA_TNUMBER)
+    value = lua_tointeger (L, -1);
+  lua_pop (L, 1);
+
+  return value;
+}
+
+static lua_Number
+getnumfield (lua_State *L, int index, const char *field, lua_Number def)
+{
+  lua_Number value = def;
+
+  lua_getfield (L, index, field);
+  if (lua_type (L, -1) == LUA_TNUMBER)
+    value = lua_tonumber (L, -1);
+  lua_pop (L, 1);
+
+  return value;
+}
+
+static void
+setnumfield (lua_State *L, const char *index, lua_Number value)
+{
+  lua_pushstring (L, index);
+  lua_pushnumber (L, value);
+  lua_settable (L, -3);
+}
+
+static void
+setintfield (lua_State *L, const char *index, int value)
+{
+  lua_pushstring (L, index);
+  lua_pushinteger (L, value);
   lua_settable (L, -3);
 }
@@ -28,6 +28,13 @@
 #define LUARADIUS_CORENAME  "radius"
 #define LUARADIUS_AUTHNAME  "radius.auth"
 #define LUARADIUS_ACCTNAME  "radius.acct"
+#define LUARADIUS_SESSIONNAME "radius.acct.session"
+#define LUARADIUS_SERVERNAME  "radius.server"
+#define LUARADIUS_PROXYNAME   "radius.proxy"
+#define LUARADIUS_PROXYREQNAME "radius.proxy.request"
+#define LUARADIUS_DISPATCHNAME "radius.dispatcher"
+
+#define LUARADIUS_SESSION_MAX_ATTRS  64
 
 LUARADIUS_API int  luaradius_createmeta (lua_State *L, const char *name,
                                          const luaL_reg *methods);
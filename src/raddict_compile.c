@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/**
+ * raddict-compile: compile the FreeRADIUS text dictionaries into the binary
+ * snapshot loaded by radius.dictionary { snapshot = ... }.
+ **/
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <freeradius/conf.h>
+#include <freeradius/radpaths.h>
+#include <unistd.h>
+#include "radiusclient.h"
+#include "radiusdict.h"
+
+int
+main (int argc, char **argv)
+{
+  RADIUSDictInfo info;
+  const char *dir    = RADDBDIR;
+  const char *file   = RADIUS_DICTIONARY;
+  const char *errmsg = NULL;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "d:f:h")) != -1)
+    {
+      switch (opt)
+        {
+          case 'd':
+            dir = optarg;
+            break;
+
+          case 'f':
+            file = optarg;
+            break;
+
+          default:
+            fprintf (stderr, "Usage: %s [-d raddb_dir] [-f dictionary] "
+                     "snapshot\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+  if (optind != argc - 1)
+    {
+      fprintf (stderr, "Usage: %s [-d raddb_dir] [-f dictionary] "
+               "snapshot\n", argv[0]);
+      return 2;
+    }
+
+  if (raddict_compile (dir, file, argv[optind], &info, &errmsg) ==
+        RADIUSCLIENT_ERR)
+    {
+      fprintf (stderr, "%s: %s\n", argv[0], errmsg ? errmsg : "failed");
+      return 1;
+    }
+
+  fprintf (stdout, "%s: %u vendors, %u attributes, %u values, "
+           "hash %016llx\n", info.snapshot, info.vendors, info.attrs,
+           info.values, (unsigned long long) info.hash);
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+--
+-- Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+--
+-- This program is free software; you can redistribute it and/or modify
+-- it under the terms of the GNU General Public License as published by
+-- the Free Software Foundation; either version 2 of the License, or
+-- (at your option) any later version.
+--
+-- This program is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along
+-- with this program; if not, write to the Free Software Foundation, Inc.,
+-- 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+--
+
+--
+-- LuaJIT FFI binding of radius.so, it offers the methods of radius.auth
+-- and radius.acct without going through the Lua C API, so the calls can
+-- be compiled into traces.
+--
+
+local ffi = require 'ffi';
+
+local ABI_VERSION = 2;
+
+local AUTH_REQ = 0;
+local ACCT_REQ = 1;
+
+local OK = 1;
+
+ffi.cdef [[
+typedef struct _RADIUSClientCtrl RADIUSClientCtrl;
+
+int  radffi_abi_version (void);
+
+RADIUSClientCtrl *radffi_new  (void);
+void              radffi_free (RADIUSClientCtrl *c);
+
+int radffi_server_set (RADIUSClientCtrl *c, const char *host, size_t host_len,
+                       int port, const char *secret, size_t secret_len);
+int radffi_attr_set   (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                       const char *value, size_t value_len);
+int radffi_attr_set_number (RADIUSClientCtrl *c, const char *attr,
+                            size_t attr_len, double value);
+int radffi_attr_get   (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                       char *value, size_t value_size, size_t *value_len,
+                       const char **opr);
+int radffi_send       (RADIUSClientCtrl *c, int packet_code);
+
+void        radffi_set_debug     (RADIUSClientCtrl *c);
+const char *radffi_last_err_msg  (RADIUSClientCtrl *c);
+int         radffi_last_err_code (RADIUSClientCtrl *c);
+]]
+
+local function findlib ()
+  for pattern in package.cpath:gmatch ("[^;]+") do
+    local path = pattern:gsub ("%?", "radius");
+    local f = io.open (path, "rb");
+
+    if f then
+      f:close ();
+      return path;
+    end
+  end
+
+  return "radius";
+end
+
+local C = ffi.load (findlib ());
+
+assert (C.radffi_abi_version () == ABI_VERSION,
+        "radius.ffi does not match the ABI of radius.so");
+
+local value_buf = ffi.new ("char[1024]");
+local value_len = ffi.new ("size_t[1]");
+local opr_buf   = ffi.new ("const char *[1]");
+
+local function tostr (v)
+  if type (v) == "string" then
+    return v;
+  end
+
+  return tostring (v);
+end
+
+local methods = {};
+
+function methods:setServer (host, port, secret)
+  secret = secret or "";
+
+  if C.radffi_server_set (self.c, host, #host, port or 0, secret,
+                          #secret) ~= OK then
+    return nil;
+  end
+
+  return 1;
+end
+
+function methods:setAttribute (attr, value)
+  if type (value) == "number" then
+    return C.radffi_attr_set_number (self.c, attr, #attr, value);
+  end
+
+  value = tostr (value);
+  return C.radffi_attr_set (self.c, attr, #attr, value, #value);
+end
+
+function methods:setUsername (username)
+  return self:setAttribute ("User-Name", username);
+end
+
+local function getattribute (self, attr)
+  if C.radffi_attr_get (self.c, attr, #attr, value_buf, 1024, value_len,
+                        opr_buf) ~= OK then
+    return nil;
+  end
+
+  return {
+    name  = attr,
+    opr   = ffi.string (opr_buf[0]),
+    value = ffi.string (value_buf, value_len[0]),
+  };
+end
+
+function methods:send ()
+  return C.radffi_send (self.c, self.code) == OK and 1 or 0;
+end
+
+function methods:enableDebug ()
+  C.radffi_set_debug (self.c);
+  return 1;
+end
+
+function methods:getLastErrMsg ()
+  return ffi.string (C.radffi_last_err_msg (self.c));
+end
+
+function methods:getLastErrCode ()
+  return C.radffi_last_err_code (self.c);
+end
+
+local auth_methods = setmetatable ({
+  setPassword = function (self, passwd)
+    return self:setAttribute ("User-Password", passwd);
+  end,
+  getAttribute = getattribute,
+}, { __index = methods });
+
+local acct_methods = setmetatable ({}, { __index = methods });
+
+local auth_mt = { __index = auth_methods };
+local acct_mt = { __index = acct_methods };
+
+local function new (mt, code)
+  local c = C.radffi_new ();
+
+  if c == nil then
+    return nil;
+  end
+
+  return setmetatable ({ c = ffi.gc (c, C.radffi_free), code = code }, mt);
+end
+
+return {
+  auth = { new = function () return new (auth_mt, AUTH_REQ) end },
+  acct = { new = function () return new (acct_mt, ACCT_REQ) end },
+};
@@ -0,0 +1,268 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <stddef.h>
+#include "radiusacct.h"
+#include "radiusdict.h"
+
+/**
+ * Status-Type, Session-Time, Input/Output-Octets, Input/Output-Gigawords,
+ * Terminate-Cause and Event-Timestamp, all of them are 4 octets integers
+ **/
+#define RADACCT_TAIL_ATTRS  8
+#define RADACCT_TAIL_LEN    (RADACCT_TAIL_ATTRS * 6)
+
+enum {
+  RADACCT_STATE_IDLE = 0,
+  RADACCT_STATE_STARTED,
+  RADACCT_STATE_STOPPED
+};
+
+/**
+ * The request header and the static attributes are encoded once, the
+ * dynamic attributes are written behind them on every event.
+ **/
+struct _RADIUSAcctSession {
+  uint32_t start_time;
+  uint16_t attrs_len;
+  uint8_t  state;
+  uint8_t  data[];
+};
+
+/* Internal declaration */
+
+static uint8_t *put_integer (uint8_t *p, int attr, uint32_t value);
+static int      session_send (RADIUSAcctSession *s, RADIUSClientCtrl *c,
+                              int status, int with_counters,
+                              uint64_t in_octets, uint64_t out_octets,
+                              int cause);
+
+/* Implementation */
+
+int
+radacct_attrs_encode (const char **attrs, const char **values, size_t count,
+                      uint8_t *buf, size_t *buf_len)
+{
+  RADIUS_PACKET *packet = NULL;
+  VALUE_PAIR *vp = NULL;
+  char session_id[32];
+  size_t i;
+  int res = RADIUSCLIENT_ERR;
+
+  if (!buf || !buf_len)
+    return RADIUSCLIENT_ERR;
+
+  packet = rad_alloc (1);
+  if (!packet)
+    return RADIUSCLIENT_ERR;
+
+  for (i = 0; i < count; i++)
+    {
+      vp = pairmake (attrs[i], values[i], T_OP_EQ);
+      if (!vp)
+        goto done;
+
+      /**
+       * The block is encoded once without a secret and the authenticator
+       * differs on every send, neither could be encrypted nor signed here.
+       **/
+      if ((vp->attribute == PW_MESSAGE_AUTHENTICATOR) || vp->flags.encrypt)
+        {
+          pairfree (&vp);
+          goto done;
+        }
+
+      pairadd (&packet->vps, vp);
+    }
+
+  if (!pairfind (packet->vps, PW_ACCT_SESSION_ID))
+    {
+      snprintf (session_id, sizeof (session_id), "%08X%08X",
+                (unsigned int) time (NULL), fr_rand ());
+
+      vp = pairmake ("Acct-Session-Id", session_id, T_OP_EQ);
+      if (!vp)
+        goto done;
+
+      pairadd (&packet->vps, vp);
+    }
+
+  /* The dynamic attributes must not be part of the static block */
+  pairdelete (&packet->vps, PW_ACCT_STATUS_TYPE);
+  pairdelete (&packet->vps, PW_ACCT_SESSION_TIME);
+  pairdelete (&packet->vps, PW_ACCT_INPUT_OCTETS);
+  pairdelete (&packet->vps, PW_ACCT_OUTPUT_OCTETS);
+  pairdelete (&packet->vps, PW_ACCT_INPUT_GIGAWORDS);
+  pairdelete (&packet->vps, PW_ACCT_OUTPUT_GIGAWORDS);
+  pairdelete (&packet->vps, PW_ACCT_TERMINATE_CAUSE);
+  pairdelete (&packet->vps, PW_EVENT_TIMESTAMP);
+
+  packet->code = PW_ACCOUNTING_REQUEST;
+  packet->id   = 0;
+
+  if (rad_encode (packet, NULL, "") < 0)
+    goto done;
+
+  if ((size_t) (packet->data_len - AUTH_HDR_LEN) > *buf_len)
+    goto done;
+
+  *buf_len = packet->data_len - AUTH_HDR_LEN;
+  memcpy (buf, packet->data + AUTH_HDR_LEN, *buf_len);
+  res = RADIUSCLIENT_OK;
+
+done:
+  rad_free (&packet);
+  return res;
+}
+
+size_t
+radacct_session_size (size_t attrs_len)
+{
+  return offsetof (RADIUSAcctSession, data) + AUTH_HDR_LEN + attrs_len +
+           RADACCT_TAIL_LEN;
+}
+
+int
+radacct_session_init (RADIUSAcctSession *s, const uint8_t *attrs,
+                      size_t attrs_len)
+{
+  if (!s)
+    return RADIUSCLIENT_ERR;
+
+  if (AUTH_HDR_LEN + attrs_len + RADACCT_TAIL_LEN > MAX_PACKET_LEN)
+    return RADIUSCLIENT_ERR;
+
+  s->start_time = 0;
+  s->attrs_len  = attrs_len;
+  s->state      = RADACCT_STATE_IDLE;
+
+  memset (s->data, 0, AUTH_HDR_LEN);
+  memcpy (s->data + AUTH_HDR_LEN, attrs, attrs_len);
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radacct_session_active (RADIUSAcctSession *s)
+{
+  return s && (s->state == RADACCT_STATE_STARTED);
+}
+
+int
+radacct_session_start (RADIUSAcctSession *s, RADIUSClientCtrl *c)
+{
+  if (!s || (s->state != RADACCT_STATE_IDLE))
+    return RADIUSCLIENT_ERR;
+
+  s->start_time = time (NULL);
+
+  /* Unanswered, the session stays idle and the Start may be sent again */
+  if (session_send (s, c, PW_STATUS_START, 0, 0, 0, 0) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  s->state = RADACCT_STATE_STARTED;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radacct_session_interim (RADIUSAcctSession *s, RADIUSClientCtrl *c,
+                         uint64_t in_octets, uint64_t out_octets)
+{
+  if (!radacct_session_active (s))
+    return RADIUSCLIENT_ERR;
+
+  return session_send (s, c, PW_STATUS_ALIVE, 1, in_octets, out_octets, 0);
+}
+
+int
+radacct_session_stop (RADIUSAcctSession *s, RADIUSClientCtrl *c,
+                      uint64_t in_octets, uint64_t out_octets, int cause)
+{
+  if (!radacct_session_active (s))
+    return RADIUSCLIENT_ERR;
+
+  /* Unanswered, the session stays active and the Stop may be sent again */
+  if (session_send (s, c, PW_STATUS_STOP, 1, in_octets, out_octets,
+                    cause) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  s->state = RADACCT_STATE_STOPPED;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radacct_cause_value (const char *name)
+{
+  int value;
+
+  if (!name ||
+      (raddict_value (PW_ACCT_TERMINATE_CAUSE, name, &value) ==
+         RADIUSCLIENT_ERR))
+    return 0;
+
+  return value;
+}
+
+/* Internal implementation */
+
+static uint8_t *
+put_integer (uint8_t *p, int attr, uint32_t value)
+{
+  p[0] = attr;
+  p[1] = 6;
+  p[2] = (value >> 24) & 0xff;
+  p[3] = (value >> 16) & 0xff;
+  p[4] = (value >> 8) & 0xff;
+  p[5] = value & 0xff;
+
+  return p + 6;
+}
+
+static int
+session_send (RADIUSAcctSession *s, RADIUSClientCtrl *c, int status,
+              int with_counters, uint64_t in_octets, uint64_t out_octets,
+              int cause)
+{
+  uint8_t *p = s->data + AUTH_HDR_LEN + s->attrs_len;
+  uint32_t now = time (NULL);
+
+  p = put_integer (p, PW_ACCT_STATUS_TYPE, status);
+
+  if (with_counters)
+    {
+      p = put_integer (p, PW_ACCT_SESSION_TIME,
+                       now > s->start_time ? now - s->start_time : 0);
+      p = put_integer (p, PW_ACCT_INPUT_OCTETS, in_octets & 0xffffffff);
+      p = put_integer (p, PW_ACCT_OUTPUT_OCTETS, out_octets & 0xffffffff);
+      p = put_integer (p, PW_ACCT_INPUT_GIGAWORDS, in_octets >> 32);
+      p = put_integer (p, PW_ACCT_OUTPUT_GIGAWORDS, out_octets >> 32);
+    }
+
+  if (cause > 0)
+    p = put_integer (p, PW_ACCT_TERMINATE_CAUSE, cause);
+
+  p = put_integer (p, PW_EVENT_TIMESTAMP, now);
+
+  return radclient_send_data (c, RADIUSCLIENT_ACCT_REQ, s->data,
+                              p - s->data);
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSACCT_H
+#define _RADIUSACCT_H
+
+#include "radiusclient.h"
+
+typedef struct _RADIUSAcctSession RADIUSAcctSession;
+
+/* Accounting session API */
+int    radacct_attrs_encode    (const char **attrs, const char **values,
+                                size_t count, uint8_t *buf, size_t *buf_len);
+size_t radacct_session_size    (size_t attrs_len);
+int    radacct_session_init    (RADIUSAcctSession *s, const uint8_t *attrs,
+                                size_t attrs_len);
+int    radacct_session_active  (RADIUSAcctSession *s);
+
+int radacct_session_start   (RADIUSAcctSession *s, RADIUSClientCtrl *c);
+int radacct_session_interim (RADIUSAcctSession *s, RADIUSClientCtrl *c,
+                             uint64_t in_octets, uint64_t out_octets);
+int radacct_session_stop    (RADIUSAcctSession *s, RADIUSClientCtrl *c,
+                             uint64_t in_octets, uint64_t out_octets,
+                             int cause);
+
+int radacct_cause_value     (const char *name);
+
+#endif /* _RADIUSACCT_H */
@@ -0,0 +1,454 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include "radiusclient.h"
+#include "radiuscache.h"
+#include "radiusdict.h"
+
+#define RADCACHE_MIN_BUCKETS  64
+#define RADCACHE_MAX_BUCKETS  (1 << 20)
+
+typedef struct _RADIUSCacheEntry RADIUSCacheEntry;
+
+struct _RADIUSCacheEntry {
+  uint8_t       key[16];
+  time_t        expires;
+  unsigned int  code;
+  size_t        bytes;
+  VALUE_PAIR   *vps;
+  RADIUSCacheEntry *next;
+  RADIUSCacheEntry *lru_prev;
+  RADIUSCacheEntry *lru_next;
+};
+
+/**
+ * The cache is shared by all the authentication clients of the process,
+ * the least recently used entry is kept at the tail of the LRU list.
+ **/
+static struct {
+  pthread_mutex_t    mutex;
+  int                ttl;
+  int                reject_ttl;
+  size_t             max_entries;
+  size_t             max_bytes;
+  char               attrs[RADCACHE_MAX_KEY_ATTRS][64];
+  size_t             attrs_count;
+  RADIUSCacheEntry **buckets;
+  size_t             buckets_mask;
+  RADIUSCacheEntry  *lru_head;
+  RADIUSCacheEntry  *lru_tail;
+  RADIUSCacheStats   stats;
+} cache = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Internal declaration */
+
+static int   cache_key        (const RADIUS_PACKET *request, uint8_t *key);
+static void  cache_key_value  (FR_MD5_CTX *ctx, const VALUE_PAIR *vp);
+static RADIUSCacheEntry **cache_find (const uint8_t *key);
+static void  cache_unlink     (RADIUSCacheEntry **pentry);
+static void  cache_lru_remove (RADIUSCacheEntry *entry);
+static void  cache_lru_push   (RADIUSCacheEntry *entry);
+static void  cache_entry_free (RADIUSCacheEntry *entry);
+static void  cache_clear      (void);
+
+/* Implementation */
+
+int
+radcache_configure (int ttl, int reject_ttl, size_t max_entries,
+                    size_t max_bytes, const char **attrs, size_t attrs_count)
+{
+  RADIUSCacheEntry **buckets = NULL;
+  size_t nbuckets = RADCACHE_MIN_BUCKETS;
+  size_t i;
+
+  if (attrs_count > RADCACHE_MAX_KEY_ATTRS)
+    return RADIUSCLIENT_ERR;
+
+  while ((nbuckets < max_entries) && (nbuckets < RADCACHE_MAX_BUCKETS))
+    nbuckets <<= 1;
+
+  if (ttl > 0)
+    {
+      buckets = calloc (nbuckets, sizeof (RADIUSCacheEntry *));
+      if (!buckets)
+        return RADIUSCLIENT_ERR;
+    }
+
+  pthread_mutex_lock (&cache.mutex);
+
+  cache_clear ();
+  free (cache.buckets);
+
+  cache.buckets      = buckets;
+  cache.buckets_mask = nbuckets - 1;
+  cache.ttl          = ttl > 0 ? ttl : 0;
+  cache.reject_ttl   = reject_ttl > 0 ? reject_ttl : 0;
+  cache.max_entries  = max_entries;
+  cache.max_bytes    = max_bytes;
+  cache.attrs_count  = attrs_count;
+
+  for (i = 0; i < attrs_count; i++)
+    {
+      strncpy (cache.attrs[i], attrs[i], sizeof (cache.attrs[i]) - 1);
+      cache.attrs[i][sizeof (cache.attrs[i]) - 1] = '\0';
+    }
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  return RADIUSCLIENT_OK;
+}
+
+void
+radcache_flush (void)
+{
+  pthread_mutex_lock (&cache.mutex);
+  cache_clear ();
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+void
+radcache_stats (RADIUSCacheStats *stats)
+{
+  if (!stats)
+    return;
+
+  pthread_mutex_lock (&cache.mutex);
+  memcpy (stats, &cache.stats, sizeof (RADIUSCacheStats));
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+int
+radcache_enabled (void)
+{
+  return cache.ttl > 0;
+}
+
+int
+radcache_lookup (const RADIUS_PACKET *request, RADIUS_PACKET **reply)
+{
+  RADIUSCacheEntry **pentry = NULL;
+  RADIUSCacheEntry  *entry  = NULL;
+  RADIUS_PACKET *packet = NULL;
+  uint8_t key[16];
+
+  if (!request || !reply)
+    return RADIUSCLIENT_ERR;
+
+  if (cache_key (request, key) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  pthread_mutex_lock (&cache.mutex);
+
+  if (!cache.buckets)
+    goto miss;
+
+  pentry = cache_find (key);
+  entry  = *pentry;
+
+  if (!entry)
+    goto miss;
+
+  if (entry->expires <= time (NULL))
+    {
+      cache_unlink (pentry);
+      cache.stats.expired++;
+      goto miss;
+    }
+
+  packet = rad_alloc (0);
+  if (!packet)
+    goto miss;
+
+  packet->code = entry->code;
+  packet->vps  = paircopy (entry->vps);
+
+  cache_lru_remove (entry);
+  cache_lru_push (entry);
+  cache.stats.hits++;
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  *reply = packet;
+  return RADIUSCLIENT_OK;
+
+miss:
+  cache.stats.misses++;
+  pthread_mutex_unlock (&cache.mutex);
+  return RADIUSCLIENT_ERR;
+}
+
+void
+radcache_store (const RADIUS_PACKET *request, const RADIUS_PACKET *reply)
+{
+  RADIUSCacheEntry **pentry = NULL;
+  RADIUSCacheEntry  *entry  = NULL;
+  VALUE_PAIR *vp = NULL;
+  uint8_t key[16];
+  int ttl = 0;
+
+  if (!request || !reply)
+    return;
+
+  if (reply->code == PW_AUTHENTICATION_ACK)
+    {
+      ttl = cache.ttl;
+
+      /* Never serve an accept longer than the session it grants */
+      vp = pairfind (reply->vps, PW_SESSION_TIMEOUT);
+      if (vp && ((int) vp->vp_integer < ttl))
+        ttl = vp->vp_integer;
+    }
+  else if (reply->code == PW_AUTHENTICATION_REJECT)
+    {
+      ttl = cache.reject_ttl;
+    }
+
+  if (ttl <= 0)
+    return;
+
+  if (cache_key (request, key) == RADIUSCLIENT_ERR)
+    return;
+
+  entry = calloc (1, sizeof (RADIUSCacheEntry));
+  if (!entry)
+    return;
+
+  memcpy (entry->key, key, sizeof (entry->key));
+  entry->expires = time (NULL) + ttl;
+  entry->code    = reply->code;
+  entry->vps     = paircopy (reply->vps);
+  entry->bytes   = sizeof (RADIUSCacheEntry);
+
+  for (vp = entry->vps; vp; vp = vp->next)
+    entry->bytes += sizeof (VALUE_PAIR);
+
+  pthread_mutex_lock (&cache.mutex);
+
+  if (!cache.buckets)
+    {
+      pthread_mutex_unlock (&cache.mutex);
+      cache_entry_free (entry);
+      return;
+    }
+
+  pentry = cache_find (key);
+  if (*pentry)
+    cache_unlink (pentry);
+
+  entry->next = *pentry;
+  *pentry     = entry;
+  cache_lru_push (entry);
+
+  cache.stats.entries++;
+  cache.stats.bytes += entry->bytes;
+  cache.stats.inserts++;
+
+  while (cache.lru_tail && (cache.lru_tail != entry) &&
+         ((cache.max_entries && (cache.stats.entries > cache.max_entries)) ||
+          (cache.max_bytes && (cache.stats.bytes > cache.max_bytes))))
+    {
+      cache_unlink (cache_find (cache.lru_tail->key));
+      cache.stats.evictions++;
+    }
+
+  pthread_mutex_unlock (&cache.mutex);
+}
+
+/* Internal implementation */
+
+static int
+cache_key (const RADIUS_PACKET *request, uint8_t *key)
+{
+  FR_MD5_CTX ctx;
+  VALUE_PAIR *vp = NULL;
+  unsigned int attrs[RADCACHE_MAX_KEY_ATTRS];
+  size_t   attrs_count;
+  int      type;
+  uint16_t port;
+  size_t i;
+
+  /* radcache_configure may rewrite the names, hash a copy of them */
+  pthread_mutex_lock (&cache.mutex);
+
+  attrs_count = cache.attrs_count;
+  for (i = 0; i < attrs_count; i++)
+    {
+      if (raddict_attr (cache.attrs[i], &attrs[i], &type) != RADIUSCLIENT_OK)
+        attrs[i] = 0;
+    }
+
+  pthread_mutex_unlock (&cache.mutex);
+
+  fr_MD5Init (&ctx);
+
+  if (request->dst_ipaddr.af == AF_INET)
+    fr_MD5Update (&ctx,
+                  (const uint8_t *) &request->dst_ipaddr.ipaddr.ip4addr, 4);
+  else
+    fr_MD5Update (&ctx,
+                  (const uint8_t *) &request->dst_ipaddr.ipaddr.ip6addr, 16);
+
+  port = htons (request->dst_port);
+  fr_MD5Update (&ctx, (const uint8_t *) &port, sizeof (port));
+
+  vp = pairfind (request->vps, PW_USER_NAME);
+  if (!vp)
+    return RADIUSCLIENT_ERR;
+
+  cache_key_value (&ctx, vp);
+
+  /* Only PAP is cacheable, CHAP responses depend on a random challenge */
+  vp = pairfind (request->vps, PW_USER_PASSWORD);
+  if (!vp)
+    return RADIUSCLIENT_ERR;
+
+  cache_key_value (&ctx, vp);
+
+  for (i = 0; i < attrs_count; i++)
+    {
+      vp = attrs[i] ? pairfind (request->vps, attrs[i]) : NULL;
+
+      if (vp)
+        cache_key_value (&ctx, vp);
+      else
+        fr_MD5Update (&ctx, (const uint8_t *) "", 1);
+    }
+
+  fr_MD5Final (key, &ctx);
+
+  return RADIUSCLIENT_OK;
+}
+
+static void
+cache_key_value (FR_MD5_CTX *ctx, const VALUE_PAIR *vp)
+{
+  uint32_t len;
+
+  fr_MD5Update (ctx, (const uint8_t *) &vp->attribute,
+                sizeof (vp->attribute));
+
+  switch (vp->type)
+    {
+      case PW_TYPE_INTEGER:
+      case PW_TYPE_IPADDR:
+      case PW_TYPE_DATE:
+      case PW_TYPE_BYTE:
+      case PW_TYPE_SHORT:
+        fr_MD5Update (ctx, (const uint8_t *) &vp->lvalue,
+                      sizeof (vp->lvalue));
+        break;
+
+      default:
+        len = vp->length;
+        fr_MD5Update (ctx, (const uint8_t *) &len, sizeof (len));
+        fr_MD5Update (ctx, vp->vp_octets, vp->length);
+        break;
+    }
+}
+
+static RADIUSCacheEntry **
+cache_find (const uint8_t *key)
+{
+  RADIUSCacheEntry **pentry = NULL;
+  uint32_t hash;
+
+  memcpy (&hash, key, sizeof (hash));
+  pentry = &cache.buckets[hash & cache.buckets_mask];
+
+  while (*pentry && memcmp ((*pentry)->key, key, sizeof ((*pentry)->key)))
+    pentry = &(*pentry)->next;
+
+  return pentry;
+}
+
+static void
+cache_unlink (RADIUSCacheEntry **pentry)
+{
+  RADIUSCacheEntry *entry = *pentry;
+
+  *pentry = entry->next;
+  cache_lru_remove (entry);
+
+  cache.stats.entries--;
+  cache.stats.bytes -= entry->bytes;
+
+  cache_entry_free (entry);
+}
+
+static void
+cache_lru_remove (RADIUSCacheEntry *entry)
+{
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache.lru_head = entry->lru_next;
+
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache.lru_tail = entry->lru_prev;
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void
+cache_lru_push (RADIUSCacheEntry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache.lru_head;
+
+  if (cache.lru_head)
+    cache.lru_head->lru_prev = entry;
+  else
+    cache.lru_tail = entry;
+
+  cache.lru_head = entry;
+}
+
+static void
+cache_entry_free (RADIUSCacheEntry *entry)
+{
+  pairfree (&entry->vps);
+  free (entry);
+}
+
+static void
+cache_clear (void)
+{
+  RADIUSCacheEntry *entry = NULL;
+
+  while ((entry = cache.lru_head) != NULL)
+    {
+      cache.lru_head = entry->lru_next;
+      cache_entry_free (entry);
+    }
+
+  cache.lru_tail = NULL;
+
+  if (cache.buckets)
+    memset (cache.buckets, 0,
+            (cache.buckets_mask + 1) * sizeof (RADIUSCacheEntry *));
+
+  cache.stats.entries = 0;
+  cache.stats.bytes   = 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSCACHE_H
+#define _RADIUSCACHE_H
+
+#include <freeradius/libradius.h>
+
+#define RADCACHE_MAX_KEY_ATTRS  16
+
+typedef struct _RADIUSCacheStats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long inserts;
+  unsigned long evictions;
+  unsigned long expired;
+  size_t        entries;
+  size_t        bytes;
+} RADIUSCacheStats;
+
+/* Access-Accept reply cache API */
+int  radcache_configure (int ttl, int reject_ttl, size_t max_entries,
+                         size_t max_bytes, const char **attrs,
+                         size_t attrs_count);
+void radcache_flush     (void);
+void radcache_stats     (RADIUSCacheStats *stats);
+int  radcache_enabled   (void);
+
+int  radcache_lookup    (const RADIUS_PACKET *request,
+                         RADIUS_PACKET **reply);
+void radcache_store     (const RADIUS_PACKET *request,
+                         const RADIUS_PACKET *reply);
+
+#endif /* _RADIUSCACHE_H */
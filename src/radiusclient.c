@@ -22,34 +22,96 @@
 #include <freeradius/conf.h>
 #include <freeradius/radpaths.h>
 #include <poll.h>
+#include <errno.h>
+#include <stdarg.h>
 #include "radiusclient.h"
+#include "radiuscache.h"
+#include "radiusdest.h"
+#include "radiuspacer.h"
+#include "radiusconn.h"
+#include "radiusshard.h"
+#include "radiusserver.h"
+#include "radiusdict.h"
+#include "radiusdispatch.h"
 
+#define RADIUSCLIENT_ERRMSG_SIZE  256
+
+/**
+ * Result of the last send to one target. Target 0 is the server of the
+ * client, the others are the replicas added to it.
+ **/
+typedef struct _RADIUSClientTarget {
+  RADIUSServer *server;
+  int           state;
+  int           errCode;
+  const char   *errMsg;
+  double        rtt;
+  int           probe;
+} RADIUSClientTarget;
+
+/**
+ * Kept small on purpose, Lua scripts may hold one per session. The server
+ * configuration is shared by reference, the request packet is allocated on
+ * the first send and the message buffer on the first formatted error.
+ **/
 struct _RADIUSClientCtrl {
   RADIUS_PACKET *request;
   RADIUS_PACKET *reply;
-  fr_ipaddr_t    server_ipaddr;
+  VALUE_PAIR    *vps;
+  RADIUSServer  *server;
+  const char    *secret;
   fr_ipaddr_t    client_ipaddr;
-  int    server_port;
   int    client_port;
   int    packet_code;
-  char   secret[256];
   int    sockfd;
-  int    packet_number;
-  char   password[256];
-  int    done;
   float  timeout;
   int    force_af;
-  time_t timestamp;
   int    debug;
-  const char *radius_dir;
   const char *lastErrMsg;
-  char   errMsgBuf[1024];
+  int    lastErrCode;
+  char  *errMsgBuf;
+  RADIUSDest *dest;
+  RADIUSPacer *pacer;
+  int    transport;
+  RADIUSConnTLS *tls;
+  RADIUSConn    *conn;
+  int    shards;
+  int    shard_flags;
+  RADIUSShardSet *shard_set;
+  RADIUSClientTarget *targets;
+  int    targets_count;
+  int    policy;
 };
 
 /* Internal declaration */
 
 static int  getport (const char *name);
 static void print_hex (RADIUS_PACKET *packet);
+static void set_err_msg (RADIUSClientCtrl *c, int code, const char *fmt, ...);
+static int  number_valid (double value, double min, double limit);
+static VALUE_PAIR **request_vps (RADIUSClientCtrl *c);
+static int  request_prepare  (RADIUSClientCtrl *c, int packet_code);
+static int  request_class    (RADIUSClientCtrl *c);
+static int  request_transact (RADIUSClientCtrl *c);
+static int  request_replicate (RADIUSClientCtrl *c);
+static int  replicate_decide (int policy, int ok, int failed, int count);
+static int  replicate_send   (RADIUSClientCtrl *c, int index, uint8_t *data,
+                              int *fd, RADIUSDest **dest);
+static int  replicate_verify (const uint8_t *reply, size_t reply_len,
+                              const uint8_t *request, const char *secret);
+static void replicate_finish (RADIUSClientTarget *t, RADIUSDest *d, int state,
+                              int code, const char *errmsg);
+static void breaker_report   (RADIUSDest *d, int probe, int code);
+static int  dest_result      (int code);
+static double request_now    (void);
+static int  request_exchange (RADIUSClientCtrl *c);
+static int  request_exchange_stream (RADIUSClientCtrl *c);
+static int  request_exchange_shard  (RADIUSClientCtrl *c);
+static int  request_exchange_dispatch (RADIUSClientCtrl *c);
+static int  request_reply_data (RADIUSClientCtrl *c, const uint8_t *data,
+                                size_t data_len);
+static int  request_resign   (RADIUSClientCtrl *c, int id);
+static int  request_reply    (RADIUSClientCtrl *c);
 
 /**
  * This is a hack, and has to be kept in sync with FreeRADIUS - tokens.h
@@ -94,23 +156,15 @@ radclient_ctrl_init (RADIUSClientCtrl *c)
 
   memset (c, 0, sizeof (RADIUSClientCtrl));
 
-  c->request = rad_alloc (1);
-  c->reply   = NULL; 
-  c->timeout = 5000;
-  c->sockfd  = -1;
-  c->done    = 1;
-  c->radius_dir   = RADDBDIR;
-  c->force_af     = AF_INET;
-  c->secret[0]    = '\0'; 
-  c->debug        = 0;
-  c->lastErrMsg   = "No errors";
-  c->errMsgBuf[0] = '\0';
+  c->timeout    = 5000;
+  c->sockfd     = -1;
+  c->force_af   = AF_INET;
+  c->debug      = 0;
+  c->lastErrMsg = "No errors";
+  c->shards     = -1;
 
-  if (dict_init (c->radius_dir, RADIUS_DICTIONARY) < 0)
-    {
-      c->lastErrMsg = "Initializing dictionary failed";
-      return RADIUSCLIENT_ERR;
-    }
+  if (raddict_acquire (&c->lastErrMsg) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
 
   return RADIUSCLIENT_OK;
 }
@@ -124,46 +178,122 @@ radclient_ctrl_free (RADIUSClientCtrl *c)
   if (c->reply)
     rad_free (&c->reply);
 
-  dict_free ();
+  pairfree (&c->vps);
+
+  radserver_unref (c->server);
+  c->server = NULL;
+
+  radclient_replica_clear (c);
+
+  free (c->errMsgBuf);
+  c->errMsgBuf = NULL;
+
+  radconn_tls_free (c->tls);
+  c->tls = NULL;
+
+  raddict_release ();
 }
 
 int
 radclient_server_set (RADIUSClientCtrl *c, const char *hostname, int port,
                       const char *secret)
 {
-  char buffer[256];
-  const char *host = NULL;
-  const char *p = NULL;
+  RADIUSServer *server = NULL;
+  int res;
 
   if (!c)
     return RADIUSCLIENT_ERR;
 
-  host = hostname;
+  server = radserver_new (hostname, port, secret, c->force_af,
+                          &c->lastErrMsg);
+  if (!server)
+    return RADIUSCLIENT_ERR;
+
+  res = radclient_server_use (c, server);
+  radserver_unref (server);
 
-  if (hostname[1] == '[') /* IPv6 URL encoded */
-    {
-      p = strchr (hostname, ']');
+  return res;
+}
+
+int
+radclient_server_use (RADIUSClientCtrl *c, RADIUSServer *server)
+{
+  if (!c || !server)
+    return RADIUSCLIENT_ERR;
+
+  radserver_ref (server);
+  radserver_unref (c->server);
 
-      if ((size_t) (p - hostname) >= sizeof (buffer))
-        return RADIUSCLIENT_ERR;
+  c->server    = server;
+  c->dest      = NULL;
+  c->pacer     = NULL;
+  c->conn      = NULL;
+  c->shard_set = NULL;
 
-      memcpy (buffer, hostname + 1, p - hostname - 1);
-      buffer[p - hostname - 1] = '\0';
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_transport_set (RADIUSClientCtrl *c, const char *transport,
+                         const char *ca_file, const char *cert_file,
+                         const char *key_file, int verify)
+{
+  int value;
+
+  if (!c)
+    return RADIUSCLIENT_ERR;
 
-      host = buffer;
+  value = radconn_transport_value (transport);
+  if (value < 0)
+    {
+      c->lastErrMsg = "Unsupported transport";
+      return RADIUSCLIENT_ERR;
     }
 
-  if (ip_hton (host, c->force_af, &c->request->dst_ipaddr) < 0)
+  radconn_tls_free (c->tls);
+  c->tls = NULL;
+
+  if (value == RADCONN_TLS)
+    c->tls = radconn_tls_new (ca_file, cert_file, key_file, verify);
+
+  c->transport = value;
+  c->dest = NULL;
+  c->conn = NULL;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_source_set (RADIUSClientCtrl *c, const char *hostname, int port)
+{
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if (hostname && (ip_hton (hostname, c->force_af, &c->client_ipaddr) < 0))
     {
-      c->lastErrMsg = "Invalid hostname or IP";
+      c->lastErrMsg = "Invalid source hostname or IP";
       return RADIUSCLIENT_ERR;
     }
 
-  if (port > 0)
-    c->request->dst_port = port;
+  c->client_port = port > 0 ? port : 0;
+
+  /* The next request looks up the shard set bound to the new source */
+  c->shard_set   = NULL;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_shards_set (RADIUSClientCtrl *c, int count, int flags)
+{
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  c->shards      = count;
+  c->shard_flags = flags;
 
-  if (secret)
-    strncpy (c->secret, secret, sizeof (c->secret));
+  /* Sets are keyed on their count and flags, a new one is looked up */
+  c->shard_set   = NULL;
 
   return RADIUSCLIENT_OK;
 }
@@ -184,12 +314,197 @@ radclient_attr_set (RADIUSClientCtrl *c, const char *attr, const char *value)
 
   vp = pairmake (attr, value, T_OP_EQ);
 
+  /* Silently ignore the invalid attribute-value pair */
   if (vp)
-    pairadd (&c->request->vps, vp);
+    pairadd (request_vps (c), vp);
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_attr_set_number (RADIUSClientCtrl *c, const char *attr,
+                           double value)
+{
+  unsigned int da_attr;
+  int         da_type;
+  VALUE_PAIR *vp = NULL;
+  char buffer[64];
+  double min   = 0;
+  double limit = 4294967296.0;
+
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if (!attr)
+    {
+      c->lastErrMsg = "Invalid arguments";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (raddict_attr (attr, &da_attr, &da_type) == RADIUSCLIENT_ERR)
+    {
+      c->lastErrMsg = "Invalid attribute";
+      return RADIUSCLIENT_ERR;
+    }
+
+  switch (da_type)
+    {
+      case PW_TYPE_INTEGER:
+      case PW_TYPE_DATE:
+      case PW_TYPE_IPADDR:
+        break;
+
+      case PW_TYPE_BYTE:
+        limit = 256;
+        break;
+
+      case PW_TYPE_SHORT:
+        limit = 65536;
+        break;
+
+      case PW_TYPE_SIGNED:
+        min   = -2147483648.0;
+        limit = 2147483648.0;
+        break;
+
+#ifdef PW_TYPE_INTEGER64
+      case PW_TYPE_INTEGER64:
+        limit = 18446744073709551616.0;
+        break;
+#endif
+
+      default:
+        /* Not a numeric attribute, let the dictionary parse it */
+        snprintf (buffer, sizeof (buffer), "%.14g", value);
+        return radclient_attr_set (c, attr, buffer);
+    }
+
+  /* Converting a double the type cannot hold is undefined behaviour */
+  if (!number_valid (value, min, limit))
+    {
+      c->lastErrMsg = "Invalid value";
+      return RADIUSCLIENT_ERR;
+    }
+
+  vp = paircreate (da_attr, da_type);
+  if (!vp)
+    {
+      c->lastErrMsg = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  switch (da_type)
+    {
+      case PW_TYPE_BYTE:
+        vp->vp_integer = (uint32_t) value & 0xff;
+        vp->length = 1;
+        break;
+
+      case PW_TYPE_SHORT:
+        vp->vp_integer = (uint32_t) value & 0xffff;
+        vp->length = 2;
+        break;
+
+      case PW_TYPE_SIGNED:
+        vp->vp_integer = (uint32_t) (int32_t) value;
+        vp->length = 4;
+        break;
+
+      case PW_TYPE_IPADDR:
+        vp->vp_ipaddr = htonl ((uint32_t) value);
+        vp->length = 4;
+        break;
+
+#ifdef PW_TYPE_INTEGER64
+      case PW_TYPE_INTEGER64:
+        vp->vp_integer64 = (uint64_t) value;
+        vp->length = 8;
+        break;
+#endif
+
+      default:
+        vp->vp_integer = (uint32_t) value;
+        vp->length = 4;
+        break;
+    }
+
+  vp->operator = T_OP_EQ;
+  pairadd (request_vps (c), vp);
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_attr_set_octets (RADIUSClientCtrl *c, const char *attr,
+                           const uint8_t *value, size_t value_len)
+{
+  unsigned int da_attr;
+  int         da_type;
+  VALUE_PAIR *vp = NULL;
+
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if (!attr || !value)
+    {
+      c->lastErrMsg = "Invalid arguments";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (raddict_attr (attr, &da_attr, &da_type) == RADIUSCLIENT_ERR)
+    {
+      c->lastErrMsg = "Invalid attribute";
+      return RADIUSCLIENT_ERR;
+    }
+
+  switch (da_type)
+    {
+      case PW_TYPE_STRING:
+      case PW_TYPE_OCTETS:
+        if (value_len > MAX_STRING_LEN - 1)
+          goto invalid;
+        break;
+
+      case PW_TYPE_IPADDR:
+        if (value_len != 4)
+          goto invalid;
+        break;
+
+      case PW_TYPE_IPV6ADDR:
+        if (value_len != 16)
+          goto invalid;
+        break;
+
+      default:
+        goto invalid;
+    }
+
+  vp = paircreate (da_attr, da_type);
+  if (!vp)
+    {
+      c->lastErrMsg = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (da_type == PW_TYPE_IPADDR)
+    {
+      memcpy (&vp->vp_ipaddr, value, 4);
+    }
   else
-    /* Silently ignore the invalid attribute-value pair */
+    {
+      memcpy (vp->vp_octets, value, value_len);
+      vp->vp_octets[value_len] = '\0';
+    }
+
+  vp->length   = value_len;
+  vp->operator = T_OP_EQ;
+  pairadd (request_vps (c), vp);
 
   return RADIUSCLIENT_OK;
+
+invalid:
+  c->lastErrMsg = "Invalid value length for the attribute type";
+  return RADIUSCLIENT_ERR;
 }
 
 int
@@ -255,146 +570,1267 @@ fail:
 }
 
 int
-radclient_send (RADIUSClientCtrl *c, int packet_code)
+radclient_attr_get_value (RADIUSClientCtrl *c, const char *attr, int *kind,
+                          double *number, const uint8_t **octets,
+                          size_t *octets_len)
 {
-  int i;
-  int rcode;
-  struct pollfd pfd;
+  unsigned int da_attr;
+  int         da_type;
+  VALUE_PAIR *vp = NULL;
 
   if (!c)
     return RADIUSCLIENT_ERR;
 
-  /* Send */
-  memset (&c->request->src_ipaddr, 0, sizeof (c->request->src_ipaddr));
-  c->request->src_ipaddr.af = c->force_af;
-  c->request->src_port = 0;
-
-  c->sockfd = fr_socket (&c->request->src_ipaddr, c->request->src_port);
-
-  if (c->sockfd < 0)
+  if (!attr || !kind || !number || !octets || !octets_len)
     {
-      c->lastErrMsg = "Could not create new socket";
+      c->lastErrMsg = "Invalid arguments";
       return RADIUSCLIENT_ERR;
     }
 
-  for (i = 0; i < 4; i++)
-    {
-      ((uint32_t *) c->request->vector)[i] = fr_rand ();
-    }
-
-  c->packet_code = packet_code == RADIUSCLIENT_AUTH_REQ ?
-                     PW_AUTHENTICATION_REQUEST :
-                     PW_ACCOUNTING_REQUEST;
-
-  if (c->packet_code == PW_AUTHENTICATION_REQUEST)
-    {
-      c->request->dst_port = getport ("radius");
-      if (c->request->dst_port == 0)
-        c->request->dst_port = PW_AUTH_UDP_PORT;
-    }
-  else
+  if (!c->reply)
     {
-      c->request->dst_port = getport ("radacct");
-      if (c->request->dst_port == 0)
-        c->request->dst_port = PW_ACCT_UDP_PORT;
+      c->lastErrMsg = "No reply";
+      return RADIUSCLIENT_ERR;
     }
 
-  c->request->code   = c->packet_code;
-
-  c->request->id = (int) fr_rand () & 0xff;
-  c->request->sockfd = c->sockfd;
-
-  if (rad_send (c->request, NULL, c->secret) < 0)
+  if (raddict_attr (attr, &da_attr, &da_type) == RADIUSCLIENT_ERR)
     {
-      snprintf (c->errMsgBuf, sizeof (c->errMsgBuf) - 1,
-                "Failed to send packet: %s", fr_strerror ());
-      c->errMsgBuf[sizeof (c->errMsgBuf) - 1] = '\0';
-      c->lastErrMsg = c->errMsgBuf;
-      goto fail;
+      c->lastErrMsg = "Invalid attribute";
+      return RADIUSCLIENT_ERR;
     }
 
-  if (c->debug)
+  vp = pairfind (c->reply->vps, da_attr);
+  if (!vp)
     {
-      fprintf (stdout, "=== Sent =======\n");
-      print_hex (c->request);
+      c->lastErrMsg = "Attribute not found";
+      return RADIUSCLIENT_ERR;
     }
 
-  /* Receive */
-  pfd.fd = c->sockfd;
-  pfd.events = POLLIN;
-  
-  if (poll (&pfd, 1, c->timeout) <= 0)
+  switch (vp->type)
     {
-      c->lastErrMsg = "Socket error or timeout";
-      goto fail;
+      case PW_TYPE_INTEGER:
+      case PW_TYPE_DATE:
+      case PW_TYPE_BYTE:
+      case PW_TYPE_SHORT:
+        *kind   = RADIUSCLIENT_VALUE_NUMBER;
+        *number = vp->vp_integer;
+        break;
+
+      case PW_TYPE_SIGNED:
+        *kind   = RADIUSCLIENT_VALUE_NUMBER;
+        *number = (int32_t) vp->vp_integer;
+        break;
+
+      case PW_TYPE_IPADDR:
+        *kind   = RADIUSCLIENT_VALUE_NUMBER;
+        *number = ntohl (vp->vp_ipaddr);
+        break;
+
+#ifdef PW_TYPE_INTEGER64
+      case PW_TYPE_INTEGER64:
+        *kind   = RADIUSCLIENT_VALUE_NUMBER;
+        *number = vp->vp_integer64;
+        break;
+#endif
+
+      default:
+        *kind       = RADIUSCLIENT_VALUE_OCTETS;
+        *octets     = vp->vp_octets;
+        *octets_len = vp->length;
+        break;
     }
 
-  c->reply = rad_recv (c->sockfd, 0);
-  if (!c->reply)
-    {
-      c->lastErrMsg = "Reply packet is invalid";
-      goto fail;
-    }
+  return RADIUSCLIENT_OK;
+}
 
-  if (rad_verify (c->reply, c->request, c->secret) < 0)
-    {
-      c->lastErrMsg = "Failed to verify reply packet";
-      goto fail;
-    }
+/**
+ * Accounting requests are also sent to every replica, in parallel with
+ * the server of the client.
+ **/
+int
+radclient_replica_add (RADIUSClientCtrl *c, RADIUSServer *server)
+{
+  if (!c || !server)
+    return RADIUSCLIENT_ERR;
 
-  if (rad_decode (c->reply, c->request, c->secret) < 0)
+  if (!c->targets)
     {
-      c->lastErrMsg = "Failed to decode reply packet";
-      goto fail;
+      c->targets = calloc (RADIUSCLIENT_TARGETS_MAX,
+                           sizeof (RADIUSClientTarget));
+      if (!c->targets)
+        {
+          c->lastErrMsg = "Out of memory";
+          return RADIUSCLIENT_ERR;
+        }
+
+      c->targets_count = 1;
     }
 
-  if (c->debug)
+  if (c->targets_count >= RADIUSCLIENT_TARGETS_MAX)
     {
-      fprintf (stdout, "=== Received ===\n");
-      print_hex (c->reply);
-      fprintf (stdout, "=== Reply ======\n");
-      vp_printlist (stdout, c->reply->vps);
+      c->lastErrMsg = "Too many replicas";
+      return RADIUSCLIENT_ERR;
     }
 
-  if ((c->reply->code == PW_AUTHENTICATION_ACK) ||
-      (c->reply->code == PW_ACCOUNTING_RESPONSE) ||
-      (c->reply->code == PW_COA_ACK) ||
-      (c->reply->code == PW_DISCONNECT_ACK))
-    {
-      close (c->sockfd);
-      return RADIUSCLIENT_OK;
-    }
+  memset (&c->targets[c->targets_count], 0, sizeof (RADIUSClientTarget));
+  c->targets[c->targets_count++].server = radserver_ref (server);
 
-fail:
-  close (c->sockfd);
-  return RADIUSCLIENT_ERR;
+  return RADIUSCLIENT_OK;
 }
 
 void
-radclient_set_debug (RADIUSClientCtrl *c)
+radclient_replica_clear (RADIUSClientCtrl *c)
 {
-  if (!c)
+  int i;
+
+  if (!c || !c->targets)
     return;
 
-  c->debug = 1;
+  for (i = 1; i < c->targets_count; i++)
+    radserver_unref (c->targets[i].server);
+
+  free (c->targets);
+  c->targets = NULL;
+  c->targets_count = 0;
 }
 
-inline size_t
-radclient_ctrl_size  (void)
+int
+radclient_replica_policy (RADIUSClientCtrl *c, int policy)
 {
-  return sizeof (RADIUSClientCtrl);
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if ((policy < RADIUSCLIENT_POLICY_ALL) ||
+      (policy > RADIUSCLIENT_POLICY_FIRST))
+    {
+      c->lastErrMsg = "Invalid replication policy";
+      return RADIUSCLIENT_ERR;
+    }
+
+  c->policy = policy;
+
+  return RADIUSCLIENT_OK;
 }
 
-inline const char *
-radclient_get_last_err_msg (RADIUSClientCtrl *c)
+int
+radclient_target_count (RADIUSClientCtrl *c)
 {
-  if (!c)
-    return "";
+  if (!c || !c->server)
+    return 0;
 
-  return c->lastErrMsg;
+  return c->targets ? c->targets_count : 1;
 }
 
-/* Internal implementation */
+/**
+ * Without replicas, the only target result is the one of the client.
+ **/
+int
+radclient_target_result (RADIUSClientCtrl *c, int index,
+                         RADIUSServer **server, int *state, int *code,
+                         const char **errmsg, double *rtt)
+{
+  RADIUSClientTarget *t = NULL;
+
+  if (!c || !server || !state || !code || !errmsg || !rtt ||
+      (index < 0) || (index >= radclient_target_count (c)))
+    return RADIUSCLIENT_ERR;
+
+  if (!c->targets)
+    {
+      *server = c->server;
+      *state  = c->lastErrCode == RADIUSCLIENT_E_NONE ?
+                  RADIUSCLIENT_TARGET_OK : RADIUSCLIENT_TARGET_FAILED;
+      *code   = c->lastErrCode;
+      *errmsg = c->lastErrMsg;
+      *rtt    = 0;
+      return RADIUSCLIENT_OK;
+    }
+
+  t = &c->targets[index];
+
+  *server = index ? t->server : c->server;
+  *state  = t->state;
+  *code   = t->errCode;
+  *errmsg = t->errMsg ? t->errMsg : "";
+  *rtt    = t->rtt;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radclient_send (RADIUSClientCtrl *c, int packet_code)
+{
+  int res;
+
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if (request_prepare (c, packet_code) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  if ((c->packet_code == PW_AUTHENTICATION_REQUEST) && radcache_enabled () &&
+      (radcache_lookup (c->request, &c->reply) == RADIUSCLIENT_OK))
+    {
+      if (c->debug)
+        {
+          fprintf (stdout, "=== Cached =====\n");
+          vp_printlist (stdout, c->reply->vps);
+        }
+
+      if (c->reply->code == PW_AUTHENTICATION_ACK)
+        return RADIUSCLIENT_OK;
+
+      c->lastErrCode = RADIUSCLIENT_E_REJECTED;
+      c->lastErrMsg  = "Access rejected (cached)";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if ((rad_encode (c->request, NULL, c->secret) < 0) ||
+      (rad_sign (c->request, NULL, c->secret) < 0))
+    {
+      set_err_msg (c, RADIUSCLIENT_E_INVALID, "Failed to encode packet: %s",
+                   fr_strerror ());
+      return RADIUSCLIENT_ERR;
+    }
+
+  res = request_transact (c);
+
+  if ((c->packet_code == PW_AUTHENTICATION_REQUEST) && radcache_enabled () &&
+      c->reply)
+    radcache_store (c->request, c->reply);
+
+  return res;
+}
+
+int
+radclient_send_data (RADIUSClientCtrl *c, int packet_code,
+                     uint8_t *data, size_t data_len)
+{
+  int res;
+
+  if (!c)
+    return RADIUSCLIENT_ERR;
+
+  if (!data || (data_len < AUTH_HDR_LEN) || (data_len > MAX_PACKET_LEN))
+    {
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Invalid arguments";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (request_prepare (c, packet_code) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  /* The caller owns the buffer, only the header is ours to fill */
+  data[0] = c->request->code;
+  data[1] = c->request->id;
+  data[2] = (data_len >> 8) & 0xff;
+  data[3] = data_len & 0xff;
+
+  if (c->request->code == PW_ACCOUNTING_REQUEST)
+    memset (data + 4, 0, AUTH_VECTOR_LEN);
+  else
+    memcpy (data + 4, c->request->vector, AUTH_VECTOR_LEN);
+
+  c->request->data     = data;
+  c->request->data_len = data_len;
+  c->request->offset   = 0;
+
+  if (rad_sign (c->request, NULL, c->secret) < 0)
+    {
+      set_err_msg (c, RADIUSCLIENT_E_INVALID, "Failed to sign packet: %s",
+                   fr_strerror ());
+      res = RADIUSCLIENT_ERR;
+    }
+  else
+    {
+      res = request_transact (c);
+    }
+
+  c->request->data     = NULL;
+  c->request->data_len = 0;
+
+  return res;
+}
+
+void
+radclient_set_debug (RADIUSClientCtrl *c)
+{
+  if (!c)
+    return;
+
+  c->debug = 1;
+}
+
+inline size_t
+radclient_ctrl_size  (void)
+{
+  return sizeof (RADIUSClientCtrl);
+}
+
+inline const char *
+radclient_get_last_err_msg (RADIUSClientCtrl *c)
+{
+  if (!c)
+    return "";
+
+  return c->lastErrMsg;
+}
+
+int
+radclient_get_last_err_code (RADIUSClientCtrl *c)
+{
+  if (!c)
+    return RADIUSCLIENT_E_INVALID;
+
+  return c->lastErrCode;
+}
+
+/* Internal implementation */
+
+static void
+set_err_msg (RADIUSClientCtrl *c, int code, const char *fmt, ...)
+{
+  va_list ap;
+
+  c->lastErrCode = code;
+
+  if (!c->errMsgBuf)
+    c->errMsgBuf = malloc (RADIUSCLIENT_ERRMSG_SIZE);
+
+  if (!c->errMsgBuf)
+    {
+      c->lastErrMsg = "Out of memory";
+      return;
+    }
+
+  va_start (ap, fmt);
+  vsnprintf (c->errMsgBuf, RADIUSCLIENT_ERRMSG_SIZE, fmt, ap);
+  va_end (ap);
+
+  c->lastErrMsg = c->errMsgBuf;
+}
+
+/**
+ * Integral and within [min, limit), NaN fails every comparison. Doubles
+ * from 2^63 up have no fraction, below that the cast to int64_t is exact.
+ **/
+static int
+number_valid (double value, double min, double limit)
+{
+  if (!((value >= min) && (value < limit)))
+    return 0;
+
+  return (value >= 9223372036854775808.0) ||
+         ((double) (int64_t) value == value);
+}
+
+/**
+ * Attributes are kept on the client until the first send allocates the
+ * request packet, then they live in the request.
+ **/
+static VALUE_PAIR **
+request_vps (RADIUSClientCtrl *c)
+{
+  return c->request ? &c->request->vps : &c->vps;
+}
+
+static int
+request_prepare (RADIUSClientCtrl *c, int packet_code)
+{
+  int i;
+
+  if (!c->server)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Server is not set";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (!c->request)
+    {
+      c->request = rad_alloc (0);
+      if (!c->request)
+        {
+          c->lastErrCode = RADIUSCLIENT_E_INVALID;
+          c->lastErrMsg  = "Out of memory";
+          return RADIUSCLIENT_ERR;
+        }
+
+      c->request->vps = c->vps;
+      c->vps = NULL;
+    }
+
+  /* Drop the previous exchange, a new ID requires a fresh encoding */
+  if (c->request->data)
+    {
+      free (c->request->data);
+      c->request->data = NULL;
+      c->request->data_len = 0;
+    }
+
+  if (c->reply)
+    rad_free (&c->reply);
+
+  if (c->client_ipaddr.af != 0)
+    {
+      memcpy (&c->request->src_ipaddr, &c->client_ipaddr,
+              sizeof (c->request->src_ipaddr));
+    }
+  else
+    {
+      memset (&c->request->src_ipaddr, 0, sizeof (c->request->src_ipaddr));
+      c->request->src_ipaddr.af = c->force_af;
+    }
+
+  c->request->src_port = c->client_port;
+
+  for (i = 0; i < 4; i++)
+    {
+      ((uint32_t *) c->request->vector)[i] = fr_rand ();
+    }
+
+  c->packet_code = packet_code == RADIUSCLIENT_AUTH_REQ ?
+                     PW_AUTHENTICATION_REQUEST :
+                     PW_ACCOUNTING_REQUEST;
+
+  c->lastErrCode = RADIUSCLIENT_E_NONE;
+
+  memcpy (&c->request->dst_ipaddr, radserver_ipaddr (c->server),
+          sizeof (c->request->dst_ipaddr));
+
+  if (radserver_port (c->server) > 0)
+    {
+      c->request->dst_port = radserver_port (c->server);
+    }
+  else if (c->transport == RADCONN_TLS)
+    {
+      c->request->dst_port = RADCONN_RADSEC_PORT;
+    }
+  else if (c->packet_code == PW_AUTHENTICATION_REQUEST)
+    {
+      c->request->dst_port = getport ("radius");
+      if (c->request->dst_port == 0)
+        c->request->dst_port = PW_AUTH_UDP_PORT;
+    }
+  else
+    {
+      c->request->dst_port = getport ("radacct");
+      if (c->request->dst_port == 0)
+        c->request->dst_port = PW_ACCT_UDP_PORT;
+    }
+
+  /* RFC 6614 fixes the secret of RADIUS over TLS */
+  c->secret = radserver_secret (c->server);
+  if ((c->transport == RADCONN_TLS) && (c->secret[0] == '\0'))
+    c->secret = RADCONN_RADSEC_SECRET;
+
+  c->request->code   = c->packet_code;
+
+  c->request->id = (int) fr_rand () & 0xff;
+
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * Pacer class of the encoded request. Accounting is ranked by its
+ * Acct-Status-Type, Accounting-On/Off count as Stop.
+ **/
+static int
+request_class (RADIUSClientCtrl *c)
+{
+  const uint8_t *attr, *end;
+
+  if (c->request->code != PW_ACCOUNTING_REQUEST)
+    return RADPACER_CLASS_AUTH;
+
+  attr = c->request->data + AUTH_HDR_LEN;
+  end  = c->request->data + c->request->data_len;
+
+  while ((attr + 2 <= end) && (attr[1] >= 2) && (attr + attr[1] <= end))
+    {
+      if ((attr[0] == PW_ACCT_STATUS_TYPE) && (attr[1] == 6))
+        {
+          switch (attr[5])
+            {
+              case PW_STATUS_START:
+                return RADPACER_CLASS_START;
+              case PW_STATUS_ALIVE:
+                return RADPACER_CLASS_INTERIM;
+              default:
+                return RADPACER_CLASS_STOP;
+            }
+        }
+      attr += attr[1];
+    }
+
+  return RADPACER_CLASS_STOP;
+}
+
+/**
+ * Send the prepared request and wait for its reply, unless the pacer of
+ * the server sheds it or the circuit breaker of the destination says it
+ * is not worth trying.
+ * The request must already be encoded and signed, c->request->data is set.
+ **/
+static int
+request_transact (RADIUSClientCtrl *c)
+{
+  double start;
+  int probe;
+  int slot;
+  int res;
+
+  if (c->targets && (c->request->code == PW_ACCOUNTING_REQUEST))
+    return request_replicate (c);
+
+  /**
+   * The dispatcher process paces and guards the server for every worker,
+   * with the pacers and breakers of its own memory.
+   **/
+  if ((c->transport == RADCONN_UDP) && raddispatch_attached ())
+    return request_exchange_dispatch (c);
+
+  if (!c->dest)
+    c->dest = raddest_get (&c->request->dst_ipaddr, c->request->dst_port);
+
+  if (!c->pacer)
+    c->pacer = radpacer_get (&c->request->dst_ipaddr);
+
+  if (radpacer_acquire (c->pacer, request_class (c)) == RADIUSCLIENT_ERR)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SHED;
+      c->lastErrMsg  = "Request shed by the pacer";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (raddest_breaker_acquire (c->dest, &probe) == RADIUSCLIENT_ERR)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_CIRCUIT_OPEN;
+      c->lastErrMsg  = "Server is unavailable (circuit open)";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (raddest_limit_acquire (c->dest, &slot) == RADIUSCLIENT_ERR)
+    {
+      raddest_breaker_report (c->dest, probe, RADDEST_RESULT_NEUTRAL);
+      c->lastErrCode = RADIUSCLIENT_E_SHED;
+      c->lastErrMsg  = "Too many requests in flight to the server";
+      return RADIUSCLIENT_ERR;
+    }
+
+  start = request_now ();
+
+  if (c->transport != RADCONN_UDP)
+    res = request_exchange_stream (c);
+  else if (c->shards >= 0)
+    res = request_exchange_shard (c);
+  else
+    res = request_exchange (c);
+
+  breaker_report (c->dest, probe, c->lastErrCode);
+  raddest_limit_release (c->dest, slot, request_now () - start,
+                         dest_result (c->lastErrCode));
+
+  return res;
+}
+
+/**
+ * Send the encoded accounting request to the server and every replica at
+ * once, each copy signed with the secret of its target, then collect the
+ * replies until the policy is met, failed or the timeout expires.
+ **/
+static int
+request_replicate (RADIUSClientCtrl *c)
+{
+  RADIUSClientTarget *t = NULL;
+  RADIUSDest *dests[RADIUSCLIENT_TARGETS_MAX];
+  struct pollfd pfd[RADIUSCLIENT_TARGETS_MAX];
+  int     fds[RADIUSCLIENT_TARGETS_MAX];
+  int     index[RADIUSCLIENT_TARGETS_MAX];
+  uint8_t reply[MAX_PACKET_LEN];
+  uint8_t *copies = NULL;
+  double  start, remain;
+  int     n = c->targets_count;
+  int     ok = 0, failed = 0;
+  int     decision, npfd, rc, i, j;
+  ssize_t len;
+
+  if (c->transport != RADCONN_UDP)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Replicas require the UDP transport";
+      return RADIUSCLIENT_ERR;
+    }
+
+  copies = malloc (n * c->request->data_len);
+  if (!copies)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  start = request_now ();
+
+  for (i = 0; i < n; i++)
+    {
+      fds[i]   = -1;
+      dests[i] = NULL;
+
+      if (replicate_send (c, i, copies + i * c->request->data_len, &fds[i],
+                          &dests[i]) == RADIUSCLIENT_ERR)
+        failed++;
+    }
+
+  while (!(decision = replicate_decide (c->policy, ok, failed, n)))
+    {
+      remain = c->timeout - (request_now () - start);
+      if (remain <= 0)
+        break;
+
+      for (npfd = 0, i = 0; i < n; i++)
+        {
+          if (fds[i] < 0)
+            continue;
+
+          pfd[npfd].fd     = fds[i];
+          pfd[npfd].events = POLLIN;
+          index[npfd++]    = i;
+        }
+
+      rc = poll (pfd, npfd, (int) remain);
+      if ((rc < 0) && (errno == EINTR))
+        continue;
+      if (rc <= 0)
+        break;
+
+      for (j = 0; j < npfd; j++)
+        {
+          if (!pfd[j].revents)
+            continue;
+
+          i = index[j];
+          t = &c->targets[i];
+
+          len = recv (fds[i], reply, sizeof (reply), MSG_DONTWAIT);
+          if (len < 0)
+            {
+              if (errno == EAGAIN)
+                continue;
+
+              replicate_finish (t, dests[i], RADIUSCLIENT_TARGET_FAILED,
+                                RADIUSCLIENT_E_UNREACHABLE,
+                                "Server is unreachable");
+            }
+          else if (replicate_verify (reply, len,
+                                     copies + i * c->request->data_len,
+                                     radserver_secret (i ? t->server :
+                                                           c->server)) ==
+                     RADIUSCLIENT_ERR)
+            {
+              /* Not an answer to this request, keep waiting */
+              continue;
+            }
+          else if (reply[0] != PW_ACCOUNTING_RESPONSE)
+            replicate_finish (t, dests[i], RADIUSCLIENT_TARGET_FAILED,
+                              RADIUSCLIENT_E_REJECTED, "Request rejected");
+          else
+            replicate_finish (t, dests[i], RADIUSCLIENT_TARGET_OK,
+                              RADIUSCLIENT_E_NONE, "");
+
+          t->rtt = request_now () - start;
+
+          if (t->state == RADIUSCLIENT_TARGET_OK)
+            ok++;
+          else
+            failed++;
+
+          close (fds[i]);
+          fds[i] = -1;
+        }
+    }
+
+  /* Without a decision the rest timed out, otherwise nobody waited */
+  for (i = 0; i < n; i++)
+    {
+      if (fds[i] < 0)
+        continue;
+
+      if (!decision)
+        {
+          replicate_finish (&c->targets[i], dests[i],
+                            RADIUSCLIENT_TARGET_FAILED,
+                            RADIUSCLIENT_E_TIMEOUT, "Socket error or timeout");
+          failed++;
+        }
+      else
+        {
+          c->targets[i].errMsg = "Not waited for";
+          raddest_breaker_report (dests[i], c->targets[i].probe,
+                                  RADDEST_RESULT_NEUTRAL);
+        }
+
+      close (fds[i]);
+    }
+
+  free (copies);
+
+  if (decision > 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_NONE;
+      c->lastErrMsg  = "No errors";
+      return RADIUSCLIENT_OK;
+    }
+
+  /* Report the first failure */
+  for (i = 0; i < n; i++)
+    {
+      if (c->targets[i].state == RADIUSCLIENT_TARGET_FAILED)
+        break;
+    }
+
+  set_err_msg (c, i < n ? c->targets[i].errCode : RADIUSCLIENT_E_TIMEOUT,
+               "Replication failed, %d of %d targets answered", ok, n);
+
+  return RADIUSCLIENT_ERR;
+}
+
+/* 1 when the policy is met, -1 when it can not be anymore, 0 otherwise */
+static int
+replicate_decide (int policy, int ok, int failed, int count)
+{
+  int quorum = count / 2 + 1;
+
+  switch (policy)
+    {
+      case RADIUSCLIENT_POLICY_QUORUM:
+        if (ok >= quorum)
+          return 1;
+        return failed > count - quorum ? -1 : 0;
+
+      case RADIUSCLIENT_POLICY_FIRST:
+        if (ok > 0)
+          return 1;
+        return failed == count ? -1 : 0;
+
+      default:
+        if (ok == count)
+          return 1;
+        return ok + failed == count ? -1 : 0;
+    }
+}
+
+/**
+ * Sign the copy of the request for the target and send it on a socket of
+ * its own. The copy keeps the authenticator the reply is checked against.
+ **/
+static int
+replicate_send (RADIUSClientCtrl *c, int index, uint8_t *data, int *fd,
+                RADIUSDest **dest)
+{
+  RADIUSClientTarget *t = &c->targets[index];
+  RADIUSServer *server = index ? t->server : c->server;
+  struct sockaddr_storage dst;
+  socklen_t dst_len;
+  const fr_ipaddr_t *ipaddr = radserver_ipaddr (server);
+  uint8_t *signed_data = c->request->data;
+  uint8_t  vector[AUTH_VECTOR_LEN];
+  int      port = c->request->dst_port;
+  int      res;
+
+  t->state   = RADIUSCLIENT_TARGET_PENDING;
+  t->errCode = RADIUSCLIENT_E_NONE;
+  t->errMsg  = NULL;
+  t->rtt     = 0;
+  t->probe   = 0;
+
+  memcpy (data, c->request->data, c->request->data_len);
+
+  if (index)
+    {
+      if (radserver_port (server) > 0)
+        port = radserver_port (server);
+
+      /* Same as request_resign, on the copy and with the target secret */
+      memset (data + 4, 0, AUTH_VECTOR_LEN);
+      if (c->request->offset > 0)
+        memset (data + c->request->offset + 2, 0, AUTH_VECTOR_LEN);
+
+      memcpy (vector, c->request->vector, AUTH_VECTOR_LEN);
+      c->request->data = data;
+      res = rad_sign (c->request, NULL, radserver_secret (server));
+      c->request->data = signed_data;
+      memcpy (c->request->vector, vector, AUTH_VECTOR_LEN);
+
+      if (res < 0)
+        {
+          replicate_finish (t, NULL, RADIUSCLIENT_TARGET_FAILED,
+                            RADIUSCLIENT_E_INVALID, "Failed to sign packet");
+          return RADIUSCLIENT_ERR;
+        }
+    }
+
+  if (radpacer_acquire (radpacer_get (ipaddr), request_class (c)) ==
+        RADIUSCLIENT_ERR)
+    {
+      replicate_finish (t, NULL, RADIUSCLIENT_TARGET_FAILED,
+                        RADIUSCLIENT_E_SHED, "Request shed by the pacer");
+      return RADIUSCLIENT_ERR;
+    }
+
+  *dest = raddest_get (ipaddr, port);
+
+  if (raddest_breaker_acquire (*dest, &t->probe) == RADIUSCLIENT_ERR)
+    {
+      replicate_finish (t, NULL, RADIUSCLIENT_TARGET_FAILED,
+                        RADIUSCLIENT_E_CIRCUIT_OPEN,
+                        "Server is unavailable (circuit open)");
+      return RADIUSCLIENT_ERR;
+    }
+
+  /* Only the server of the client gets the configured source port */
+  *fd = fr_socket (&c->request->src_ipaddr,
+                   index ? 0 : c->request->src_port);
+  if (*fd < 0)
+    {
+      replicate_finish (t, *dest, RADIUSCLIENT_TARGET_FAILED,
+                        RADIUSCLIENT_E_SOCKET,
+                        "Could not create new socket");
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (!fr_ipaddr2sockaddr (ipaddr, port, &dst, &dst_len) ||
+      (connect (*fd, (struct sockaddr *) &dst, dst_len) < 0) ||
+      (send (*fd, data, c->request->data_len, 0) < 0))
+    {
+      close (*fd);
+      *fd = -1;
+      replicate_finish (t, *dest, RADIUSCLIENT_TARGET_FAILED,
+                        RADIUSCLIENT_E_UNREACHABLE, "Failed to send packet");
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (c->debug)
+    fprintf (stdout, "=== Sent to target %d ===\n", index);
+
+  return RADIUSCLIENT_OK;
+}
+
+/* Response authenticator of a reply to the given request */
+static int
+replicate_verify (const uint8_t *reply, size_t reply_len,
+                  const uint8_t *request, const char *secret)
+{
+  FR_MD5_CTX ctx;
+  uint8_t digest[AUTH_VECTOR_LEN];
+  size_t len;
+
+  if (reply_len < AUTH_HDR_LEN)
+    return RADIUSCLIENT_ERR;
+
+  len = (reply[2] << 8) | reply[3];
+  if ((len < AUTH_HDR_LEN) || (len > reply_len) || (reply[1] != request[1]))
+    return RADIUSCLIENT_ERR;
+
+  fr_MD5Init (&ctx);
+  fr_MD5Update (&ctx, reply, 4);
+  fr_MD5Update (&ctx, request + 4, AUTH_VECTOR_LEN);
+  fr_MD5Update (&ctx, reply + AUTH_HDR_LEN, len - AUTH_HDR_LEN);
+  fr_MD5Update (&ctx, (const uint8_t *) secret, strlen (secret));
+  fr_MD5Final (digest, &ctx);
+
+  return memcmp (digest, reply + 4, AUTH_VECTOR_LEN) == 0 ?
+           RADIUSCLIENT_OK : RADIUSCLIENT_ERR;
+}
+
+static void
+replicate_finish (RADIUSClientTarget *t, RADIUSDest *d, int state, int code,
+                  const char *errmsg)
+{
+  t->state   = state;
+  t->errCode = code;
+  t->errMsg  = errmsg;
+
+  if (d)
+    breaker_report (d, t->probe, code);
+}
+
+static void
+breaker_report (RADIUSDest *d, int probe, int code)
+{
+  raddest_breaker_report (d, probe, dest_result (code));
+}
+
+/* What an exchange says about the health of the server */
+static int
+dest_result (int code)
+{
+  switch (code)
+    {
+      case RADIUSCLIENT_E_TIMEOUT:
+      case RADIUSCLIENT_E_UNREACHABLE:
+        return RADDEST_RESULT_FAILURE;
+
+      case RADIUSCLIENT_E_SOCKET:
+        return RADDEST_RESULT_NEUTRAL;
+
+      default:
+        return RADDEST_RESULT_SUCCESS;
+    }
+}
+
+/* Monotonic milliseconds */
+static double
+request_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+request_exchange (RADIUSClientCtrl *c)
+{
+  struct pollfd pfd;
+  struct sockaddr_storage dst;
+  socklen_t dst_len;
+
+  c->sockfd = fr_socket (&c->request->src_ipaddr, c->request->src_port);
+
+  if (c->sockfd < 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SOCKET;
+      c->lastErrMsg  = "Could not create new socket";
+      return RADIUSCLIENT_ERR;
+    }
+
+  c->request->sockfd = c->sockfd;
+
+  /* A connected socket reports ICMP errors instead of waiting them out */
+  if (fr_ipaddr2sockaddr (&c->request->dst_ipaddr, c->request->dst_port,
+                          &dst, &dst_len) &&
+      (connect (c->sockfd, (struct sockaddr *) &dst, dst_len) < 0))
+    {
+      c->lastErrCode = RADIUSCLIENT_E_UNREACHABLE;
+      c->lastErrMsg  = "Could not connect socket to server";
+      goto fail;
+    }
+
+  if (rad_send (c->request, NULL, c->secret) < 0)
+    {
+      set_err_msg (c, RADIUSCLIENT_E_UNREACHABLE, "Failed to send packet: %s",
+                   fr_strerror ());
+      goto fail;
+    }
+
+  if (c->debug)
+    {
+      fprintf (stdout, "=== Sent =======\n");
+      print_hex (c->request);
+    }
+
+  /* Receive */
+  pfd.fd = c->sockfd;
+  pfd.events = POLLIN;
+  
+  if (poll (&pfd, 1, c->timeout) <= 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_TIMEOUT;
+      c->lastErrMsg  = "Socket error or timeout";
+      goto fail;
+    }
+
+  if (pfd.revents & POLLERR)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_UNREACHABLE;
+      c->lastErrMsg  = "Server is unreachable";
+      goto fail;
+    }
+
+  c->reply = rad_recv (c->sockfd, 0);
+  if (!c->reply)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_REPLY;
+      c->lastErrMsg  = "Reply packet is invalid";
+      goto fail;
+    }
+
+  close (c->sockfd);
+  return request_reply (c);
+
+fail:
+  close (c->sockfd);
+  return RADIUSCLIENT_ERR;
+}
+
+/**
+ * Exchange the request over the persistent connection of the server,
+ * the packet ID must be unique among the requests in flight on it.
+ **/
+static int
+request_exchange_stream (RADIUSClientCtrl *c)
+{
+  uint8_t buf[MAX_PACKET_LEN];
+  size_t  len = sizeof (buf);
+  const char *errmsg = NULL;
+  int id;
+  int code;
+
+  if (!c->conn)
+    c->conn = radconn_get (&c->request->dst_ipaddr, c->request->dst_port,
+                           radserver_hostname (c->server), c->transport,
+                           c->tls);
+
+  if (!c->conn)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SOCKET;
+      c->lastErrMsg  = "Could not create new connection";
+      return RADIUSCLIENT_ERR;
+    }
+
+  id = radconn_id_reserve (c->conn, c->request->id);
+  if (id < 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SOCKET;
+      c->lastErrMsg  = "Too many requests in flight";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if ((id != c->request->id) && (request_resign (c, id) < 0))
+    {
+      radconn_id_release (c->conn, id);
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Failed to sign packet";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (c->debug)
+    {
+      fprintf (stdout, "=== Sent =======\n");
+      print_hex (c->request);
+    }
+
+  code = radconn_exchange (c->conn, id, c->request->data,
+                           c->request->data_len, (int) c->timeout,
+                           buf, &len, &errmsg);
+
+  if (code != RADIUSCLIENT_E_NONE)
+    {
+      c->lastErrCode = code;
+      c->lastErrMsg  = errmsg ? errmsg : "Socket error or timeout";
+      return RADIUSCLIENT_ERR;
+    }
+
+  return request_reply_data (c, buf, len);
+}
+
+/**
+ * Exchange the request over the socket shard of the current CPU, each
+ * shard has its own source port and packet ID space.
+ **/
+static int
+request_exchange_shard (RADIUSClientCtrl *c)
+{
+  RADIUSShard *shard = NULL;
+  uint8_t buf[MAX_PACKET_LEN];
+  size_t  len = sizeof (buf);
+  const char *errmsg = NULL;
+  int id;
+  int code;
+
+  if (!c->shard_set)
+    c->shard_set = radshard_get (&c->request->dst_ipaddr,
+                                 c->request->dst_port,
+                                 &c->request->src_ipaddr,
+                                 c->request->src_port, c->shards,
+                                 c->shard_flags);
+
+  shard = radshard_local (c->shard_set);
+  if (!shard)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SOCKET;
+      c->lastErrMsg  = "Could not create socket shards";
+      return RADIUSCLIENT_ERR;
+    }
+
+  id = radshard_id_reserve (shard, c->request->id);
+  if (id < 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_SOCKET;
+      c->lastErrMsg  = "Too many requests in flight";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if ((id != c->request->id) && (request_resign (c, id) < 0))
+    {
+      radshard_id_release (shard, id);
+      c->lastErrCode = RADIUSCLIENT_E_INVALID;
+      c->lastErrMsg  = "Failed to sign packet";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (c->debug)
+    {
+      fprintf (stdout, "=== Sent =======\n");
+      print_hex (c->request);
+    }
+
+  code = radshard_exchange (shard, id, c->request->data,
+                            c->request->data_len, (int) c->timeout,
+                            buf, &len, &errmsg);
+
+  if (code != RADIUSCLIENT_E_NONE)
+    {
+      c->lastErrCode = code;
+      c->lastErrMsg  = errmsg ? errmsg : "Socket error or timeout";
+      return RADIUSCLIENT_ERR;
+    }
+
+  return request_reply_data (c, buf, len);
+}
+
+/**
+ * Exchange the request through the dispatcher process, which owns the
+ * socket and the packet ID space of the server for all the workers.
+ **/
+static int
+request_exchange_dispatch (RADIUSClientCtrl *c)
+{
+  uint8_t buf[MAX_PACKET_LEN];
+  size_t  len = sizeof (buf);
+  const char *errmsg = NULL;
+  int code;
+
+  if (c->debug)
+    {
+      fprintf (stdout, "=== Dispatched =\n");
+      print_hex (c->request);
+    }
+
+  code = raddispatch_exchange (&c->request->dst_ipaddr, c->request->dst_port,
+                               c->secret, c->request->data,
+                               c->request->data_len, c->request->offset,
+                               request_class (c), (int) c->timeout, buf,
+                               &len, &errmsg);
+
+  if (code != RADIUSCLIENT_E_NONE)
+    {
+      c->lastErrCode = code;
+      c->lastErrMsg  = errmsg ? errmsg : "Socket error or timeout";
+      return RADIUSCLIENT_ERR;
+    }
+
+  /* The reply answers the ID and authenticator the dispatcher sent */
+  c->request->id = c->request->data[1];
+  memcpy (c->request->vector, c->request->data + 4, AUTH_VECTOR_LEN);
+
+  return request_reply_data (c, buf, len);
+}
+
+/**
+ * Turn the raw reply received by a shared socket into c->reply.
+ **/
+static int
+request_reply_data (RADIUSClientCtrl *c, const uint8_t *data,
+                    size_t data_len)
+{
+  c->reply = rad_alloc (0);
+  if (c->reply)
+    c->reply->data = malloc (data_len);
+
+  if (!c->reply || !c->reply->data)
+    {
+      if (c->reply)
+        rad_free (&c->reply);
+
+      c->lastErrCode = RADIUSCLIENT_E_REPLY;
+      c->lastErrMsg  = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  memcpy (c->reply->data, data, data_len);
+  c->reply->data_len = data_len;
+  c->reply->code     = data[0];
+  c->reply->id       = data[1];
+  c->reply->sockfd   = -1;
+  memcpy (c->reply->vector, data + 4, AUTH_VECTOR_LEN);
+  memcpy (&c->reply->src_ipaddr, &c->request->dst_ipaddr,
+          sizeof (fr_ipaddr_t));
+  c->reply->src_port = c->request->dst_port;
+
+  if (!rad_packet_ok (c->reply, 0))
+    {
+      rad_free (&c->reply);
+      c->lastErrCode = RADIUSCLIENT_E_REPLY;
+      c->lastErrMsg  = "Reply packet is invalid";
+      return RADIUSCLIENT_ERR;
+    }
+
+  return request_reply (c);
+}
+
+/**
+ * Move an encoded request to another packet ID, the signature covers it.
+ **/
+static int
+request_resign (RADIUSClientCtrl *c, int id)
+{
+  c->request->id      = id;
+  c->request->data[1] = id;
+
+  if (c->request->code == PW_ACCOUNTING_REQUEST)
+    memset (c->request->data + 4, 0, AUTH_VECTOR_LEN);
+
+  if (c->request->offset > 0)
+    memset (c->request->data + c->request->offset + 2, 0, AUTH_VECTOR_LEN);
+
+  return rad_sign (c->request, NULL, c->secret);
+}
+
+/**
+ * Verify and decode the received c->reply.
+ **/
+static int
+request_reply (RADIUSClientCtrl *c)
+{
+  if (rad_verify (c->reply, c->request, c->secret) < 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_REPLY;
+      c->lastErrMsg  = "Failed to verify reply packet";
+      rad_free (&c->reply);
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (rad_decode (c->reply, c->request, c->secret) < 0)
+    {
+      c->lastErrCode = RADIUSCLIENT_E_REPLY;
+      c->lastErrMsg  = "Failed to decode reply packet";
+      rad_free (&c->reply);
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (c->debug)
+    {
+      fprintf (stdout, "=== Received ===\n");
+      print_hex (c->reply);
+      fprintf (stdout, "=== Reply ======\n");
+      vp_printlist (stdout, c->reply->vps);
+    }
+
+  if ((c->reply->code == PW_AUTHENTICATION_ACK) ||
+      (c->reply->code == PW_ACCOUNTING_RESPONSE) ||
+      (c->reply->code == PW_COA_ACK) ||
+      (c->reply->code == PW_DISCONNECT_ACK))
+    return RADIUSCLIENT_OK;
+
+  c->lastErrCode = RADIUSCLIENT_E_REJECTED;
+  c->lastErrMsg  = "Request rejected";
+
+  return RADIUSCLIENT_ERR;
+}
 
 static int
 getport (const char *name)
@@ -20,34 +20,98 @@
 #ifndef _RADIUSCLIENT_H
 #define _RADIUSCLIENT_H
 
+#include <stdint.h>
+
 typedef struct _RADIUSClientCtrl RADIUSClientCtrl;
 
+/* Shared server configuration, see radiusserver.h */
+struct _RADIUSServer;
+
 enum {
   RADIUSCLIENT_ERR  =  0,
   RADIUSCLIENT_OK
 };
 
+enum {
+  RADIUSCLIENT_E_NONE = 0,
+  RADIUSCLIENT_E_INVALID,
+  RADIUSCLIENT_E_SOCKET,
+  RADIUSCLIENT_E_TIMEOUT,
+  RADIUSCLIENT_E_UNREACHABLE,
+  RADIUSCLIENT_E_REPLY,
+  RADIUSCLIENT_E_REJECTED,
+  RADIUSCLIENT_E_CIRCUIT_OPEN,
+  RADIUSCLIENT_E_SHED
+};
+
+enum {
+  RADIUSCLIENT_VALUE_NUMBER = 0,
+  RADIUSCLIENT_VALUE_OCTETS
+};
+
 enum {
   RADIUSCLIENT_AUTH_REQ = 0,
   RADIUSCLIENT_ACCT_REQ
 };
 
+/* Accounting replicated to several servers */
+#define RADIUSCLIENT_TARGETS_MAX  8
+
+enum {
+  RADIUSCLIENT_POLICY_ALL = 0,
+  RADIUSCLIENT_POLICY_QUORUM,
+  RADIUSCLIENT_POLICY_FIRST
+};
+
+enum {
+  RADIUSCLIENT_TARGET_PENDING = 0,
+  RADIUSCLIENT_TARGET_OK,
+  RADIUSCLIENT_TARGET_FAILED
+};
+
 /* RADIUS client API */
 int  radclient_ctrl_init  (RADIUSClientCtrl *c);
 void radclient_ctrl_free  (RADIUSClientCtrl *c);
 
 int radclient_server_set (RADIUSClientCtrl *c, const char *hostname,
                           int port, const char *secret);
+int radclient_server_use (RADIUSClientCtrl *c, struct _RADIUSServer *server);
+int radclient_transport_set (RADIUSClientCtrl *c, const char *transport,
+                             const char *ca_file, const char *cert_file,
+                             const char *key_file, int verify);
+int radclient_source_set (RADIUSClientCtrl *c, const char *hostname,
+                          int port);
+int radclient_shards_set (RADIUSClientCtrl *c, int count, int flags);
 int radclient_attr_set   (RADIUSClientCtrl *c, const char *attr,
                           const char *value);
 int radclient_attr_get   (RADIUSClientCtrl *c, const char *attr,
                           char *value, size_t value_size, const char **opr);
 
+int radclient_attr_set_number (RADIUSClientCtrl *c, const char *attr,
+                               double value);
+int radclient_attr_set_octets (RADIUSClientCtrl *c, const char *attr,
+                               const uint8_t *value, size_t value_len);
+int radclient_attr_get_value  (RADIUSClientCtrl *c, const char *attr,
+                               int *kind, double *number,
+                               const uint8_t **octets, size_t *octets_len);
+
+int  radclient_replica_add    (RADIUSClientCtrl *c,
+                               struct _RADIUSServer *server);
+void radclient_replica_clear  (RADIUSClientCtrl *c);
+int  radclient_replica_policy (RADIUSClientCtrl *c, int policy);
+int  radclient_target_count   (RADIUSClientCtrl *c);
+int  radclient_target_result  (RADIUSClientCtrl *c, int index,
+                               struct _RADIUSServer **server, int *state,
+                               int *code, const char **errmsg, double *rtt);
+
 int radclient_send       (RADIUSClientCtrl *c, int packet_code);
+int radclient_send_data  (RADIUSClientCtrl *c, int packet_code,
+                          uint8_t *data, size_t data_len);
 
 void radclient_set_debug (RADIUSClientCtrl *c);
 
 inline size_t radclient_ctrl_size (void);
 inline const char *radclient_get_last_err_msg (RADIUSClientCtrl *c);
+int radclient_get_last_err_code (RADIUSClientCtrl *c);
 
 #endif /* _RADIUSCLIENT_H */
@@ -0,0 +1,906 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+#include "radiusclient.h"
+#include "radiusconn.h"
+
+#define RADCONN_BACKOFF_MIN   100
+#define RADCONN_BACKOFF_MAX   30000
+
+enum {
+  RADCONN_SLOT_FREE = 0,
+  RADCONN_SLOT_RESERVED,
+  RADCONN_SLOT_WAITING,
+  RADCONN_SLOT_DONE,
+  RADCONN_SLOT_FAILED
+};
+
+typedef struct _RADIUSConnSlot {
+  int      state;
+  int      err;
+  size_t   len;
+  uint8_t *data;
+} RADIUSConnSlot;
+
+/**
+ * One connection per destination and transport carries the requests of
+ * every client, replies are matched to their request by the packet ID.
+ * Whichever waiting thread finds nobody reading becomes the reader and
+ * hands the replies of the others over through the slots.
+ **/
+struct _RADIUSConn {
+  RADIUSConn     *next;
+  fr_ipaddr_t     ipaddr;
+  int             port;
+  int             transport;
+  char           *host;
+  RADIUSConnTLS  *tls;
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  int             fd;
+  unsigned int    generation;
+  int             reading;
+  int             connecting;
+  int             failures;
+  long long       retry_at;
+#ifdef HAVE_OPENSSL
+  SSL_CTX        *ctx;
+  SSL            *ssl;
+  SSL_SESSION    *session;
+#endif
+  RADIUSConnSlot  slots[256];
+  size_t          rlen;
+  uint8_t         rbuf[MAX_PACKET_LEN];
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  RADIUSConn     *conns;
+} registry = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* Internal declaration */
+
+static long long conn_now      (void);
+static int       conn_tls_same (const RADIUSConnTLS *a,
+                                const RADIUSConnTLS *b);
+static int       conn_open     (RADIUSConn *conn, long long deadline,
+                                const char **errmsg);
+static void      conn_close    (RADIUSConn *conn, int err);
+static int       conn_wait     (int fd, short events, long long deadline);
+static int       conn_write    (RADIUSConn *conn, const uint8_t *data,
+                                size_t len, long long deadline);
+static ssize_t   conn_read     (RADIUSConn *conn);
+static int       conn_dispatch (RADIUSConn *conn);
+static void      conn_receive  (RADIUSConn *conn, long long deadline);
+#ifdef HAVE_OPENSSL
+static int       conn_tls_init (RADIUSConn *conn, const char **errmsg);
+static int       conn_tls_peer (RADIUSConn *conn, SSL *ssl,
+                                const char **errmsg);
+#endif
+
+/* Implementation */
+
+RADIUSConn *
+radconn_get (const fr_ipaddr_t *ipaddr, int port, const char *host,
+             int transport, const RADIUSConnTLS *tls)
+{
+  RADIUSConn *conn = NULL;
+  pthread_condattr_t attr;
+
+  if (!ipaddr || !host || (transport == RADCONN_UDP))
+    return NULL;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  /**
+   * The host name is part of the key, it is what the certificate proves,
+   * and so are the TLS settings: clients that trust different CAs or
+   * present different certificates never share a connection.
+   **/
+  for (conn = registry.conns; conn; conn = conn->next)
+    {
+      if ((conn->port == port) && (conn->transport == transport) &&
+          (fr_ipaddr_cmp (&conn->ipaddr, ipaddr) == 0) &&
+          !strcasecmp (conn->host, host) &&
+          ((transport != RADCONN_TLS) || conn_tls_same (conn->tls, tls)))
+        goto done;
+    }
+
+  conn = calloc (1, sizeof (RADIUSConn));
+  if (!conn)
+    goto done;
+
+  conn->host = strdup (host);
+  if (!conn->host)
+    {
+      free (conn);
+      conn = NULL;
+      goto done;
+    }
+
+  memcpy (&conn->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  conn->port      = port;
+  conn->transport = transport;
+  conn->fd        = -1;
+
+  if (tls)
+    {
+      conn->tls = radconn_tls_new (tls->ca_file, tls->cert_file,
+                                   tls->key_file, tls->verify);
+      if (!conn->tls)
+        {
+          free (conn->host);
+          free (conn);
+          conn = NULL;
+          goto done;
+        }
+    }
+
+  pthread_mutex_init (&conn->mutex, NULL);
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&conn->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  conn->next = registry.conns;
+  registry.conns = conn;
+
+done:
+  pthread_mutex_unlock (&registry.mutex);
+  return conn;
+}
+
+int
+radconn_id_reserve (RADIUSConn *conn, int preferred)
+{
+  int i;
+  int id = -1;
+
+  if (!conn)
+    return -1;
+
+  pthread_mutex_lock (&conn->mutex);
+
+  for (i = 0; i < 256; i++)
+    {
+      if (conn->slots[(preferred + i) & 0xff].state == RADCONN_SLOT_FREE)
+        {
+          id = (preferred + i) & 0xff;
+          conn->slots[id].state = RADCONN_SLOT_RESERVED;
+          break;
+        }
+    }
+
+  pthread_mutex_unlock (&conn->mutex);
+
+  return id;
+}
+
+void
+radconn_id_release (RADIUSConn *conn, int id)
+{
+  if (!conn || (id < 0) || (id > 0xff))
+    return;
+
+  pthread_mutex_lock (&conn->mutex);
+
+  free (conn->slots[id].data);
+  memset (&conn->slots[id], 0, sizeof (RADIUSConnSlot));
+
+  pthread_mutex_unlock (&conn->mutex);
+}
+
+int
+radconn_exchange (RADIUSConn *conn, int id, const uint8_t *data,
+                  size_t data_len, int timeout, uint8_t *reply,
+                  size_t *reply_len, const char **errmsg)
+{
+  RADIUSConnSlot *slot = NULL;
+  struct timespec ts;
+  long long deadline;
+  int res = RADIUSCLIENT_E_NONE;
+
+  if (!conn || (id < 0) || (id > 0xff) || !reply || !reply_len)
+    return RADIUSCLIENT_E_INVALID;
+
+  deadline = conn_now () + timeout;
+  slot     = &conn->slots[id];
+
+  pthread_mutex_lock (&conn->mutex);
+
+  /* Another thread is opening the connection, wait for its outcome */
+  while (conn->connecting)
+    {
+      if (conn_now () >= deadline)
+        {
+          *errmsg = "Socket error or timeout";
+          res = RADIUSCLIENT_E_TIMEOUT;
+          goto done;
+        }
+
+      ts.tv_sec  = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait (&conn->cond, &conn->mutex, &ts);
+    }
+
+  if (conn->fd < 0)
+    {
+      int opened;
+
+      if (conn_now () < conn->retry_at)
+        {
+          *errmsg = "Connection is backing off after a failure";
+          res = RADIUSCLIENT_E_UNREACHABLE;
+          goto done;
+        }
+
+      /* The handshake may take a while, other clients must not wait */
+      conn->connecting = 1;
+      pthread_mutex_unlock (&conn->mutex);
+
+      opened = conn_open (conn, deadline, errmsg);
+
+      pthread_mutex_lock (&conn->mutex);
+      conn->connecting = 0;
+      pthread_cond_broadcast (&conn->cond);
+
+      if (opened < 0)
+        {
+          conn->failures++;
+          conn->retry_at = conn_now () +
+            (conn->failures > 8 ? RADCONN_BACKOFF_MAX :
+               RADCONN_BACKOFF_MIN << conn->failures);
+          if (conn->retry_at > conn_now () + RADCONN_BACKOFF_MAX)
+            conn->retry_at = conn_now () + RADCONN_BACKOFF_MAX;
+
+          res = RADIUSCLIENT_E_UNREACHABLE;
+          goto done;
+        }
+
+      conn->failures = 0;
+    }
+
+  slot->state = RADCONN_SLOT_WAITING;
+
+  if (conn_write (conn, data, data_len, deadline) < 0)
+    {
+      *errmsg = "Failed to write to the connection";
+      conn_close (conn, RADIUSCLIENT_E_UNREACHABLE);
+    }
+
+  while (slot->state == RADCONN_SLOT_WAITING)
+    {
+      if (conn_now () >= deadline)
+        {
+          *errmsg = "Socket error or timeout";
+          res = RADIUSCLIENT_E_TIMEOUT;
+          goto done;
+        }
+
+      if (!conn->reading)
+        {
+          conn_receive (conn, deadline);
+          continue;
+        }
+
+      ts.tv_sec  = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait (&conn->cond, &conn->mutex, &ts);
+    }
+
+  if (slot->state == RADCONN_SLOT_DONE)
+    {
+      if (slot->len > *reply_len)
+        {
+          *errmsg = "Reply packet is too large";
+          res = RADIUSCLIENT_E_REPLY;
+          goto done;
+        }
+
+      memcpy (reply, slot->data, slot->len);
+      *reply_len = slot->len;
+    }
+  else
+    {
+      *errmsg = "Connection to server is lost";
+      res = slot->err;
+    }
+
+done:
+  free (slot->data);
+  memset (slot, 0, sizeof (RADIUSConnSlot));
+
+  pthread_mutex_unlock (&conn->mutex);
+
+  return res;
+}
+
+int
+radconn_transport_value (const char *name)
+{
+  if (!name || !strcmp (name, "udp"))
+    return RADCONN_UDP;
+
+  if (!strcmp (name, "tcp"))
+    return RADCONN_TCP;
+
+  if (!strcmp (name, "tls") || !strcmp (name, "radsec"))
+    return radconn_tls_available () ? RADCONN_TLS : -1;
+
+  return -1;
+}
+
+int
+radconn_tls_available (void)
+{
+#ifdef HAVE_OPENSSL
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+RADIUSConnTLS *
+radconn_tls_new (const char *ca_file, const char *cert_file,
+                 const char *key_file, int verify)
+{
+  RADIUSConnTLS *tls = calloc (1, sizeof (RADIUSConnTLS));
+
+  if (!tls)
+    return NULL;
+
+  tls->ca_file   = ca_file ? strdup (ca_file) : NULL;
+  tls->cert_file = cert_file ? strdup (cert_file) : NULL;
+  tls->key_file  = key_file ? strdup (key_file) : NULL;
+  tls->verify    = verify;
+
+  return tls;
+}
+
+void
+radconn_tls_free (RADIUSConnTLS *tls)
+{
+  if (!tls)
+    return;
+
+  free (tls->ca_file);
+  free (tls->cert_file);
+  free (tls->key_file);
+  free (tls);
+}
+
+/* Internal implementation */
+
+/* Monotonic milliseconds, the clock of the cond waits too */
+static long long
+conn_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+conn_str_same (const char *a, const char *b)
+{
+  return (a == b) || (a && b && !strcmp (a, b));
+}
+
+/* No settings at all verify against the default CA paths */
+static int
+conn_tls_same (const RADIUSConnTLS *a, const RADIUSConnTLS *b)
+{
+  return conn_str_same (a ? a->ca_file : NULL, b ? b->ca_file : NULL) &&
+         conn_str_same (a ? a->cert_file : NULL, b ? b->cert_file : NULL) &&
+         conn_str_same (a ? a->key_file : NULL, b ? b->key_file : NULL) &&
+         ((a ? !!a->verify : 1) == (b ? !!b->verify : 1));
+}
+
+/**
+ * Runs without conn->mutex, the caller has set conn->connecting so the
+ * TLS context and the session are ours until it is cleared. The new
+ * socket is only published under the lock, a reader still polling the
+ * old one must not see it change under its feet.
+ **/
+static int
+conn_open (RADIUSConn *conn, long long deadline, const char **errmsg)
+{
+  struct sockaddr_storage dst;
+  socklen_t dst_len;
+  int fd;
+  int one = 1;
+  int err = 0;
+  socklen_t err_len = sizeof (err);
+#ifdef HAVE_OPENSSL
+  SSL *ssl = NULL;
+#endif
+
+  if (!fr_ipaddr2sockaddr (&conn->ipaddr, conn->port, &dst, &dst_len))
+    {
+      *errmsg = "Invalid server address";
+      return -1;
+    }
+
+  fd = socket (dst.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      *errmsg = "Could not create new socket";
+      return -1;
+    }
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  if ((connect (fd, (struct sockaddr *) &dst, dst_len) < 0) &&
+      (errno != EINPROGRESS))
+    goto fail;
+
+  if ((conn_wait (fd, POLLOUT, deadline) <= 0) ||
+      (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) ||
+      err)
+    goto fail;
+
+#ifdef HAVE_OPENSSL
+  if (conn->transport == RADCONN_TLS)
+    {
+      int rcode;
+
+      if (conn_tls_init (conn, errmsg) < 0)
+        goto fail_tls;
+
+      ssl = SSL_new (conn->ctx);
+      if (!ssl)
+        goto fail_tls;
+
+      SSL_set_fd (ssl, fd);
+
+      if (conn_tls_peer (conn, ssl, errmsg) < 0)
+        goto fail_tls;
+
+      /* Resume the previous session, this skips the full handshake */
+      if (conn->session)
+        SSL_set_session (ssl, conn->session);
+
+      while ((rcode = SSL_connect (ssl)) <= 0)
+        {
+          switch (SSL_get_error (ssl, rcode))
+            {
+              case SSL_ERROR_WANT_READ:
+                if (conn_wait (fd, POLLIN, deadline) <= 0)
+                  goto fail_tls;
+                break;
+
+              case SSL_ERROR_WANT_WRITE:
+                if (conn_wait (fd, POLLOUT, deadline) <= 0)
+                  goto fail_tls;
+                break;
+
+              default:
+                goto fail_tls;
+            }
+        }
+    }
+#endif
+
+  pthread_mutex_lock (&conn->mutex);
+
+  conn->fd = fd;
+#ifdef HAVE_OPENSSL
+  conn->ssl = ssl;
+#endif
+  conn->generation++;
+  conn->rlen = 0;
+
+  pthread_mutex_unlock (&conn->mutex);
+
+  return 0;
+
+#ifdef HAVE_OPENSSL
+fail_tls:
+  if (ssl)
+    SSL_free (ssl);
+
+  if (conn->session)
+    {
+      SSL_SESSION_free (conn->session);
+      conn->session = NULL;
+    }
+
+  close (fd);
+
+  if (*errmsg == NULL)
+    *errmsg = "TLS handshake with server failed";
+  return -1;
+#endif
+
+fail:
+  close (fd);
+
+  *errmsg = "Could not connect to server";
+  return -1;
+}
+
+static void
+conn_close (RADIUSConn *conn, int err)
+{
+  int i;
+
+#ifdef HAVE_OPENSSL
+  if (conn->ssl)
+    {
+      SSL_SESSION *session = SSL_get1_session (conn->ssl);
+
+      if (session)
+        {
+          if (conn->session)
+            SSL_SESSION_free (conn->session);
+          conn->session = session;
+        }
+
+      SSL_free (conn->ssl);
+      conn->ssl = NULL;
+    }
+#endif
+
+  if (conn->fd >= 0)
+    close (conn->fd);
+
+  conn->fd   = -1;
+  conn->rlen = 0;
+
+  for (i = 0; i < 256; i++)
+    {
+      if (conn->slots[i].state == RADCONN_SLOT_WAITING)
+        {
+          conn->slots[i].state = RADCONN_SLOT_FAILED;
+          conn->slots[i].err   = err;
+        }
+    }
+
+  pthread_cond_broadcast (&conn->cond);
+}
+
+static int
+conn_wait (int fd, short events, long long deadline)
+{
+  struct pollfd pfd;
+  long long remain = deadline - conn_now ();
+
+  if (remain <= 0)
+    return 0;
+
+  pfd.fd     = fd;
+  pfd.events = events;
+
+  return poll (&pfd, 1, remain);
+}
+
+static int
+conn_write (RADIUSConn *conn, const uint8_t *data, size_t len,
+            long long deadline)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+#ifdef HAVE_OPENSSL
+      if (conn->ssl)
+        {
+          n = SSL_write (conn->ssl, data, len);
+          if (n <= 0)
+            {
+              switch (SSL_get_error (conn->ssl, n))
+                {
+                  case SSL_ERROR_WANT_READ:
+                    if (conn_wait (conn->fd, POLLIN, deadline) <= 0)
+                      return -1;
+                    continue;
+
+                  case SSL_ERROR_WANT_WRITE:
+                    if (conn_wait (conn->fd, POLLOUT, deadline) <= 0)
+                      return -1;
+                    continue;
+
+                  default:
+                    return -1;
+                }
+            }
+        }
+      else
+#endif
+        {
+          n = send (conn->fd, data, len, MSG_NOSIGNAL);
+          if (n < 0)
+            {
+              if ((errno != EAGAIN) && (errno != EINTR))
+                return -1;
+
+              if (conn_wait (conn->fd, POLLOUT, deadline) <= 0)
+                return -1;
+              continue;
+            }
+        }
+
+      data += n;
+      len  -= n;
+    }
+
+  return 0;
+}
+
+/**
+ * Read what is available without blocking.
+ * Return the number of bytes read, 0 when it would block or -1 when the
+ * connection is closed or broken.
+ **/
+static ssize_t
+conn_read (RADIUSConn *conn)
+{
+  ssize_t n;
+  size_t  room = sizeof (conn->rbuf) - conn->rlen;
+
+#ifdef HAVE_OPENSSL
+  if (conn->ssl)
+    {
+      n = SSL_read (conn->ssl, conn->rbuf + conn->rlen, room);
+      if (n <= 0)
+        {
+          switch (SSL_get_error (conn->ssl, n))
+            {
+              case SSL_ERROR_WANT_READ:
+              case SSL_ERROR_WANT_WRITE:
+                return 0;
+
+              default:
+                return -1;
+            }
+        }
+
+      conn->rlen += n;
+      return n;
+    }
+#endif
+
+  n = recv (conn->fd, conn->rbuf + conn->rlen, room, 0);
+  if (n < 0)
+    return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+
+  if (n == 0)
+    return -1;
+
+  conn->rlen += n;
+  return n;
+}
+
+/**
+ * Hand the complete packets of the read buffer over to their slots.
+ * Return -1 on a framing error, the stream can not be resynchronized.
+ **/
+static int
+conn_dispatch (RADIUSConn *conn)
+{
+  RADIUSConnSlot *slot = NULL;
+  size_t len;
+
+  while (conn->rlen >= 4)
+    {
+      len = (conn->rbuf[2] << 8) | conn->rbuf[3];
+
+      if ((len < AUTH_HDR_LEN) || (len > MAX_PACKET_LEN))
+        return -1;
+
+      if (conn->rlen < len)
+        break;
+
+      slot = &conn->slots[conn->rbuf[1]];
+
+      /* Replies to abandoned requests are silently dropped */
+      if (slot->state == RADCONN_SLOT_WAITING)
+        {
+          slot->data = malloc (len);
+          if (slot->data)
+            {
+              memcpy (slot->data, conn->rbuf, len);
+              slot->len   = len;
+              slot->state = RADCONN_SLOT_DONE;
+            }
+          else
+            {
+              slot->state = RADCONN_SLOT_FAILED;
+              slot->err   = RADIUSCLIENT_E_REPLY;
+            }
+        }
+
+      conn->rlen -= len;
+      memmove (conn->rbuf, conn->rbuf + len, conn->rlen);
+    }
+
+  return 0;
+}
+
+/**
+ * Become the reader of the connection until the deadline or until some
+ * reply arrives. Called and returns with the connection mutex held.
+ **/
+static void
+conn_receive (RADIUSConn *conn, long long deadline)
+{
+  unsigned int generation = conn->generation;
+  int fd = conn->fd;
+  int pending = 0;
+  ssize_t n;
+
+  if (fd < 0)
+    return;
+
+  conn->reading = 1;
+
+#ifdef HAVE_OPENSSL
+  if (conn->ssl)
+    pending = SSL_pending (conn->ssl);
+#endif
+
+  if (!pending)
+    {
+      struct pollfd pfd;
+      long long remain = deadline - conn_now ();
+
+      pfd.fd     = fd;
+      pfd.events = POLLIN;
+
+      pthread_mutex_unlock (&conn->mutex);
+      poll (&pfd, 1, remain > 0 ? remain : 0);
+      pthread_mutex_lock (&conn->mutex);
+    }
+
+  /* The connection may have been replaced while the lock was released */
+  if ((conn->fd == fd) && (conn->generation == generation))
+    {
+      while ((n = conn_read (conn)) > 0)
+        {
+          if (conn_dispatch (conn) < 0)
+            {
+              n = -1;
+              break;
+            }
+        }
+
+      if (n < 0)
+        conn_close (conn, RADIUSCLIENT_E_UNREACHABLE);
+    }
+
+  conn->reading = 0;
+  pthread_cond_broadcast (&conn->cond);
+}
+
+#ifdef HAVE_OPENSSL
+static int
+conn_tls_init (RADIUSConn *conn, const char **errmsg)
+{
+  RADIUSConnTLS *tls = conn->tls;
+
+  if (conn->ctx)
+    return 0;
+
+  conn->ctx = SSL_CTX_new (SSLv23_client_method ());
+  if (!conn->ctx)
+    {
+      *errmsg = "Could not create TLS context";
+      return -1;
+    }
+
+  SSL_CTX_set_options (conn->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+                                  SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+  SSL_CTX_set_session_cache_mode (conn->ctx, SSL_SESS_CACHE_CLIENT);
+
+  if (tls && tls->cert_file &&
+      (SSL_CTX_use_certificate_chain_file (conn->ctx, tls->cert_file) != 1))
+    {
+      *errmsg = "Could not load the client certificate";
+      goto fail;
+    }
+
+  if (tls && tls->key_file &&
+      (SSL_CTX_use_PrivateKey_file (conn->ctx, tls->key_file,
+                                    SSL_FILETYPE_PEM) != 1))
+    {
+      *errmsg = "Could not load the client private key";
+      goto fail;
+    }
+
+  if (!tls || tls->verify)
+    {
+      if ((tls && tls->ca_file) ?
+            (SSL_CTX_load_verify_locations (conn->ctx, tls->ca_file,
+                                            NULL) != 1) :
+            (SSL_CTX_set_default_verify_paths (conn->ctx) != 1))
+        {
+          *errmsg = "Could not load the CA certificates";
+          goto fail;
+        }
+
+      SSL_CTX_set_verify (conn->ctx, SSL_VERIFY_PEER, NULL);
+    }
+  else
+    {
+      SSL_CTX_set_verify (conn->ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+  return 0;
+
+fail:
+  SSL_CTX_free (conn->ctx);
+  conn->ctx = NULL;
+  return -1;
+}
+
+/**
+ * A certificate signed by a trusted CA is not enough, it must also be
+ * issued to the server we meant to reach (RFC 6614, section 2.3).
+ **/
+static int
+conn_tls_peer (RADIUSConn *conn, SSL *ssl, const char **errmsg)
+{
+  struct in6_addr addr;
+  int literal;
+
+  literal = (inet_pton (AF_INET, conn->host, &addr) == 1) ||
+            (inet_pton (AF_INET6, conn->host, &addr) == 1);
+
+  /* SNI carries host names only (RFC 6066, section 3) */
+  if (!literal && (SSL_set_tlsext_host_name (ssl, conn->host) != 1))
+    {
+      *errmsg = "Could not set the TLS server name";
+      return -1;
+    }
+
+  if (conn->tls && !conn->tls->verify)
+    return 0;
+
+  if (literal ?
+        (X509_VERIFY_PARAM_set1_ip_asc (SSL_get0_param (ssl),
+                                        conn->host) != 1) :
+        (SSL_set1_host (ssl, conn->host) != 1))
+    {
+      *errmsg = "Could not set the expected server name";
+      return -1;
+    }
+
+  return 0;
+}
+#endif
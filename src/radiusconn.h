@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSCONN_H
+#define _RADIUSCONN_H
+
+#include <freeradius/libradius.h>
+
+#define RADCONN_RADSEC_PORT    2083
+#define RADCONN_RADSEC_SECRET  "radsec"
+
+typedef struct _RADIUSConn RADIUSConn;
+
+enum {
+  RADCONN_UDP = 0,
+  RADCONN_TCP,
+  RADCONN_TLS
+};
+
+typedef struct _RADIUSConnTLS {
+  char *ca_file;
+  char *cert_file;
+  char *key_file;
+  int   verify;
+} RADIUSConnTLS;
+
+/* Persistent stream connection API (RFC 6613, RFC 6614) */
+RADIUSConn *radconn_get        (const fr_ipaddr_t *ipaddr, int port,
+                                const char *host, int transport,
+                                const RADIUSConnTLS *tls);
+int         radconn_id_reserve (RADIUSConn *conn, int preferred);
+void        radconn_id_release (RADIUSConn *conn, int id);
+int         radconn_exchange   (RADIUSConn *conn, int id,
+                                const uint8_t *data, size_t data_len,
+                                int timeout, uint8_t *reply,
+                                size_t *reply_len, const char **errmsg);
+
+int  radconn_transport_value (const char *name);
+int  radconn_tls_available   (void);
+
+RADIUSConnTLS *radconn_tls_new  (const char *ca_file, const char *cert_file,
+                                 const char *key_file, int verify);
+void           radconn_tls_free (RADIUSConnTLS *tls);
+
+#endif /* _RADIUSCONN_H */
@@ -0,0 +1,574 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include "radiusclient.h"
+#include "radiusdest.h"
+
+#define RADDEST_BUCKETS     256
+#define RADDEST_RTT_WINDOW  30000
+
+struct _RADIUSDest {
+  fr_ipaddr_t     ipaddr;
+  int             port;
+  RADIUSDest     *next;
+  pthread_mutex_t mutex;
+
+  /* Circuit breaker */
+  int             state;
+  int             failures;
+  int             probing;
+  time_t          changed;
+  unsigned long   trips;
+  unsigned long   rejected;
+
+  /* Adaptive concurrency limit, config is a copy of the process one */
+  RADIUSDestLimitConfig config;
+  pthread_cond_t  cond;
+  double          limit;
+  int             inflight;
+  int             queued;
+  double          rtt;
+  double          rtt_base;
+  double          rtt_min;
+  double          window;
+  double          cut;
+  unsigned long   limited;
+};
+
+/**
+ * Destinations are never freed, a client may keep a pointer to its
+ * destination for as long as it lives.
+ **/
+static struct {
+  pthread_mutex_t mutex;
+  RADIUSDest     *buckets[RADDEST_BUCKETS];
+  int             threshold;
+  int             cooldown;
+  RADIUSDestLimitConfig limit;
+} registry = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 5, 30,
+               { 0, 1, 256, 2.0, 0.7, RADDEST_LIMIT_QUEUE, 1000 } };
+
+/* Internal declaration */
+
+static uint32_t dest_hash     (const fr_ipaddr_t *ipaddr, int port);
+static int      dest_match    (const RADIUSDest *d, const fr_ipaddr_t *ipaddr,
+                               int port);
+static void     breaker_trip  (RADIUSDest *d, time_t now);
+static double   limit_now     (void);
+static void     limit_clamp   (RADIUSDest *d);
+static void     limit_cut     (RADIUSDest *d, double now);
+
+/* Implementation */
+
+RADIUSDest *
+raddest_get (const fr_ipaddr_t *ipaddr, int port)
+{
+  RADIUSDest *d = NULL;
+  pthread_condattr_t attr;
+  uint32_t hash;
+
+  if (!ipaddr)
+    return NULL;
+
+  hash = dest_hash (ipaddr, port) % RADDEST_BUCKETS;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (d = registry.buckets[hash]; d; d = d->next)
+    {
+      if (dest_match (d, ipaddr, port))
+        goto done;
+    }
+
+  d = calloc (1, sizeof (RADIUSDest));
+  if (!d)
+    goto done;
+
+  memcpy (&d->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  d->port    = port;
+  d->state   = RADDEST_CLOSED;
+  d->changed = time (NULL);
+  memcpy (&d->config, &registry.limit, sizeof (RADIUSDestLimitConfig));
+  pthread_mutex_init (&d->mutex, NULL);
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&d->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  d->next = registry.buckets[hash];
+  registry.buckets[hash] = d;
+
+done:
+  pthread_mutex_unlock (&registry.mutex);
+  return d;
+}
+
+RADIUSDest *
+raddest_lookup (const char *host, int port)
+{
+  RADIUSDest *d = NULL;
+  fr_ipaddr_t ipaddr;
+  uint32_t hash;
+
+  if (!host)
+    return NULL;
+
+  if (ip_hton (host, strchr (host, ':') ? AF_INET6 : AF_INET, &ipaddr) < 0)
+    return NULL;
+
+  hash = dest_hash (&ipaddr, port) % RADDEST_BUCKETS;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (d = registry.buckets[hash]; d; d = d->next)
+    {
+      if (dest_match (d, &ipaddr, port))
+        break;
+    }
+
+  pthread_mutex_unlock (&registry.mutex);
+  return d;
+}
+
+void
+raddest_foreach (RADIUSDestFunc func, void *arg)
+{
+  RADIUSDest *d = NULL;
+  int i;
+
+  if (!func)
+    return;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (i = 0; i < RADDEST_BUCKETS; i++)
+    {
+      for (d = registry.buckets[i]; d; d = d->next)
+        func (d, arg);
+    }
+
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+void
+raddest_info (RADIUSDest *d, RADIUSDestInfo *info)
+{
+  if (!d || !info)
+    return;
+
+  memset (info, 0, sizeof (RADIUSDestInfo));
+  ip_ntoh (&d->ipaddr, info->host, sizeof (info->host));
+  info->port = d->port;
+
+  pthread_mutex_lock (&d->mutex);
+  info->state    = d->state;
+  info->failures = d->failures;
+  info->trips    = d->trips;
+  info->rejected = d->rejected;
+  info->changed  = d->changed;
+  info->limit    = d->limit;
+  info->inflight = d->inflight;
+  info->queued   = d->queued;
+  info->rtt      = d->rtt;
+  info->rtt_base = d->rtt_base;
+  info->limited  = d->limited;
+  pthread_mutex_unlock (&d->mutex);
+}
+
+void
+raddest_breaker_configure (int threshold, int cooldown)
+{
+  pthread_mutex_lock (&registry.mutex);
+  registry.threshold = threshold > 0 ? threshold : 0;
+  registry.cooldown  = cooldown > 0 ? cooldown : 0;
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+/**
+ * Admit a request unless the circuit is open. The single request let
+ * through once the circuit cooled down is flagged as the probe, only its
+ * report may close or trip the circuit again.
+ **/
+int
+raddest_breaker_acquire (RADIUSDest *d, int *probe)
+{
+  int res = RADIUSCLIENT_OK;
+  time_t now;
+
+  *probe = 0;
+
+  if (!d || (registry.threshold == 0))
+    return RADIUSCLIENT_OK;
+
+  now = time (NULL);
+
+  pthread_mutex_lock (&d->mutex);
+
+  switch (d->state)
+    {
+      case RADDEST_OPEN:
+        if (now - d->changed < registry.cooldown)
+          {
+            res = RADIUSCLIENT_ERR;
+            break;
+          }
+
+        /* Cooled down, let a single probe through */
+        d->state   = RADDEST_HALF_OPEN;
+        d->changed = now;
+        d->probing = 1;
+        *probe     = 1;
+        break;
+
+      case RADDEST_HALF_OPEN:
+        if (d->probing)
+          res = RADIUSCLIENT_ERR;
+        else
+          {
+            d->probing = 1;
+            *probe     = 1;
+          }
+        break;
+
+      default:
+        break;
+    }
+
+  if (res == RADIUSCLIENT_ERR)
+    d->rejected++;
+
+  pthread_mutex_unlock (&d->mutex);
+
+  return res;
+}
+
+/**
+ * Reports of requests admitted while the circuit was closed only count
+ * while it still is, a late answer must not close a half-open circuit.
+ **/
+void
+raddest_breaker_report (RADIUSDest *d, int probe, int result)
+{
+  time_t now;
+
+  if (!d || (!probe && (registry.threshold == 0)))
+    return;
+
+  now = time (NULL);
+
+  pthread_mutex_lock (&d->mutex);
+
+  if (probe)
+    {
+      d->probing = 0;
+
+      /* A neutral probe leaves the circuit half-open for the next one */
+      if (result == RADDEST_RESULT_SUCCESS)
+        {
+          d->failures = 0;
+          d->state    = RADDEST_CLOSED;
+          d->changed  = now;
+        }
+      else if (result == RADDEST_RESULT_FAILURE)
+        breaker_trip (d, now);
+    }
+  else if (d->state == RADDEST_CLOSED)
+    {
+      if (result == RADDEST_RESULT_SUCCESS)
+        d->failures = 0;
+      else if ((result == RADDEST_RESULT_FAILURE) &&
+               (++d->failures >= registry.threshold))
+        breaker_trip (d, now);
+    }
+
+  pthread_mutex_unlock (&d->mutex);
+}
+
+void
+raddest_limit_config_default (RADIUSDestLimitConfig *config)
+{
+  pthread_mutex_lock (&registry.mutex);
+  memcpy (config, &registry.limit, sizeof (RADIUSDestLimitConfig));
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+/**
+ * Every destination gets a copy of the new configuration, requests only
+ * ever read the copy of theirs. Enabling the limit starts the limit of
+ * every destination over from initial.
+ **/
+void
+raddest_limit_configure (const RADIUSDestLimitConfig *config)
+{
+  RADIUSDest *d = NULL;
+  int enable;
+  int i;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  enable = (registry.limit.initial <= 0) && (config->initial > 0);
+
+  memcpy (&registry.limit, config, sizeof (RADIUSDestLimitConfig));
+
+  if (registry.limit.min < 1)
+    registry.limit.min = 1;
+  if (registry.limit.max < registry.limit.min)
+    registry.limit.max = registry.limit.min;
+  if ((registry.limit.initial > 0) &&
+      (registry.limit.initial < registry.limit.min))
+    registry.limit.initial = registry.limit.min;
+  if (registry.limit.tolerance < 1)
+    registry.limit.tolerance = 1;
+  if ((registry.limit.backoff <= 0) || (registry.limit.backoff >= 1))
+    registry.limit.backoff = 0.7;
+  if (registry.limit.max_wait < 0)
+    registry.limit.max_wait = 0;
+
+  for (i = 0; i < RADDEST_BUCKETS; i++)
+    {
+      for (d = registry.buckets[i]; d; d = d->next)
+        {
+          pthread_mutex_lock (&d->mutex);
+          memcpy (&d->config, &registry.limit,
+                  sizeof (RADIUSDestLimitConfig));
+          if (enable)
+            d->limit = 0;
+          pthread_cond_broadcast (&d->cond);
+          pthread_mutex_unlock (&d->mutex);
+        }
+    }
+
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+/**
+ * Take a place among the requests in flight to the destination. At the
+ * limit the request waits up to max_wait for a place, or fails at once
+ * with the fail policy. Only a request that took a place, flagged in
+ * slot, gives one back, whatever the configuration became meanwhile.
+ **/
+int
+raddest_limit_acquire (RADIUSDest *d, int *slot)
+{
+  struct timespec ts;
+  double deadline;
+  int res = RADIUSCLIENT_OK;
+
+  *slot = 0;
+
+  if (!d)
+    return RADIUSCLIENT_OK;
+
+  pthread_mutex_lock (&d->mutex);
+
+  if (d->config.initial <= 0)
+    {
+      pthread_mutex_unlock (&d->mutex);
+      return RADIUSCLIENT_OK;
+    }
+
+  limit_clamp (d);
+
+  if (d->inflight >= (int) d->limit)
+    {
+      if ((d->config.policy == RADDEST_LIMIT_FAIL) ||
+          (d->config.max_wait <= 0))
+        res = RADIUSCLIENT_ERR;
+      else
+        {
+          d->queued++;
+          deadline = limit_now () + d->config.max_wait;
+
+          ts.tv_sec  = (time_t) (deadline / 1000);
+          ts.tv_nsec = (long) ((deadline - ts.tv_sec * 1000.0) * 1e6);
+
+          while ((d->config.initial > 0) && (d->inflight >= (int) d->limit))
+            {
+              if (limit_now () >= deadline)
+                {
+                  res = RADIUSCLIENT_ERR;
+                  break;
+                }
+
+              pthread_cond_timedwait (&d->cond, &d->mutex, &ts);
+              limit_clamp (d);
+            }
+
+          d->queued--;
+        }
+    }
+
+  if (res == RADIUSCLIENT_ERR)
+    d->limited++;
+  else if (d->config.initial > 0)
+    {
+      d->inflight++;
+      *slot = 1;
+    }
+
+  pthread_mutex_unlock (&d->mutex);
+
+  return res;
+}
+
+/**
+ * Give the place back with the RTT of the exchange. The limit grows by one
+ * per limit worth of answers near the baseline and is cut on a slow answer
+ * or a failure.
+ **/
+void
+raddest_limit_release (RADIUSDest *d, int slot, double rtt, int result)
+{
+  double now;
+
+  if (!d || !slot)
+    return;
+
+  now = limit_now ();
+
+  pthread_mutex_lock (&d->mutex);
+
+  d->inflight--;
+
+  /* Disabled meanwhile, the place is given back and nothing learnt */
+  if (d->config.initial <= 0)
+    {
+      pthread_mutex_unlock (&d->mutex);
+      return;
+    }
+
+  if ((result == RADDEST_RESULT_SUCCESS) && (rtt > 0))
+    {
+      d->rtt = (d->rtt > 0) ? d->rtt * 0.8 + rtt * 0.2 : rtt;
+
+      /**
+       * The baseline is the lowest RTT of the last window, so it follows
+       * a change of path but not a queue that stays for a whole window.
+       **/
+      if ((d->rtt_min <= 0) || (rtt < d->rtt_min))
+        d->rtt_min = rtt;
+
+      if ((d->rtt_base <= 0) || (d->rtt_min < d->rtt_base))
+        d->rtt_base = d->rtt_min;
+
+      if (now - d->window >= RADDEST_RTT_WINDOW)
+        {
+          d->rtt_base = d->rtt_min;
+          d->rtt_min  = 0;
+          d->window   = now;
+        }
+
+      if (d->rtt > d->rtt_base * d->config.tolerance)
+        limit_cut (d, now);
+      else if (d->inflight + 1 >= d->limit / 2)
+        d->limit += 1.0 / d->limit;
+    }
+  else if (result == RADDEST_RESULT_FAILURE)
+    limit_cut (d, now);
+
+  limit_clamp (d);
+
+  if (d->queued)
+    pthread_cond_broadcast (&d->cond);
+
+  pthread_mutex_unlock (&d->mutex);
+}
+
+const char *
+raddest_state_name (int state)
+{
+  switch (state)
+    {
+      case RADDEST_CLOSED:
+        return "closed";
+      case RADDEST_OPEN:
+        return "open";
+      case RADDEST_HALF_OPEN:
+        return "half-open";
+      default:
+        return "unknown";
+    }
+}
+
+/* Internal implementation */
+
+static uint32_t
+dest_hash (const fr_ipaddr_t *ipaddr, int port)
+{
+  uint32_t hash;
+
+  if (ipaddr->af == AF_INET)
+    hash = fr_hash (&ipaddr->ipaddr.ip4addr, sizeof (struct in_addr));
+  else
+    hash = fr_hash (&ipaddr->ipaddr.ip6addr, sizeof (struct in6_addr));
+
+  return fr_hash_update (&port, sizeof (port), hash);
+}
+
+static int
+dest_match (const RADIUSDest *d, const fr_ipaddr_t *ipaddr, int port)
+{
+  return (d->port == port) && (fr_ipaddr_cmp (&d->ipaddr, ipaddr) == 0);
+}
+
+static void
+breaker_trip (RADIUSDest *d, time_t now)
+{
+  d->state   = RADDEST_OPEN;
+  d->changed = now;
+  d->trips++;
+}
+
+/* Monotonic milliseconds */
+static double
+limit_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+limit_clamp (RADIUSDest *d)
+{
+  if (d->limit <= 0)
+    d->limit = d->config.initial;
+
+  if (d->limit < d->config.min)
+    d->limit = d->config.min;
+  else if (d->limit > d->config.max)
+    d->limit = d->config.max;
+}
+
+/* Once per RTT, the requests in flight answer for the same congestion */
+static void
+limit_cut (RADIUSDest *d, double now)
+{
+  if (now - d->cut < d->rtt)
+    return;
+
+  d->limit *= d->config.backoff;
+  d->cut    = now;
+}
@@ -0,0 +1,93 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSDEST_H
+#define _RADIUSDEST_H
+
+#include <freeradius/libradius.h>
+
+typedef struct _RADIUSDest RADIUSDest;
+
+enum {
+  RADDEST_CLOSED = 0,
+  RADDEST_OPEN,
+  RADDEST_HALF_OPEN
+};
+
+enum {
+  RADDEST_RESULT_SUCCESS = 0,
+  RADDEST_RESULT_FAILURE,
+  RADDEST_RESULT_NEUTRAL
+};
+
+/* What a request does once the concurrency limit is reached */
+enum {
+  RADDEST_LIMIT_QUEUE = 0,
+  RADDEST_LIMIT_FAIL
+};
+
+typedef struct _RADIUSDestLimitConfig {
+  int    initial;    /* requests in flight to start with, 0 disables it */
+  int    min;        /* the limit never goes below */
+  int    max;        /* nor above */
+  double tolerance;  /* RTT over the baseline still taken as unloaded */
+  double backoff;    /* factor the limit is cut by on congestion */
+  int    policy;     /* RADDEST_LIMIT_QUEUE or RADDEST_LIMIT_FAIL */
+  int    max_wait;   /* milliseconds a request may queue */
+} RADIUSDestLimitConfig;
+
+typedef struct _RADIUSDestInfo {
+  char          host[INET6_ADDRSTRLEN];
+  int           port;
+  int           state;
+  int           failures;
+  unsigned long trips;
+  unsigned long rejected;
+  time_t        changed;
+  double        limit;
+  int           inflight;
+  int           queued;
+  double        rtt;
+  double        rtt_base;
+  unsigned long limited;
+} RADIUSDestInfo;
+
+typedef void (*RADIUSDestFunc) (RADIUSDest *d, void *arg);
+
+/* Destination registry API, shared by every client of the process */
+RADIUSDest *raddest_get     (const fr_ipaddr_t *ipaddr, int port);
+RADIUSDest *raddest_lookup  (const char *host, int port);
+void        raddest_foreach (RADIUSDestFunc func, void *arg);
+void        raddest_info    (RADIUSDest *d, RADIUSDestInfo *info);
+
+/* Circuit breaker API */
+void raddest_breaker_configure (int threshold, int cooldown);
+int  raddest_breaker_acquire   (RADIUSDest *d, int *probe);
+void raddest_breaker_report    (RADIUSDest *d, int probe, int result);
+
+/* Adaptive concurrency limit API, AIMD on the measured RTT */
+void raddest_limit_config_default (RADIUSDestLimitConfig *config);
+void raddest_limit_configure      (const RADIUSDestLimitConfig *config);
+int  raddest_limit_acquire        (RADIUSDest *d, int *slot);
+void raddest_limit_release        (RADIUSDest *d, int slot, double rtt,
+                                   int result);
+
+const char *raddest_state_name (int state);
+
+#endif /* _RADIUSDEST_H */
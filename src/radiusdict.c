@@ -0,0 +1,1243 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <freeradius/conf.h>
+#include <freeradius/radpaths.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include "radiusclient.h"
+#include "radiusdict.h"
+
+#define RADDICT_MAGIC      "LRDICT\r\n"
+#define RADDICT_FLAGS_MAX  16
+#define RADDICT_MAX_DEPTH  16
+#define RADDICT_ROOT_EXT   ".dictionary"
+
+#define ALIGN8(n)  (((n) + 7) & ~((size_t) 7))
+
+/**
+ * Snapshot layout, every offset is from the start of the file and every
+ * section is 8-byte aligned. Names live in one string table. The attribute,
+ * value and vendor sections keep the order of the text files, which is the
+ * order FreeRADIUS needs them registered in; lookups use sorted indexes.
+ **/
+typedef struct _RADIUSDictHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t size;
+  uint64_t hash;
+  int64_t  built;    /* when the text files were read */
+  uint32_t flags_size;
+  uint32_t nfiles;
+  uint32_t files;
+  uint32_t nvendors;
+  uint32_t vendors;
+  uint32_t nattrs;
+  uint32_t attrs;
+  uint32_t attrs_byname;
+  uint32_t nattrs_byvalue;
+  uint32_t attrs_byvalue;
+  uint32_t nvalues;
+  uint32_t values;
+  uint32_t values_byname;
+  uint32_t strings;
+  uint32_t strings_len;
+  uint32_t reserved;
+} RADIUSDictHeader;
+
+typedef struct _RADIUSDictFile {
+  uint32_t name;
+  uint32_t size;
+  int64_t  mtime;
+  uint64_t hash;     /* FNV-1a of the file alone, without its includes */
+} RADIUSDictFile;
+
+typedef struct _RADIUSDictVendor {
+  uint32_t name;
+  uint32_t pec;
+  int32_t  type;
+  int32_t  length;
+  int32_t  flags;
+} RADIUSDictVendor;
+
+typedef struct _RADIUSDictAttr {
+  uint32_t name;
+  uint32_t attr;
+  int32_t  vendor;
+  int32_t  type;
+  uint8_t  flags[RADDICT_FLAGS_MAX];
+} RADIUSDictAttr;
+
+typedef struct _RADIUSDictValue {
+  uint32_t name;
+  uint32_t attr_name;
+  uint32_t attr;
+  int32_t  value;
+} RADIUSDictValue;
+
+static struct {
+  pthread_mutex_t mutex;
+  int             refs;
+  char            dir[PATH_MAX];
+  char            file[PATH_MAX];
+  char            snapshot[PATH_MAX];
+  uint8_t        *map;
+  size_t          map_len;
+  const RADIUSDictHeader *hdr;
+} dict = { PTHREAD_MUTEX_INITIALIZER, 0, RADDBDIR, RADIUS_DICTIONARY, "",
+           NULL, 0, NULL };
+
+/* Compiler state */
+
+typedef struct _DictBuf {
+  uint8_t *data;
+  size_t   len;
+  size_t   size;
+  int      failed;
+} DictBuf;
+
+typedef struct _DictPtrSet {
+  const void **slots;
+  size_t       size;
+} DictPtrSet;
+
+typedef struct _DictCompile {
+  uint64_t    hash;
+  int64_t     built;
+  DictBuf     strings;
+  DictBuf     files;
+  DictBuf     vendors;
+  DictBuf     attrs;
+  DictBuf     values;
+  DictBuf     names;       /* pending names, "kind\0attr\0value\0" */
+  const char *errmsg;
+} DictCompile;
+
+/* Internal declaration */
+
+static int  snapshot_load   (const char **errmsg);
+static void snapshot_unload (void);
+static int  section_ok      (size_t len, uint32_t off, uint32_t n,
+                             size_t size);
+static int  snapshot_check  (const uint8_t *map, size_t len);
+static int  snapshot_fresh  (void);
+static int  snapshot_register (void);
+
+static const char     *snap_string (uint32_t off);
+static const RADIUSDictAttr *snap_attr_byname  (const char *name);
+static const RADIUSDictAttr *snap_attr_byvalue (unsigned int attr);
+
+static int      buf_put     (DictBuf *b, const void *data, size_t len);
+static uint32_t buf_string  (DictBuf *b, const char *s);
+static int      ptrset_add  (DictPtrSet *set, const void *ptr);
+static uint64_t fnv1a       (uint64_t hash, const void *data, size_t len);
+static int      file_hash   (const char *path, uint64_t *hash);
+static int      compile_file    (DictCompile *dc, const char *path, int depth);
+static int      compile_resolve (DictCompile *dc);
+static int      compile_write   (DictCompile *dc, const char *snapshot);
+
+/* Implementation */
+
+void
+raddict_configure (const char *dir, const char *file, const char *snapshot)
+{
+  char path[PATH_MAX];
+
+  /**
+   * FreeRADIUS joins a relative file name to the dictionary directory,
+   * the root file next to the snapshot needs the absolute path.
+   **/
+  if (snapshot && snapshot[0] && (snapshot[0] != '/') &&
+      realpath (snapshot, path))
+    snapshot = path;
+
+  pthread_mutex_lock (&dict.mutex);
+
+  /* Takes effect the next time the dictionary is loaded */
+  snprintf (dict.dir, sizeof (dict.dir), "%s", dir ? dir : RADDBDIR);
+  snprintf (dict.file, sizeof (dict.file), "%s",
+            file ? file : RADIUS_DICTIONARY);
+  snprintf (dict.snapshot, sizeof (dict.snapshot), "%s",
+            snapshot ? snapshot : "");
+
+  pthread_mutex_unlock (&dict.mutex);
+}
+
+int
+raddict_acquire (const char **errmsg)
+{
+  const char *snapmsg = NULL;
+  int res = RADIUSCLIENT_OK;
+
+  pthread_mutex_lock (&dict.mutex);
+
+  if (dict.refs++ > 0)
+    goto done;
+
+  /* The snapshot is optional, not using it is no error for the caller */
+  if (dict.snapshot[0] && (snapshot_load (&snapmsg) == RADIUSCLIENT_OK))
+    goto done;
+
+  /* No snapshot, or a stale one: parse the text dictionaries */
+  if (dict_init (dict.dir, dict.file) < 0)
+    {
+      dict.refs--;
+      *errmsg = "Initializing dictionary failed";
+      res = RADIUSCLIENT_ERR;
+    }
+
+done:
+  pthread_mutex_unlock (&dict.mutex);
+
+  return res;
+}
+
+void
+raddict_release (void)
+{
+  pthread_mutex_lock (&dict.mutex);
+
+  if ((dict.refs > 0) && (--dict.refs == 0))
+    {
+      dict_free ();
+      snapshot_unload ();
+    }
+
+  pthread_mutex_unlock (&dict.mutex);
+}
+
+void
+raddict_info (RADIUSDictInfo *info)
+{
+  memset (info, 0, sizeof (RADIUSDictInfo));
+
+  pthread_mutex_lock (&dict.mutex);
+
+  info->loaded = dict.refs > 0;
+
+  if (dict.hdr)
+    {
+      info->snapshot = dict.snapshot;
+      info->hash     = dict.hdr->hash;
+      info->vendors  = dict.hdr->nvendors;
+      info->attrs    = dict.hdr->nattrs;
+      info->values   = dict.hdr->nvalues;
+    }
+
+  pthread_mutex_unlock (&dict.mutex);
+}
+
+/**
+ * The lookups don't lock, the caller holds a client and with it a
+ * reference on the loaded dictionary.
+ **/
+int
+raddict_attr (const char *name, unsigned int *attr, int *type)
+{
+  const RADIUSDictAttr *a = NULL;
+  DICT_ATTR *da = NULL;
+
+  if (!name)
+    return RADIUSCLIENT_ERR;
+
+  if (dict.hdr)
+    {
+      a = snap_attr_byname (name);
+      if (!a)
+        return RADIUSCLIENT_ERR;
+
+      *attr = a->attr;
+      *type = a->type;
+      return RADIUSCLIENT_OK;
+    }
+
+  da = dict_attrbyname (name);
+  if (!da)
+    return RADIUSCLIENT_ERR;
+
+  *attr = da->attr;
+  *type = da->type;
+  return RADIUSCLIENT_OK;
+}
+
+const char *
+raddict_attr_name (unsigned int attr)
+{
+  const RADIUSDictAttr *a = NULL;
+  DICT_ATTR *da = NULL;
+
+  if (dict.hdr)
+    {
+      a = snap_attr_byvalue (attr);
+      return a ? snap_string (a->name) : NULL;
+    }
+
+  da = dict_attrbyvalue (attr);
+  return da ? da->name : NULL;
+}
+
+int
+raddict_value (unsigned int attr, const char *name, int *value)
+{
+  const RADIUSDictValue *values = NULL;
+  const uint32_t *index = NULL;
+  DICT_VALUE *dval = NULL;
+  size_t lo, hi, mid;
+  int cmp;
+
+  if (!name)
+    return RADIUSCLIENT_ERR;
+
+  if (!dict.hdr)
+    {
+      dval = dict_valbyname (attr, name);
+      if (!dval)
+        return RADIUSCLIENT_ERR;
+
+      *value = dval->value;
+      return RADIUSCLIENT_OK;
+    }
+
+  values = (const RADIUSDictValue *) (dict.map + dict.hdr->values);
+  index  = (const uint32_t *) (dict.map + dict.hdr->values_byname);
+
+  lo = 0;
+  hi = dict.hdr->nvalues;
+
+  while (lo < hi)
+    {
+      const RADIUSDictValue *v = NULL;
+
+      mid = (lo + hi) / 2;
+      v = &values[index[mid]];
+
+      if (v->attr != attr)
+        cmp = v->attr < attr ? -1 : 1;
+      else
+        cmp = strcasecmp (snap_string (v->name), name);
+
+      if (cmp == 0)
+        {
+          *value = v->value;
+          return RADIUSCLIENT_OK;
+        }
+
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return RADIUSCLIENT_ERR;
+}
+
+/**
+ * The names to compile come from walking the text files, everything else
+ * is asked to FreeRADIUS after it parsed the same files, so the snapshot
+ * can't disagree with the text parser.
+ **/
+int
+raddict_compile (const char *dir, const char *file, const char *snapshot,
+                 RADIUSDictInfo *info, const char **errmsg)
+{
+  DictCompile dc;
+  char path[PATH_MAX];
+  int res = RADIUSCLIENT_ERR;
+
+  memset (&dc, 0, sizeof (dc));
+  dc.hash  = 14695981039346656037ULL;
+  dc.built = time (NULL);
+
+  dir  = dir ? dir : RADDBDIR;
+  file = file ? file : RADIUS_DICTIONARY;
+
+  if (dict_init (dir, file) < 0)
+    {
+      *errmsg = fr_strerror ();
+      return RADIUSCLIENT_ERR;
+    }
+
+  if (file[0] == '/')
+    snprintf (path, sizeof (path), "%s", file);
+  else
+    snprintf (path, sizeof (path), "%s/%s", dir, file);
+
+  /* Offset 0 of the string table is the empty string */
+  buf_string (&dc.strings, "");
+
+  if ((compile_file (&dc, path, 0) == RADIUSCLIENT_OK) &&
+      (compile_resolve (&dc) == RADIUSCLIENT_OK) &&
+      (compile_write (&dc, snapshot) == RADIUSCLIENT_OK))
+    {
+      res = RADIUSCLIENT_OK;
+
+      if (info)
+        {
+          memset (info, 0, sizeof (RADIUSDictInfo));
+          info->loaded   = 1;
+          info->snapshot = snapshot;
+          info->hash     = dc.hash;
+          info->vendors  = dc.vendors.len / sizeof (RADIUSDictVendor);
+          info->attrs    = dc.attrs.len / sizeof (RADIUSDictAttr);
+          info->values   = dc.values.len / sizeof (RADIUSDictValue);
+        }
+    }
+
+  *errmsg = dc.errmsg;
+
+  free (dc.strings.data);
+  free (dc.files.data);
+  free (dc.vendors.data);
+  free (dc.attrs.data);
+  free (dc.values.data);
+  free (dc.names.data);
+
+  dict_free ();
+
+  return res;
+}
+
+/* Internal implementation */
+
+static int
+snapshot_load (const char **errmsg)
+{
+  struct stat st;
+  char root[PATH_MAX];
+  int fd;
+
+  fd = open (dict.snapshot, O_RDONLY);
+  if (fd < 0)
+    {
+      *errmsg = "Could not open the dictionary snapshot";
+      return RADIUSCLIENT_ERR;
+    }
+
+  if ((fstat (fd, &st) < 0) || (st.st_size < (off_t) sizeof (RADIUSDictHeader)))
+    {
+      close (fd);
+      *errmsg = "Invalid dictionary snapshot";
+      return RADIUSCLIENT_ERR;
+    }
+
+  /* Read-only and shared, every process maps the same pages */
+  dict.map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (dict.map == MAP_FAILED)
+    {
+      dict.map = NULL;
+      *errmsg = "Could not map the dictionary snapshot";
+      return RADIUSCLIENT_ERR;
+    }
+
+  dict.map_len = st.st_size;
+
+  if (snapshot_check (dict.map, dict.map_len) != RADIUSCLIENT_OK)
+    {
+      *errmsg = "Invalid dictionary snapshot";
+      goto fail;
+    }
+
+  dict.hdr = (const RADIUSDictHeader *) dict.map;
+
+  if (snapshot_fresh () != RADIUSCLIENT_OK)
+    {
+      *errmsg = "Dictionary snapshot is stale";
+      goto fail;
+    }
+
+  /**
+   * FreeRADIUS only creates its tables in dict_init, so initialize it
+   * with the empty root dictionary written next to the snapshot and
+   * register the entries directly.
+   **/
+  snprintf (root, sizeof (root), "%s"RADDICT_ROOT_EXT, dict.snapshot);
+
+  if (dict_init (dict.dir, root) < 0)
+    {
+      *errmsg = "Could not initialize the dictionary from the snapshot";
+      goto fail;
+    }
+
+  if (snapshot_register () != RADIUSCLIENT_OK)
+    {
+      dict_free ();
+      *errmsg = "Dictionary snapshot does not match the FreeRADIUS library";
+      goto fail;
+    }
+
+  return RADIUSCLIENT_OK;
+
+fail:
+  snapshot_unload ();
+  return RADIUSCLIENT_ERR;
+}
+
+static void
+snapshot_unload (void)
+{
+  if (dict.map)
+    munmap (dict.map, dict.map_len);
+
+  dict.map     = NULL;
+  dict.map_len = 0;
+  dict.hdr     = NULL;
+}
+
+static int
+section_ok (size_t len, uint32_t off, uint32_t n, size_t size)
+{
+  return (off % 8 == 0) && (off <= len) && (n <= (len - off) / size);
+}
+
+/**
+ * Bounds check everything once, the lookups then trust the snapshot.
+ **/
+static int
+snapshot_check (const uint8_t *map, size_t len)
+{
+  const RADIUSDictHeader *hdr = (const RADIUSDictHeader *) map;
+  const RADIUSDictFile   *files   = NULL;
+  const RADIUSDictVendor *vendors = NULL;
+  const RADIUSDictAttr   *attrs   = NULL;
+  const RADIUSDictValue  *values  = NULL;
+  const uint32_t *index = NULL;
+  uint32_t i;
+
+  if ((memcmp (hdr->magic, RADDICT_MAGIC, sizeof (hdr->magic)) != 0) ||
+      (hdr->version != RADDICT_VERSION) || (hdr->size != len) ||
+      (hdr->flags_size != sizeof (ATTR_FLAGS)) ||
+      (sizeof (ATTR_FLAGS) > RADDICT_FLAGS_MAX))
+    return RADIUSCLIENT_ERR;
+
+  if (!section_ok (len, hdr->files, hdr->nfiles, sizeof (RADIUSDictFile)) ||
+      !section_ok (len, hdr->vendors, hdr->nvendors,
+                   sizeof (RADIUSDictVendor)) ||
+      !section_ok (len, hdr->attrs, hdr->nattrs, sizeof (RADIUSDictAttr)) ||
+      !section_ok (len, hdr->attrs_byname, hdr->nattrs, sizeof (uint32_t)) ||
+      !section_ok (len, hdr->attrs_byvalue, hdr->nattrs_byvalue,
+                   sizeof (uint32_t)) ||
+      (hdr->nattrs_byvalue > hdr->nattrs) ||
+      !section_ok (len, hdr->values, hdr->nvalues,
+                   sizeof (RADIUSDictValue)) ||
+      !section_ok (len, hdr->values_byname, hdr->nvalues,
+                   sizeof (uint32_t)) ||
+      !section_ok (len, hdr->strings, hdr->strings_len, 1) ||
+      (hdr->strings_len == 0) ||
+      (map[hdr->strings + hdr->strings_len - 1] != '\0'))
+    return RADIUSCLIENT_ERR;
+
+  files = (const RADIUSDictFile *) (map + hdr->files);
+  for (i = 0; i < hdr->nfiles; i++)
+    {
+      if (files[i].name >= hdr->strings_len)
+        return RADIUSCLIENT_ERR;
+    }
+
+  vendors = (const RADIUSDictVendor *) (map + hdr->vendors);
+  for (i = 0; i < hdr->nvendors; i++)
+    {
+      if (vendors[i].name >= hdr->strings_len)
+        return RADIUSCLIENT_ERR;
+    }
+
+  attrs = (const RADIUSDictAttr *) (map + hdr->attrs);
+  for (i = 0; i < hdr->nattrs; i++)
+    {
+      if (attrs[i].name >= hdr->strings_len)
+        return RADIUSCLIENT_ERR;
+    }
+
+  index = (const uint32_t *) (map + hdr->attrs_byname);
+  for (i = 0; i < hdr->nattrs; i++)
+    {
+      if (index[i] >= hdr->nattrs)
+        return RADIUSCLIENT_ERR;
+    }
+
+  index = (const uint32_t *) (map + hdr->attrs_byvalue);
+  for (i = 0; i < hdr->nattrs_byvalue; i++)
+    {
+      if (index[i] >= hdr->nattrs)
+        return RADIUSCLIENT_ERR;
+    }
+
+  values = (const RADIUSDictValue *) (map + hdr->values);
+  for (i = 0; i < hdr->nvalues; i++)
+    {
+      if ((values[i].name >= hdr->strings_len) ||
+          (values[i].attr_name >= hdr->strings_len))
+        return RADIUSCLIENT_ERR;
+    }
+
+  index = (const uint32_t *) (map + hdr->values_byname);
+  for (i = 0; i < hdr->nvalues; i++)
+    {
+      if (index[i] >= hdr->nvalues)
+        return RADIUSCLIENT_ERR;
+    }
+
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * Stale when any of the text files it was compiled from changed since.
+ * Size and mtime are trusted, but a file modified in the second it was
+ * read keeps both through a second edit, so files with an mtime at or
+ * after the build time are hashed again.
+ **/
+static int
+snapshot_fresh (void)
+{
+  const RADIUSDictFile *files = NULL;
+  struct stat st;
+  uint64_t hash;
+  uint32_t i;
+
+  files = (const RADIUSDictFile *) (dict.map + dict.hdr->files);
+
+  for (i = 0; i < dict.hdr->nfiles; i++)
+    {
+      if ((stat (snap_string (files[i].name), &st) < 0) ||
+          ((uint32_t) st.st_size != files[i].size) ||
+          ((int64_t) st.st_mtime != files[i].mtime))
+        return RADIUSCLIENT_ERR;
+
+      if ((files[i].mtime >= dict.hdr->built) &&
+          ((file_hash (snap_string (files[i].name), &hash) ==
+              RADIUSCLIENT_ERR) ||
+           (hash != files[i].hash)))
+        return RADIUSCLIENT_ERR;
+    }
+
+  return RADIUSCLIENT_OK;
+}
+
+static int
+snapshot_register (void)
+{
+  const RADIUSDictVendor *vendors = NULL;
+  const RADIUSDictAttr   *attrs   = NULL;
+  const RADIUSDictValue  *values  = NULL;
+  DICT_VENDOR *dv = NULL;
+  DICT_ATTR   *da = NULL;
+  ATTR_FLAGS   flags;
+  uint32_t i;
+  int value;
+
+  vendors = (const RADIUSDictVendor *) (dict.map + dict.hdr->vendors);
+  for (i = 0; i < dict.hdr->nvendors; i++)
+    {
+      if (dict_addvendor (snap_string (vendors[i].name), vendors[i].pec) < 0)
+        return RADIUSCLIENT_ERR;
+
+      dv = dict_vendorbyvalue (vendors[i].pec);
+      if (!dv)
+        return RADIUSCLIENT_ERR;
+
+      dv->type   = vendors[i].type;
+      dv->length = vendors[i].length;
+      dv->flags  = vendors[i].flags;
+    }
+
+  attrs = (const RADIUSDictAttr *) (dict.map + dict.hdr->attrs);
+  for (i = 0; i < dict.hdr->nattrs; i++)
+    {
+      memcpy (&flags, attrs[i].flags, sizeof (flags));
+
+      /* dict_addattr puts the vendor back in the upper 16 bits */
+      value = attrs[i].vendor ? (int) (attrs[i].attr & 0xffff) :
+                                (int) attrs[i].attr;
+
+      if (dict_addattr (snap_string (attrs[i].name), attrs[i].vendor,
+                        attrs[i].type, value, flags) < 0)
+        return RADIUSCLIENT_ERR;
+
+      /* Anything the library numbers differently makes the snapshot unusable */
+      da = dict_attrbyname (snap_string (attrs[i].name));
+      if (!da || (da->attr != attrs[i].attr))
+        return RADIUSCLIENT_ERR;
+    }
+
+  values = (const RADIUSDictValue *) (dict.map + dict.hdr->values);
+  for (i = 0; i < dict.hdr->nvalues; i++)
+    {
+      if (dict_addvalue (snap_string (values[i].name),
+                         snap_string (values[i].attr_name),
+                         values[i].value) < 0)
+        return RADIUSCLIENT_ERR;
+    }
+
+  return RADIUSCLIENT_OK;
+}
+
+static const char *
+snap_string (uint32_t off)
+{
+  return (const char *) (dict.map + dict.hdr->strings + off);
+}
+
+static const RADIUSDictAttr *
+snap_attr_byname (const char *name)
+{
+  const RADIUSDictAttr *attrs = NULL;
+  const uint32_t *index = NULL;
+  size_t lo, hi, mid;
+  int cmp;
+
+  attrs = (const RADIUSDictAttr *) (dict.map + dict.hdr->attrs);
+  index = (const uint32_t *) (dict.map + dict.hdr->attrs_byname);
+
+  lo = 0;
+  hi = dict.hdr->nattrs;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      cmp = strcasecmp (snap_string (attrs[index[mid]].name), name);
+
+      if (cmp == 0)
+        return &attrs[index[mid]];
+
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return NULL;
+}
+
+static const RADIUSDictAttr *
+snap_attr_byvalue (unsigned int attr)
+{
+  const RADIUSDictAttr *attrs = NULL;
+  const uint32_t *index = NULL;
+  size_t lo, hi, mid;
+
+  attrs = (const RADIUSDictAttr *) (dict.map + dict.hdr->attrs);
+  index = (const uint32_t *) (dict.map + dict.hdr->attrs_byvalue);
+
+  lo = 0;
+  hi = dict.hdr->nattrs_byvalue;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+
+      if (attrs[index[mid]].attr == attr)
+        return &attrs[index[mid]];
+
+      if (attrs[index[mid]].attr < attr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return NULL;
+}
+
+/* Compiler */
+
+static int
+buf_put (DictBuf *b, const void *data, size_t len)
+{
+  uint8_t *p = NULL;
+  size_t size;
+
+  if (b->len + len > b->size)
+    {
+      size = b->size ? b->size * 2 : 4096;
+      while (size < b->len + len)
+        size *= 2;
+
+      p = realloc (b->data, size);
+      if (!p)
+        {
+          b->failed = 1;
+          return -1;
+        }
+
+      b->data = p;
+      b->size = size;
+    }
+
+  memcpy (b->data + b->len, data, len);
+  b->len += len;
+
+  return 0;
+}
+
+static uint32_t
+buf_string (DictBuf *b, const char *s)
+{
+  uint32_t off = b->len;
+
+  if (buf_put (b, s, strlen (s) + 1) < 0)
+    return UINT32_MAX;
+
+  return off;
+}
+
+/**
+ * Open addressing set of the FreeRADIUS entries already emitted, names
+ * may be defined more than once and aliases resolve to the same entry.
+ **/
+static int
+ptrset_add (DictPtrSet *set, const void *ptr)
+{
+  size_t i;
+
+  i = ((uintptr_t) ptr >> 4) & (set->size - 1);
+
+  while (set->slots[i])
+    {
+      if (set->slots[i] == ptr)
+        return 0;
+
+      i = (i + 1) & (set->size - 1);
+    }
+
+  set->slots[i] = ptr;
+
+  return 1;
+}
+
+static uint64_t
+fnv1a (uint64_t hash, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  while (len--)
+    {
+      hash ^= *p++;
+      hash *= 1099511628211ULL;
+    }
+
+  return hash;
+}
+
+/**
+ * Hashed line by line the way compile_file reads it.
+ **/
+static int
+file_hash (const char *path, uint64_t *hash)
+{
+  char line[1024];
+  FILE *fp = fopen (path, "r");
+
+  if (!fp)
+    return RADIUSCLIENT_ERR;
+
+  *hash = 14695981039346656037ULL;
+  while (fgets (line, sizeof (line), fp))
+    *hash = fnv1a (*hash, line, strlen (line));
+
+  fclose (fp);
+
+  return RADIUSCLIENT_OK;
+}
+
+static int
+compile_file (DictCompile *dc, const char *path, int depth)
+{
+  RADIUSDictFile f;
+  struct stat st;
+  size_t offset;
+  char line[1024];
+  char include[PATH_MAX];
+  char *argv[4];
+  char *p = NULL;
+  FILE *fp = NULL;
+  int argc;
+  int res = RADIUSCLIENT_OK;
+
+  if (depth > RADDICT_MAX_DEPTH)
+    {
+      dc->errmsg = "Dictionary includes are nested too deep";
+      return RADIUSCLIENT_ERR;
+    }
+
+  fp = fopen (path, "r");
+  if (!fp || (fstat (fileno (fp), &st) < 0))
+    {
+      if (fp)
+        fclose (fp);
+
+      dc->errmsg = "Could not read a dictionary file";
+      return RADIUSCLIENT_ERR;
+    }
+
+  /* The record goes first to keep the include order, its hash comes last */
+  f.name  = buf_string (&dc->strings, path);
+  f.size  = st.st_size;
+  f.mtime = st.st_mtime;
+  f.hash  = 14695981039346656037ULL;
+  offset  = dc->files.len;
+  buf_put (&dc->files, &f, sizeof (f));
+
+  while (fgets (line, sizeof (line), fp))
+    {
+      dc->hash = fnv1a (dc->hash, line, strlen (line));
+      f.hash   = fnv1a (f.hash, line, strlen (line));
+
+      p = strchr (line, '#');
+      if (p)
+        *p = '\0';
+
+      argc = 0;
+      for (p = strtok (line, " \t\r\n"); p && (argc < 4);
+           p = strtok (NULL, " \t\r\n"))
+        argv[argc++] = p;
+
+      if (argc < 2)
+        continue;
+
+      if ((strcasecmp (argv[0], "$INCLUDE") == 0) ||
+          (strcasecmp (argv[0], "$INCLUDE-") == 0))
+        {
+          if (argv[1][0] == '/')
+            {
+              snprintf (include, sizeof (include), "%s", argv[1]);
+            }
+          else
+            {
+              p = strrchr (path, '/');
+              snprintf (include, sizeof (include), "%.*s/%s",
+                        p ? (int) (p - path) : 1, p ? path : ".", argv[1]);
+            }
+
+          /* $INCLUDE- is optional */
+          if ((argv[0][8] == '-') && (access (include, R_OK) < 0))
+            continue;
+
+          res = compile_file (dc, include, depth + 1);
+          if (res != RADIUSCLIENT_OK)
+            break;
+        }
+      else if (strcasecmp (argv[0], "VENDOR") == 0)
+        {
+          buf_put (&dc->names, "V", 2);
+          buf_string (&dc->names, argv[1]);
+        }
+      else if (strcasecmp (argv[0], "ATTRIBUTE") == 0)
+        {
+          buf_put (&dc->names, "A", 2);
+          buf_string (&dc->names, argv[1]);
+        }
+      else if ((strcasecmp (argv[0], "VALUE") == 0) && (argc >= 3))
+        {
+          buf_put (&dc->names, "L", 2);
+          buf_string (&dc->names, argv[1]);
+          buf_string (&dc->names, argv[2]);
+        }
+    }
+
+  fclose (fp);
+
+  if (!dc->files.failed)
+    memcpy (dc->files.data + offset, &f, sizeof (f));
+
+  return res;
+}
+
+static int
+compile_resolve (DictCompile *dc)
+{
+  DictPtrSet set;
+  RADIUSDictVendor v;
+  RADIUSDictAttr   a;
+  RADIUSDictValue  l;
+  DICT_VENDOR *dv = NULL;
+  DICT_ATTR   *da = NULL;
+  DICT_VALUE  *dval = NULL;
+  const char *p   = NULL;
+  const char *end = NULL;
+  size_t entries = 0;
+
+  for (p = (const char *) dc->names.data,
+       end = (const char *) dc->names.data + dc->names.len; p < end;
+       p += strlen (p) + 1)
+    entries++;
+
+  set.size = 64;
+  while (set.size < entries * 2)
+    set.size *= 2;
+
+  set.slots = calloc (set.size, sizeof (void *));
+  if (!set.slots)
+    {
+      dc->errmsg = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  p = (const char *) dc->names.data;
+  end = p + dc->names.len;
+
+  while (p < end)
+    {
+      char kind = p[0];
+      const char *name = p + 2;
+      const char *value = NULL;
+
+      p = name + strlen (name) + 1;
+
+      switch (kind)
+        {
+          case 'V':
+            dv = dict_vendorbyvalue (dict_vendorbyname (name));
+            if (!dv || !ptrset_add (&set, dv))
+              break;
+
+            v.name   = buf_string (&dc->strings, dv->name);
+            v.pec    = dv->vendorpec;
+            v.type   = dv->type;
+            v.length = dv->length;
+            v.flags  = dv->flags;
+            buf_put (&dc->vendors, &v, sizeof (v));
+            break;
+
+          case 'A':
+            da = dict_attrbyname (name);
+            if (!da || !ptrset_add (&set, da))
+              break;
+
+            memset (&a, 0, sizeof (a));
+            a.name   = buf_string (&dc->strings, da->name);
+            a.attr   = da->attr;
+            a.vendor = da->vendor;
+            a.type   = da->type;
+            memcpy (a.flags, &da->flags, sizeof (da->flags));
+            buf_put (&dc->attrs, &a, sizeof (a));
+            break;
+
+          case 'L':
+            value = p;
+            p = value + strlen (value) + 1;
+
+            da = dict_attrbyname (name);
+            dval = da ? dict_valbyname (da->attr, value) : NULL;
+            if (!dval || !ptrset_add (&set, dval))
+              break;
+
+            l.name      = buf_string (&dc->strings, dval->name);
+            l.attr_name = buf_string (&dc->strings, da->name);
+            l.attr      = da->attr;
+            l.value     = dval->value;
+            buf_put (&dc->values, &l, sizeof (l));
+            break;
+        }
+    }
+
+  free (set.slots);
+
+  return RADIUSCLIENT_OK;
+}
+
+/* qsort has no context argument, the compiler is not reentrant */
+static const DictCompile *sort_dc;
+
+static int
+cmp_attr_name (const void *a, const void *b)
+{
+  const RADIUSDictAttr *attrs = (const RADIUSDictAttr *) sort_dc->attrs.data;
+  const char *strings = (const char *) sort_dc->strings.data;
+
+  return strcasecmp (strings + attrs[*(const uint32_t *) a].name,
+                     strings + attrs[*(const uint32_t *) b].name);
+}
+
+static int
+cmp_attr_value (const void *a, const void *b)
+{
+  const RADIUSDictAttr *attrs = (const RADIUSDictAttr *) sort_dc->attrs.data;
+  uint32_t x = attrs[*(const uint32_t *) a].attr;
+  uint32_t y = attrs[*(const uint32_t *) b].attr;
+
+  return x < y ? -1 : x > y;
+}
+
+static int
+cmp_value_name (const void *a, const void *b)
+{
+  const RADIUSDictValue *values =
+    (const RADIUSDictValue *) sort_dc->values.data;
+  const RADIUSDictValue *x = &values[*(const uint32_t *) a];
+  const RADIUSDictValue *y = &values[*(const uint32_t *) b];
+  const char *strings = (const char *) sort_dc->strings.data;
+
+  if (x->attr != y->attr)
+    return x->attr < y->attr ? -1 : 1;
+
+  return strcasecmp (strings + x->name, strings + y->name);
+}
+
+static int
+compile_write (DictCompile *dc, const char *snapshot)
+{
+  RADIUSDictHeader hdr;
+  const RADIUSDictAttr *attrs = (const RADIUSDictAttr *) dc->attrs.data;
+  uint32_t nattrs  = dc->attrs.len / sizeof (RADIUSDictAttr);
+  uint32_t nvalues = dc->values.len / sizeof (RADIUSDictValue);
+  uint32_t *byname  = NULL;
+  uint32_t *byvalue = NULL;
+  uint32_t *values_byname = NULL;
+  uint8_t *image = NULL;
+  char tmp[PATH_MAX];
+  char root[PATH_MAX];
+  size_t off;
+  uint32_t i, n = 0;
+  FILE *fp = NULL;
+  DICT_ATTR *da = NULL;
+  int res = RADIUSCLIENT_ERR;
+
+  if (dc->strings.failed || dc->files.failed || dc->vendors.failed ||
+      dc->attrs.failed || dc->values.failed || dc->names.failed)
+    {
+      dc->errmsg = "Out of memory";
+      return RADIUSCLIENT_ERR;
+    }
+
+  byname  = malloc ((nattrs + 1) * sizeof (uint32_t));
+  byvalue = malloc ((nattrs + 1) * sizeof (uint32_t));
+  values_byname = malloc ((nvalues + 1) * sizeof (uint32_t));
+
+  if (!byname || !byvalue || !values_byname)
+    {
+      dc->errmsg = "Out of memory";
+      goto done;
+    }
+
+  for (i = 0; i < nattrs; i++)
+    {
+      byname[i] = i;
+
+      /* Aliases share a number, keep the name the library prints */
+      da = dict_attrbyvalue (attrs[i].attr);
+      if (da && (strcmp (da->name, (const char *) dc->strings.data +
+                                   attrs[i].name) == 0))
+        byvalue[n++] = i;
+    }
+
+  for (i = 0; i < nvalues; i++)
+    values_byname[i] = i;
+
+  sort_dc = dc;
+  qsort (byname, nattrs, sizeof (uint32_t), cmp_attr_name);
+  qsort (byvalue, n, sizeof (uint32_t), cmp_attr_value);
+  qsort (values_byname, nvalues, sizeof (uint32_t), cmp_value_name);
+  sort_dc = NULL;
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, RADDICT_MAGIC, sizeof (hdr.magic));
+  hdr.version        = RADDICT_VERSION;
+  hdr.hash           = dc->hash;
+  hdr.built          = dc->built;
+  hdr.flags_size     = sizeof (ATTR_FLAGS);
+  hdr.nfiles         = dc->files.len / sizeof (RADIUSDictFile);
+  hdr.nvendors       = dc->vendors.len / sizeof (RADIUSDictVendor);
+  hdr.nattrs         = nattrs;
+  hdr.nattrs_byvalue = n;
+  hdr.nvalues        = nvalues;
+  hdr.strings_len    = dc->strings.len;
+
+  off = ALIGN8 (sizeof (hdr));
+  hdr.files = off;          off = ALIGN8 (off + dc->files.len);
+  hdr.vendors = off;        off = ALIGN8 (off + dc->vendors.len);
+  hdr.attrs = off;          off = ALIGN8 (off + dc->attrs.len);
+  hdr.attrs_byname = off;   off = ALIGN8 (off + nattrs * sizeof (uint32_t));
+  hdr.attrs_byvalue = off;  off = ALIGN8 (off + n * sizeof (uint32_t));
+  hdr.values = off;         off = ALIGN8 (off + dc->values.len);
+  hdr.values_byname = off;  off = ALIGN8 (off + nvalues * sizeof (uint32_t));
+  hdr.strings = off;        off = off + dc->strings.len;
+  hdr.size = off;
+
+  if (off > UINT32_MAX)
+    {
+      dc->errmsg = "Dictionary is too large for a snapshot";
+      goto done;
+    }
+
+  image = calloc (1, off);
+  if (!image)
+    {
+      dc->errmsg = "Out of memory";
+      goto done;
+    }
+
+  memcpy (image, &hdr, sizeof (hdr));
+  memcpy (image + hdr.files, dc->files.data, dc->files.len);
+  memcpy (image + hdr.vendors, dc->vendors.data, dc->vendors.len);
+  memcpy (image + hdr.attrs, dc->attrs.data, dc->attrs.len);
+  memcpy (image + hdr.attrs_byname, byname, nattrs * sizeof (uint32_t));
+  memcpy (image + hdr.attrs_byvalue, byvalue, n * sizeof (uint32_t));
+  memcpy (image + hdr.values, dc->values.data, dc->values.len);
+  memcpy (image + hdr.values_byname, values_byname,
+          nvalues * sizeof (uint32_t));
+  memcpy (image + hdr.strings, dc->strings.data, dc->strings.len);
+
+  /* The empty root dictionary the loader initializes FreeRADIUS with */
+  snprintf (root, sizeof (root), "%s"RADDICT_ROOT_EXT, snapshot);
+  fp = fopen (root, "w");
+  if (!fp)
+    {
+      dc->errmsg = "Could not write the snapshot root dictionary";
+      goto done;
+    }
+
+  fprintf (fp, "# Empty on purpose, entries are loaded from the snapshot\n");
+  fclose (fp);
+
+  /* Replace atomically, running processes keep their mapping */
+  snprintf (tmp, sizeof (tmp), "%s.tmp", snapshot);
+  fp = fopen (tmp, "wb");
+  if (!fp || (fwrite (image, 1, off, fp) != off))
+    {
+      if (fp)
+        fclose (fp);
+
+      unlink (tmp);
+      dc->errmsg = "Could not write the dictionary snapshot";
+      goto done;
+    }
+
+  if ((fclose (fp) != 0) || (rename (tmp, snapshot) < 0))
+    {
+      unlink (tmp);
+      dc->errmsg = "Could not write the dictionary snapshot";
+      goto done;
+    }
+
+  res = RADIUSCLIENT_OK;
+
+done:
+  free (image);
+  free (byname);
+  free (byvalue);
+  free (values_byname);
+
+  return res;
+}
@@ -0,0 +1,58 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSDICT_H
+#define _RADIUSDICT_H
+
+#include <freeradius/libradius.h>
+
+#define RADDICT_VERSION  2
+
+typedef struct _RADIUSDictInfo {
+  int         loaded;
+  const char *snapshot;   /* NULL when parsed from the text files */
+  uint64_t    hash;
+  unsigned    vendors;
+  unsigned    attrs;
+  unsigned    values;
+} RADIUSDictInfo;
+
+/**
+ * Process wide dictionary, loaded by the first client and freed with the
+ * last one. A configured snapshot is used unless it is missing or stale,
+ * then the text dictionaries are parsed as before.
+ **/
+void raddict_configure (const char *dir, const char *file,
+                        const char *snapshot);
+int  raddict_acquire   (const char **errmsg);
+void raddict_release   (void);
+void raddict_info      (RADIUSDictInfo *info);
+
+/* Name <-> number lookups, answered from the snapshot when it is mapped */
+int         raddict_attr      (const char *name, unsigned int *attr,
+                               int *type);
+const char *raddict_attr_name (unsigned int attr);
+int         raddict_value     (unsigned int attr, const char *name,
+                               int *value);
+
+/* Snapshot compiler, used by raddict-compile */
+int raddict_compile (const char *dir, const char *file, const char *snapshot,
+                     RADIUSDictInfo *info, const char **errmsg);
+
+#endif /* _RADIUSDICT_H */
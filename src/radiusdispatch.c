@@ -0,0 +1,1043 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "radiusclient.h"
+#include "radiusdest.h"
+#include "radiuspacer.h"
+#include "radiusdispatch.h"
+
+#define RADDISPATCH_SLOTS_DEFAULT  8
+#define RADDISPATCH_SLOTS_MAX      1024
+#define RADDISPATCH_RETRIES_MAX    10
+#define RADDISPATCH_SERVERS_MAX    64
+#define RADDISPATCH_GRACE          1000
+#define RADDISPATCH_CACHELINE      64
+
+/**
+ * One request or completion. A worker fills in the destination and the
+ * encoded request, the dispatcher answers in the completion ring with the
+ * reply and the header the request was sent with.
+ **/
+typedef struct _RADIUSDispatchSlot {
+  uint32_t    tag;
+  int32_t     code;
+  int32_t     timeout;
+  int32_t     offset;
+  int32_t     cls;
+  int32_t     port;
+  uint32_t    len;
+  fr_ipaddr_t ipaddr;
+  char        secret[RADDISPATCH_SECRET_MAX];
+  uint8_t     header[AUTH_HDR_LEN];
+  uint8_t     data[MAX_PACKET_LEN];
+} RADIUSDispatchSlot;
+
+/**
+ * Single producer, single consumer. The indexes run freely and are kept
+ * on their own cache lines, the slots follow the ring in memory.
+ **/
+typedef struct _RADIUSDispatchRing {
+  uint32_t head;
+  uint8_t  head_pad[RADDISPATCH_CACHELINE - sizeof (uint32_t)];
+  uint32_t tail;
+  uint8_t  tail_pad[RADDISPATCH_CACHELINE - sizeof (uint32_t)];
+} RADIUSDispatchRing;
+
+/* Start of the shared mapping, the rings of every worker follow */
+typedef struct _RADIUSDispatchShm {
+  RADIUSDispatchStats stats;
+} RADIUSDispatchShm;
+
+/* An eventfd, or a pipe where there is none */
+typedef struct _RADIUSDispatchWake {
+  int rfd;
+  int wfd;
+} RADIUSDispatchWake;
+
+typedef struct _RADIUSDispatchPending {
+  uint8_t  used;
+  uint8_t  tries;
+  uint8_t  probe;
+  uint16_t worker;
+  uint32_t tag;
+  uint32_t expire;
+  uint32_t interval;
+  size_t   len;
+  uint8_t *data;
+  char    *secret;
+} RADIUSDispatchPending;
+
+/* A server as seen by the dispatcher, one socket and ID space for all */
+typedef struct _RADIUSDispatchServer {
+  fr_ipaddr_t ipaddr;
+  int         port;
+  int         fd;
+  int         next_id;
+  int         pending;
+  RADIUSDest *dest;
+  RADIUSPacer *pacer;
+  RADIUSDispatchPending slots[256];
+} RADIUSDispatchServer;
+
+struct _RADIUSDispatch {
+  RADIUSDispatchShm  *shm;
+  size_t              size;
+  size_t              ring_size;
+  int                 workers;
+  uint32_t            slots;
+  int                 retries;
+  RADIUSDispatchWake  wake;
+  RADIUSDispatchWake *wakes;
+  pid_t               pid;
+  pid_t               owner;
+  RADIUSDispatchServer *servers[RADDISPATCH_SERVERS_MAX];
+  int                 count;
+};
+
+/* The rings this process submits to, see raddispatch_attach */
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static RADIUSDispatch *worker_dispatch = NULL;
+static int             worker_index = -1;
+static uint32_t        worker_tag = 0;
+
+/* Internal declaration */
+
+static uint32_t dispatch_now     (void);
+static void     dispatch_submit  (RADIUSDispatch *d, int worker,
+                                  RADIUSDispatchSlot *req);
+static int      dispatch_receive (RADIUSDispatch *d, RADIUSDispatchServer *s);
+static int      dispatch_expire  (RADIUSDispatch *d);
+static void     dispatch_complete (RADIUSDispatch *d, int worker,
+                                   uint32_t tag, int code,
+                                   const uint8_t *header,
+                                   const uint8_t *reply, size_t len);
+static void     dispatch_release (RADIUSDispatchServer *s,
+                                  RADIUSDispatchPending *p);
+static const char *dispatch_errmsg (int code);
+static RADIUSDispatchServer *server_get (RADIUSDispatch *d,
+                                         const fr_ipaddr_t *ipaddr,
+                                         int port);
+static int      server_resign    (uint8_t *data, size_t len, int id,
+                                  int offset, const char *secret);
+static int      reply_verify     (const uint8_t *reply, size_t reply_len,
+                                  const uint8_t *request,
+                                  const char *secret);
+static RADIUSDispatchRing *ring_get     (RADIUSDispatch *d, int worker,
+                                         int completion);
+static RADIUSDispatchSlot *ring_slot    (RADIUSDispatch *d,
+                                         RADIUSDispatchRing *r,
+                                         uint32_t index);
+static RADIUSDispatchSlot *ring_reserve (RADIUSDispatch *d,
+                                         RADIUSDispatchRing *r);
+static void                ring_push    (RADIUSDispatchRing *r);
+static RADIUSDispatchSlot *ring_peek    (RADIUSDispatch *d,
+                                         RADIUSDispatchRing *r);
+static void                ring_pop     (RADIUSDispatchRing *r);
+static int      wake_open        (RADIUSDispatchWake *w);
+static void     wake_signal      (RADIUSDispatchWake *w);
+static void     wake_drain       (RADIUSDispatchWake *w);
+static void     wake_close       (RADIUSDispatchWake *w);
+
+/* Implementation */
+
+RADIUSDispatch *
+raddispatch_new (int workers, int slots, int retries, const char **errmsg)
+{
+  RADIUSDispatch *d = NULL;
+  void *shm = NULL;
+  uint32_t n;
+  int i;
+
+  if ((workers <= 0) || (workers > RADDISPATCH_WORKERS_MAX))
+    {
+      *errmsg = "Invalid number of workers";
+      return NULL;
+    }
+
+  if (slots <= 0)
+    slots = RADDISPATCH_SLOTS_DEFAULT;
+  else if (slots > RADDISPATCH_SLOTS_MAX)
+    slots = RADDISPATCH_SLOTS_MAX;
+
+  /* The ring indexes wrap with a mask */
+  for (n = 1; n < (uint32_t) slots; n <<= 1)
+    ;
+
+  if (retries < 0)
+    retries = 0;
+  else if (retries > RADDISPATCH_RETRIES_MAX)
+    retries = RADDISPATCH_RETRIES_MAX;
+
+  d = calloc (1, sizeof (RADIUSDispatch));
+  if (d)
+    d->wakes = calloc (workers, sizeof (RADIUSDispatchWake));
+
+  if (!d || !d->wakes)
+    {
+      free (d);
+      *errmsg = "Out of memory";
+      return NULL;
+    }
+
+  d->workers   = workers;
+  d->slots     = n;
+  d->retries   = retries;
+  d->ring_size = sizeof (RADIUSDispatchRing) +
+                 n * sizeof (RADIUSDispatchSlot);
+  d->size      = sizeof (RADIUSDispatchShm) + 2 * workers * d->ring_size;
+
+  d->wake.rfd = d->wake.wfd = -1;
+  for (i = 0; i < workers; i++)
+    d->wakes[i].rfd = d->wakes[i].wfd = -1;
+
+  /* Anonymous and shared, the processes forked later all see it */
+  shm = mmap (NULL, d->size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED)
+    {
+      *errmsg = "Failed to map the shared rings";
+      raddispatch_free (d);
+      return NULL;
+    }
+
+  d->shm = (RADIUSDispatchShm *) shm;
+
+  if (wake_open (&d->wake) == RADIUSCLIENT_ERR)
+    goto nowake;
+
+  for (i = 0; i < workers; i++)
+    {
+      if (wake_open (&d->wakes[i]) == RADIUSCLIENT_ERR)
+        goto nowake;
+    }
+
+  return d;
+
+nowake:
+  *errmsg = "Failed to create the wakeup descriptors";
+  raddispatch_free (d);
+  return NULL;
+}
+
+void
+raddispatch_free (RADIUSDispatch *d)
+{
+  int i, j;
+
+  if (!d)
+    return;
+
+  pthread_mutex_lock (&worker_lock);
+  if (worker_dispatch == d)
+    {
+      worker_dispatch = NULL;
+      worker_index    = -1;
+    }
+  pthread_mutex_unlock (&worker_lock);
+
+  /* Only the process that spawned the dispatcher stops it */
+  if ((d->pid > 0) && (d->owner == getpid ()))
+    {
+      kill (d->pid, SIGTERM);
+      waitpid (d->pid, NULL, 0);
+    }
+
+  for (i = 0; i < d->count; i++)
+    {
+      for (j = 0; j < 256; j++)
+        free (d->servers[i]->slots[j].data);
+
+      close (d->servers[i]->fd);
+      free (d->servers[i]);
+    }
+
+  wake_close (&d->wake);
+  for (i = 0; i < d->workers; i++)
+    wake_close (&d->wakes[i]);
+
+  if (d->shm)
+    munmap (d->shm, d->size);
+
+  free (d->wakes);
+  free (d);
+}
+
+int
+raddispatch_workers (RADIUSDispatch *d)
+{
+  return d ? d->workers : 0;
+}
+
+void
+raddispatch_stats (RADIUSDispatch *d, RADIUSDispatchStats *stats)
+{
+  if (!d || !stats)
+    return;
+
+  memcpy (stats, &d->shm->stats, sizeof (RADIUSDispatchStats));
+}
+
+/**
+ * Fork the dispatcher process, it runs until its parent exits or the
+ * dispatcher is freed by the parent. Returns the pid, -1 on failure.
+ **/
+pid_t
+raddispatch_spawn (RADIUSDispatch *d)
+{
+  pid_t parent = getpid ();
+  pid_t pid;
+
+  if (!d || (d->pid > 0))
+    return -1;
+
+  pid = fork ();
+  if (pid < 0)
+    return -1;
+
+  if (pid == 0)
+    {
+      while (getppid () == parent)
+        {
+          if (raddispatch_run (d, 1000) < 0)
+            break;
+        }
+
+      _exit (0);
+    }
+
+  d->pid   = pid;
+  d->owner = parent;
+
+  return pid;
+}
+
+/**
+ * Wait up to timeout milliseconds, then relay the replies, take the new
+ * requests of every worker and retransmit or expire what went silent.
+ * Returns the number of requests and replies handled.
+ **/
+int
+raddispatch_run (RADIUSDispatch *d, int timeout)
+{
+  struct pollfd pfd[RADDISPATCH_SERVERS_MAX + 1];
+  RADIUSDispatchSlot *req = NULL;
+  RADIUSDispatchRing *r = NULL;
+  int handled = 0;
+  int next, i;
+
+  if (!d)
+    return -1;
+
+  next = dispatch_expire (d);
+  if ((next >= 0) && ((timeout < 0) || (next < timeout)))
+    timeout = next;
+
+  pfd[0].fd     = d->wake.rfd;
+  pfd[0].events = POLLIN;
+
+  for (i = 0; i < d->count; i++)
+    {
+      pfd[i + 1].fd     = d->servers[i]->fd;
+      pfd[i + 1].events = POLLIN;
+    }
+
+  if (poll (pfd, d->count + 1, timeout) < 0)
+    return (errno == EINTR) ? 0 : -1;
+
+  /* Replies first, they free IDs for the new requests */
+  for (i = 0; i < d->count; i++)
+    {
+      if (pfd[i + 1].revents)
+        handled += dispatch_receive (d, d->servers[i]);
+    }
+
+  /* Drained before the rings are read, a later push wakes us again */
+  if (pfd[0].revents)
+    wake_drain (&d->wake);
+
+  for (i = 0; i < d->workers; i++)
+    {
+      r = ring_get (d, i, 0);
+
+      while ((req = ring_peek (d, r)))
+        {
+          dispatch_submit (d, i, req);
+          ring_pop (r);
+          handled++;
+        }
+    }
+
+  dispatch_expire (d);
+
+  return handled;
+}
+
+/**
+ * Route the requests of this process through the rings of the given
+ * worker. Each worker number must be attached by one process only.
+ **/
+int
+raddispatch_attach (RADIUSDispatch *d, int worker)
+{
+  if (!d || (worker < 0) || (worker >= d->workers))
+    return RADIUSCLIENT_ERR;
+
+  pthread_mutex_lock (&worker_lock);
+  worker_dispatch = d;
+  worker_index    = worker;
+  /* Completions left over by a previous process never match */
+  worker_tag      = (uint32_t) getpid () << 16;
+  pthread_mutex_unlock (&worker_lock);
+
+  return RADIUSCLIENT_OK;
+}
+
+void
+raddispatch_detach (void)
+{
+  pthread_mutex_lock (&worker_lock);
+  worker_dispatch = NULL;
+  worker_index    = -1;
+  pthread_mutex_unlock (&worker_lock);
+}
+
+int
+raddispatch_attached (void)
+{
+  return worker_dispatch ? 1 : 0;
+}
+
+/**
+ * Hand the encoded request to the dispatcher and wait for its reply. On
+ * success the ID and authenticator of data are those the server saw, the
+ * reply is verified against them. Returns a RADIUSCLIENT_E_* code.
+ **/
+int
+raddispatch_exchange (const fr_ipaddr_t *ipaddr, int port,
+                      const char *secret, uint8_t *data, size_t len,
+                      int offset, int cls, int timeout, uint8_t *reply,
+                      size_t *reply_len, const char **errmsg)
+{
+  RADIUSDispatch *d = NULL;
+  RADIUSDispatchRing *r = NULL;
+  RADIUSDispatchSlot *slot = NULL;
+  struct pollfd pfd;
+  uint32_t tag, start, elapsed;
+  int code = RADIUSCLIENT_E_TIMEOUT;
+  int done = 0;
+
+  if (strlen (secret) >= RADDISPATCH_SECRET_MAX)
+    {
+      *errmsg = "Secret is too long for the dispatcher";
+      return RADIUSCLIENT_E_INVALID;
+    }
+
+  /* One request in flight per worker, threads take turns */
+  pthread_mutex_lock (&worker_lock);
+
+  d = worker_dispatch;
+  if (!d)
+    {
+      pthread_mutex_unlock (&worker_lock);
+      *errmsg = "Not attached to a dispatcher";
+      return RADIUSCLIENT_E_SOCKET;
+    }
+
+  r    = ring_get (d, worker_index, 0);
+  slot = ring_reserve (d, r);
+  if (!slot)
+    {
+      pthread_mutex_unlock (&worker_lock);
+      *errmsg = "Dispatcher queue is full";
+      return RADIUSCLIENT_E_SOCKET;
+    }
+
+  tag = ++worker_tag;
+
+  slot->tag     = tag;
+  slot->timeout = timeout;
+  slot->offset  = offset;
+  slot->cls     = cls;
+  slot->port    = port;
+  slot->len     = len;
+  memcpy (&slot->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  strcpy (slot->secret, secret);
+  memcpy (slot->data, data, len);
+
+  ring_push (r);
+  wake_signal (&d->wake);
+
+  r     = ring_get (d, worker_index, 1);
+  start = dispatch_now ();
+
+  pfd.fd     = d->wakes[worker_index].rfd;
+  pfd.events = POLLIN;
+
+  while (!done)
+    {
+      wake_drain (&d->wakes[worker_index]);
+
+      /* Anything but our tag was given up on by an earlier request */
+      while ((slot = ring_peek (d, r)))
+        {
+          if (slot->tag == tag)
+            {
+              code = slot->code;
+              if ((code == RADIUSCLIENT_E_NONE) && (slot->len <= *reply_len))
+                {
+                  data[1] = slot->header[1];
+                  memcpy (data + 4, slot->header + 4, AUTH_VECTOR_LEN);
+                  memcpy (reply, slot->data, slot->len);
+                  *reply_len = slot->len;
+                }
+              else if (code == RADIUSCLIENT_E_NONE)
+                code = RADIUSCLIENT_E_REPLY;
+
+              done = 1;
+            }
+
+          ring_pop (r);
+
+          if (done)
+            break;
+        }
+
+      if (done)
+        break;
+
+      elapsed = dispatch_now () - start;
+      if (elapsed >= (uint32_t) timeout + RADDISPATCH_GRACE)
+        break;
+
+      if ((poll (&pfd, 1, timeout + RADDISPATCH_GRACE - elapsed) < 0) &&
+          (errno != EINTR))
+        break;
+    }
+
+  pthread_mutex_unlock (&worker_lock);
+
+  if (!done)
+    {
+      *errmsg = "Dispatcher did not answer";
+      return RADIUSCLIENT_E_TIMEOUT;
+    }
+
+  if (code != RADIUSCLIENT_E_NONE)
+    *errmsg = dispatch_errmsg (code);
+
+  return code;
+}
+
+static uint32_t
+dispatch_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * Take one request from a worker: pick an ID in the space of the server,
+ * sign the copy for it and send. The timeout of the request is split
+ * between the first transmission and the retries.
+ **/
+static void
+dispatch_submit (RADIUSDispatch *d, int worker, RADIUSDispatchSlot *req)
+{
+  RADIUSDispatchServer *s = NULL;
+  RADIUSDispatchPending *p = NULL;
+  size_t secret_len;
+  int probe;
+  int id, i;
+
+  d->shm->stats.submitted++;
+
+  if ((req->len < AUTH_HDR_LEN) || (req->len > MAX_PACKET_LEN) ||
+      (req->offset < 0) ||
+      (req->offset + 2 + AUTH_VECTOR_LEN > (int32_t) req->len))
+    {
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_INVALID,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  s = server_get (d, &req->ipaddr, req->port);
+  if (!s)
+    {
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_SOCKET,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  /* The loop serves every worker, a request without a token is shed */
+  if (radpacer_try (s->pacer, req->cls) == RADIUSCLIENT_ERR)
+    {
+      d->shm->stats.shed++;
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_SHED,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  if (raddest_breaker_acquire (s->dest, &probe) == RADIUSCLIENT_ERR)
+    {
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_CIRCUIT_OPEN,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  for (i = 0, id = -1; i < 256; i++)
+    {
+      if (!s->slots[(s->next_id + i) & 0xff].used)
+        {
+          id = (s->next_id + i) & 0xff;
+          break;
+        }
+    }
+
+  if (id < 0)
+    {
+      d->shm->stats.busy++;
+      raddest_breaker_report (s->dest, probe, RADDEST_RESULT_NEUTRAL);
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_SOCKET,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  s->next_id = (id + 1) & 0xff;
+  p = &s->slots[id];
+
+  secret_len = strlen (req->secret) + 1;
+  free (p->data);
+  p->data = malloc (req->len + secret_len);
+  if (!p->data)
+    {
+      raddest_breaker_report (s->dest, probe, RADDEST_RESULT_NEUTRAL);
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_SOCKET,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  p->secret = (char *) p->data + req->len;
+  memcpy (p->data, req->data, req->len);
+  memcpy (p->secret, req->secret, secret_len);
+
+  if (server_resign (p->data, req->len, id, req->offset, p->secret) < 0)
+    {
+      raddest_breaker_report (s->dest, probe, RADDEST_RESULT_NEUTRAL);
+      dispatch_complete (d, worker, req->tag, RADIUSCLIENT_E_INVALID,
+                         req->data, NULL, 0);
+      return;
+    }
+
+  p->used     = 1;
+  p->tries    = 1;
+  p->probe    = probe;
+  p->worker   = worker;
+  p->tag      = req->tag;
+  p->len      = req->len;
+  p->interval = (req->timeout > 0 ? req->timeout : 1) / (d->retries + 1);
+  if (p->interval == 0)
+    p->interval = 1;
+  p->expire   = dispatch_now () + p->interval;
+  s->pending++;
+
+  if (send (s->fd, p->data, p->len, 0) < 0)
+    {
+      raddest_breaker_report (s->dest, p->probe, RADDEST_RESULT_FAILURE);
+      dispatch_complete (d, worker, p->tag, RADIUSCLIENT_E_UNREACHABLE,
+                         p->data, NULL, 0);
+      dispatch_release (s, p);
+    }
+}
+
+static int
+dispatch_receive (RADIUSDispatch *d, RADIUSDispatchServer *s)
+{
+  RADIUSDispatchPending *p = NULL;
+  uint8_t buf[MAX_PACKET_LEN];
+  ssize_t len;
+  int handled = 0;
+
+  while ((len = recv (s->fd, buf, sizeof (buf), MSG_DONTWAIT)) >= 0)
+    {
+      p = (len >= AUTH_HDR_LEN) ? &s->slots[buf[1]] : NULL;
+
+      if (!p || !p->used ||
+          (reply_verify (buf, len, p->data, p->secret) == RADIUSCLIENT_ERR))
+        {
+          d->shm->stats.invalid++;
+          continue;
+        }
+
+      raddest_breaker_report (s->dest, p->probe, RADDEST_RESULT_SUCCESS);
+      dispatch_complete (d, p->worker, p->tag, RADIUSCLIENT_E_NONE, p->data,
+                         buf, (buf[2] << 8) | buf[3]);
+      dispatch_release (s, p);
+      handled++;
+    }
+
+  return handled;
+}
+
+/**
+ * Retransmit the requests whose interval went by, the last try expires
+ * them. Returns the milliseconds to the next deadline, -1 for none.
+ **/
+static int
+dispatch_expire (RADIUSDispatch *d)
+{
+  RADIUSDispatchServer *s = NULL;
+  RADIUSDispatchPending *p = NULL;
+  uint32_t now = dispatch_now ();
+  int32_t  left;
+  int next = -1;
+  int i, j;
+
+  for (i = 0; i < d->count; i++)
+    {
+      s = d->servers[i];
+
+      for (j = 0; (j < 256) && s->pending; j++)
+        {
+          p = &s->slots[j];
+          if (!p->used)
+            continue;
+
+          left = (int32_t) (p->expire - now);
+          if ((left <= 0) && (p->tries > d->retries))
+            {
+              d->shm->stats.timeouts++;
+              raddest_breaker_report (s->dest, p->probe,
+                                      RADDEST_RESULT_FAILURE);
+              dispatch_complete (d, p->worker, p->tag,
+                                 RADIUSCLIENT_E_TIMEOUT, p->data, NULL, 0);
+              dispatch_release (s, p);
+              continue;
+            }
+
+          if (left <= 0)
+            {
+              d->shm->stats.retransmits++;
+              send (s->fd, p->data, p->len, 0);
+              p->tries++;
+              p->expire = now + p->interval;
+              left      = p->interval;
+            }
+
+          if ((next < 0) || (left < next))
+            next = left;
+        }
+    }
+
+  return next;
+}
+
+static void
+dispatch_complete (RADIUSDispatch *d, int worker, uint32_t tag, int code,
+                   const uint8_t *header, const uint8_t *reply, size_t len)
+{
+  RADIUSDispatchRing *r = ring_get (d, worker, 1);
+  RADIUSDispatchSlot *slot = ring_reserve (d, r);
+
+  /* The worker gave up long ago and left its ring full */
+  if (!slot)
+    {
+      d->shm->stats.dropped++;
+      return;
+    }
+
+  slot->tag  = tag;
+  slot->code = code;
+  slot->len  = len;
+  memcpy (slot->header, header, AUTH_HDR_LEN);
+  if (reply)
+    memcpy (slot->data, reply, len);
+
+  ring_push (r);
+  wake_signal (&d->wakes[worker]);
+
+  d->shm->stats.completed++;
+}
+
+static void
+dispatch_release (RADIUSDispatchServer *s, RADIUSDispatchPending *p)
+{
+  p->used = 0;
+  s->pending--;
+}
+
+static const char *
+dispatch_errmsg (int code)
+{
+  switch (code)
+    {
+      case RADIUSCLIENT_E_INVALID:
+        return "Dispatcher could not sign the request";
+      case RADIUSCLIENT_E_TIMEOUT:
+        return "Socket error or timeout";
+      case RADIUSCLIENT_E_UNREACHABLE:
+        return "Failed to send packet";
+      case RADIUSCLIENT_E_CIRCUIT_OPEN:
+        return "Server is unavailable (circuit open)";
+      case RADIUSCLIENT_E_SHED:
+        return "Request shed by the pacer";
+      case RADIUSCLIENT_E_REPLY:
+        return "Reply packet is too large";
+      default:
+        return "Dispatcher could not send the request";
+    }
+}
+
+static RADIUSDispatchServer *
+server_get (RADIUSDispatch *d, const fr_ipaddr_t *ipaddr, int port)
+{
+  RADIUSDispatchServer *s = NULL;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  int i;
+
+  for (i = 0; i < d->count; i++)
+    {
+      s = d->servers[i];
+      if ((s->port == port) && (fr_ipaddr_cmp (&s->ipaddr, ipaddr) == 0))
+        return s;
+    }
+
+  if (d->count >= RADDISPATCH_SERVERS_MAX)
+    return NULL;
+
+  s = calloc (1, sizeof (RADIUSDispatchServer));
+  if (!s)
+    return NULL;
+
+  memcpy (&s->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  s->port    = port;
+  s->next_id = fr_rand () & 0xff;
+
+  /* Connected, replies from anyone else never reach the socket */
+  s->fd = socket (ipaddr->af, SOCK_DGRAM, 0);
+  if ((s->fd < 0) ||
+      !fr_ipaddr2sockaddr (ipaddr, port, &sa, &sa_len) ||
+      (connect (s->fd, (struct sockaddr *) &sa, sa_len) < 0))
+    {
+      if (s->fd >= 0)
+        close (s->fd);
+      free (s);
+      return NULL;
+    }
+
+  s->dest  = raddest_get (ipaddr, port);
+  s->pacer = radpacer_get (ipaddr);
+  d->servers[d->count++] = s;
+
+  return s;
+}
+
+/**
+ * Same as request_resign of the client, on a bare buffer. Only requests
+ * with a random authenticator keep it.
+ **/
+static int
+server_resign (uint8_t *data, size_t len, int id, int offset,
+               const char *secret)
+{
+  RADIUS_PACKET packet;
+
+  memset (&packet, 0, sizeof (packet));
+  packet.code     = data[0];
+  packet.id       = id;
+  packet.data     = data;
+  packet.data_len = len;
+  packet.offset   = offset;
+
+  data[1] = id;
+
+  if ((packet.code == PW_AUTHENTICATION_REQUEST) ||
+      (packet.code == PW_STATUS_SERVER))
+    memcpy (packet.vector, data + 4, AUTH_VECTOR_LEN);
+  else
+    memset (data + 4, 0, AUTH_VECTOR_LEN);
+
+  if (offset > 0)
+    memset (data + offset + 2, 0, AUTH_VECTOR_LEN);
+
+  return rad_sign (&packet, NULL, secret);
+}
+
+/* Response authenticator of a reply to the given request */
+static int
+reply_verify (const uint8_t *reply, size_t reply_len, const uint8_t *request,
+              const char *secret)
+{
+  FR_MD5_CTX ctx;
+  uint8_t digest[AUTH_VECTOR_LEN];
+  size_t len;
+
+  len = (reply[2] << 8) | reply[3];
+  if ((len < AUTH_HDR_LEN) || (len > reply_len) || (reply[1] != request[1]))
+    return RADIUSCLIENT_ERR;
+
+  fr_MD5Init (&ctx);
+  fr_MD5Update (&ctx, reply, 4);
+  fr_MD5Update (&ctx, request + 4, AUTH_VECTOR_LEN);
+  fr_MD5Update (&ctx, reply + AUTH_HDR_LEN, len - AUTH_HDR_LEN);
+  fr_MD5Update (&ctx, (const uint8_t *) secret, strlen (secret));
+  fr_MD5Final (digest, &ctx);
+
+  return memcmp (digest, reply + 4, AUTH_VECTOR_LEN) == 0 ?
+           RADIUSCLIENT_OK : RADIUSCLIENT_ERR;
+}
+
+static RADIUSDispatchRing *
+ring_get (RADIUSDispatch *d, int worker, int completion)
+{
+  return (RADIUSDispatchRing *) ((uint8_t *) d->shm +
+                                 sizeof (RADIUSDispatchShm) +
+                                 (2 * worker + completion) * d->ring_size);
+}
+
+static RADIUSDispatchSlot *
+ring_slot (RADIUSDispatch *d, RADIUSDispatchRing *r, uint32_t index)
+{
+  return (RADIUSDispatchSlot *) ((uint8_t *) r + sizeof (RADIUSDispatchRing) +
+                                 (index & (d->slots - 1)) *
+                                 sizeof (RADIUSDispatchSlot));
+}
+
+/* Producer side, NULL while the consumer has not caught up */
+static RADIUSDispatchSlot *
+ring_reserve (RADIUSDispatch *d, RADIUSDispatchRing *r)
+{
+  uint32_t head = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+
+  if (head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) >= d->slots)
+    return NULL;
+
+  return ring_slot (d, r, head);
+}
+
+/* The slot is written before the consumer can see it */
+static void
+ring_push (RADIUSDispatchRing *r)
+{
+  __atomic_store_n (&r->head, __atomic_load_n (&r->head, __ATOMIC_RELAXED) + 1,
+                    __ATOMIC_RELEASE);
+}
+
+/* Consumer side, NULL when the ring is empty */
+static RADIUSDispatchSlot *
+ring_peek (RADIUSDispatch *d, RADIUSDispatchRing *r)
+{
+  uint32_t tail = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n (&r->head, __ATOMIC_ACQUIRE) == tail)
+    return NULL;
+
+  return ring_slot (d, r, tail);
+}
+
+/* The slot is read before the producer may reuse it */
+static void
+ring_pop (RADIUSDispatchRing *r)
+{
+  __atomic_store_n (&r->tail, __atomic_load_n (&r->tail, __ATOMIC_RELAXED) + 1,
+                    __ATOMIC_RELEASE);
+}
+
+static int
+wake_open (RADIUSDispatchWake *w)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  w->rfd = w->wfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  return (w->rfd < 0) ? RADIUSCLIENT_ERR : RADIUSCLIENT_OK;
+#else
+  int fds[2];
+
+  if (pipe (fds) < 0)
+    return RADIUSCLIENT_ERR;
+
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+
+  w->rfd = fds[0];
+  w->wfd = fds[1];
+
+  return RADIUSCLIENT_OK;
+#endif
+}
+
+/* A full pipe or a saturated counter already wakes the reader */
+static void
+wake_signal (RADIUSDispatchWake *w)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
+
+  if (write (w->wfd, &one, sizeof (one)) < 0)
+    return;
+#else
+  uint8_t one = 1;
+
+  if (write (w->wfd, &one, sizeof (one)) < 0)
+    return;
+#endif
+}
+
+static void
+wake_drain (RADIUSDispatchWake *w)
+{
+  uint64_t buf[8];
+
+  while (read (w->rfd, buf, sizeof (buf)) > 0)
+    ;
+}
+
+static void
+wake_close (RADIUSDispatchWake *w)
+{
+  if (w->rfd >= 0)
+    close (w->rfd);
+
+  if ((w->wfd >= 0) && (w->wfd != w->rfd))
+    close (w->wfd);
+
+  w->rfd = w->wfd = -1;
+}
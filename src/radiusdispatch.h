@@ -0,0 +1,63 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSDISPATCH_H
+#define _RADIUSDISPATCH_H
+
+#include <freeradius/libradius.h>
+#include <sys/types.h>
+
+#define RADDISPATCH_WORKERS_MAX  1024
+#define RADDISPATCH_SECRET_MAX   128
+
+typedef struct _RADIUSDispatch RADIUSDispatch;
+
+typedef struct _RADIUSDispatchStats {
+  unsigned long submitted;    /* requests taken from the workers */
+  unsigned long completed;    /* replies handed back to the workers */
+  unsigned long retransmits;  /* requests sent again after a silence */
+  unsigned long timeouts;     /* the server never replied */
+  unsigned long busy;         /* no free ID towards the server */
+  unsigned long shed;         /* refused by the pacer of the server */
+  unsigned long invalid;      /* unmatched or badly signed replies */
+  unsigned long dropped;      /* completions a worker had no room for */
+} RADIUSDispatchStats;
+
+/* Created by the parent before forking, shared by every child process */
+RADIUSDispatch *raddispatch_new     (int workers, int slots, int retries,
+                                     const char **errmsg);
+void            raddispatch_free    (RADIUSDispatch *d);
+int             raddispatch_workers (RADIUSDispatch *d);
+void            raddispatch_stats   (RADIUSDispatch *d,
+                                     RADIUSDispatchStats *stats);
+
+/* Dispatcher side, a single process owns the sockets and server state */
+pid_t raddispatch_spawn (RADIUSDispatch *d);
+int   raddispatch_run   (RADIUSDispatch *d, int timeout);
+
+/* Worker side, every worker process attaches to its own pair of rings */
+int  raddispatch_attach   (RADIUSDispatch *d, int worker);
+void raddispatch_detach   (void);
+int  raddispatch_attached (void);
+int  raddispatch_exchange (const fr_ipaddr_t *ipaddr, int port,
+                           const char *secret, uint8_t *data, size_t len,
+                           int offset, int cls, int timeout, uint8_t *reply,
+                           size_t *reply_len, const char **errmsg);
+
+#endif /* _RADIUSDISPATCH_H */
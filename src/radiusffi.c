@@ -0,0 +1,164 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "radiusclient.h"
+#include "radiusffi.h"
+
+#define RADFFI_ATTR_MAX   256
+#define RADFFI_VALUE_MAX  1024
+
+/* Internal declaration */
+
+static int copystring (char *dst, size_t dst_size, const char *src,
+                       size_t src_len);
+
+/* Implementation */
+
+int
+radffi_abi_version (void)
+{
+  return RADFFI_ABI_VERSION;
+}
+
+RADIUSClientCtrl *
+radffi_new (void)
+{
+  RADIUSClientCtrl *c = malloc (radclient_ctrl_size ());
+
+  if (!c)
+    return NULL;
+
+  if (radclient_ctrl_init (c) == RADIUSCLIENT_ERR)
+    {
+      free (c);
+      return NULL;
+    }
+
+  return c;
+}
+
+void
+radffi_free (RADIUSClientCtrl *c)
+{
+  if (!c)
+    return;
+
+  radclient_ctrl_free (c);
+  free (c);
+}
+
+int
+radffi_server_set (RADIUSClientCtrl *c, const char *host, size_t host_len,
+                   int port, const char *secret, size_t secret_len)
+{
+  char hostbuf[RADFFI_ATTR_MAX];
+  char secretbuf[RADFFI_ATTR_MAX];
+
+  if (!c || (copystring (hostbuf, sizeof (hostbuf), host, host_len) < 0) ||
+      (copystring (secretbuf, sizeof (secretbuf), secret, secret_len) < 0))
+    return RADIUSCLIENT_ERR;
+
+  return radclient_server_set (c, hostbuf, port, secretbuf);
+}
+
+int
+radffi_attr_set (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                 const char *value, size_t value_len)
+{
+  char attrbuf[RADFFI_ATTR_MAX];
+  char valuebuf[RADFFI_VALUE_MAX];
+
+  if (!c || (copystring (attrbuf, sizeof (attrbuf), attr, attr_len) < 0) ||
+      (copystring (valuebuf, sizeof (valuebuf), value, value_len) < 0))
+    return RADIUSCLIENT_ERR;
+
+  return radclient_attr_set (c, attrbuf, valuebuf);
+}
+
+int
+radffi_attr_set_number (RADIUSClientCtrl *c, const char *attr,
+                        size_t attr_len, double value)
+{
+  char attrbuf[RADFFI_ATTR_MAX];
+
+  if (!c || (copystring (attrbuf, sizeof (attrbuf), attr, attr_len) < 0))
+    return RADIUSCLIENT_ERR;
+
+  return radclient_attr_set_number (c, attrbuf, value);
+}
+
+int
+radffi_attr_get (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                 char *value, size_t value_size, size_t *value_len,
+                 const char **opr)
+{
+  char attrbuf[RADFFI_ATTR_MAX];
+
+  if (!c || !value_len ||
+      (copystring (attrbuf, sizeof (attrbuf), attr, attr_len) < 0))
+    return RADIUSCLIENT_ERR;
+
+  if (radclient_attr_get (c, attrbuf, value, value_size, opr) ==
+        RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  *value_len = strlen (value);
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radffi_send (RADIUSClientCtrl *c, int packet_code)
+{
+  return radclient_send (c, packet_code);
+}
+
+void
+radffi_set_debug (RADIUSClientCtrl *c)
+{
+  radclient_set_debug (c);
+}
+
+const char *
+radffi_last_err_msg (RADIUSClientCtrl *c)
+{
+  return radclient_get_last_err_msg (c);
+}
+
+int
+radffi_last_err_code (RADIUSClientCtrl *c)
+{
+  return radclient_get_last_err_code (c);
+}
+
+/* Internal implementation */
+
+static int
+copystring (char *dst, size_t dst_size, const char *src, size_t src_len)
+{
+  if (!src || (src_len >= dst_size))
+    return -1;
+
+  memcpy (dst, src, src_len);
+  dst[src_len] = '\0';
+
+  return 0;
+}
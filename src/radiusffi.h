@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSFFI_H
+#define _RADIUSFFI_H
+
+#include <stddef.h>
+#include "radiusclient.h"
+
+/**
+ * Flat C ABI for foreign function interfaces such as the LuaJIT FFI.
+ * It only takes plain C types, strings are passed as pointer and length.
+ * Keep src/radius/ffi.lua in sync when changing it and bump the version.
+ **/
+
+#define RADFFI_ABI_VERSION  2
+
+int  radffi_abi_version (void);
+
+RADIUSClientCtrl *radffi_new  (void);
+void              radffi_free (RADIUSClientCtrl *c);
+
+int radffi_server_set (RADIUSClientCtrl *c, const char *host, size_t host_len,
+                       int port, const char *secret, size_t secret_len);
+int radffi_attr_set   (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                       const char *value, size_t value_len);
+int radffi_attr_set_number (RADIUSClientCtrl *c, const char *attr,
+                            size_t attr_len, double value);
+int radffi_attr_get   (RADIUSClientCtrl *c, const char *attr, size_t attr_len,
+                       char *value, size_t value_size, size_t *value_len,
+                       const char **opr);
+int radffi_send       (RADIUSClientCtrl *c, int packet_code);
+
+void        radffi_set_debug        (RADIUSClientCtrl *c);
+const char *radffi_last_err_msg     (RADIUSClientCtrl *c);
+int         radffi_last_err_code    (RADIUSClientCtrl *c);
+
+#endif /* _RADIUSFFI_H */
@@ -0,0 +1,468 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include "radiusclient.h"
+#include "radiuspacer.h"
+
+#define RADPACER_BUCKETS  64
+
+struct _RADIUSPacer {
+  fr_ipaddr_t       ipaddr;
+  RADIUSPacer      *next;
+  pthread_mutex_t   mutex;
+  pthread_cond_t    cond;
+  int               custom;
+  RADIUSPacerConfig config;       /* the default, unless custom is set */
+
+  double            tokens;
+  double            last;
+  int               queued[RADPACER_CLASSES];
+  unsigned long     sent[RADPACER_CLASSES];
+  unsigned long     shed[RADPACER_CLASSES];
+};
+
+/**
+ * Pacers are never freed, like destinations. A pacer without its own
+ * configuration keeps a copy of the process default, refreshed when the
+ * default changes, so requests never read the registry.
+ **/
+static struct {
+  pthread_mutex_t   mutex;
+  RADIUSPacer      *buckets[RADPACER_BUCKETS];
+  RADIUSPacerConfig config;
+} registry = { PTHREAD_MUTEX_INITIALIZER, { NULL },
+               { 0, 0, 5000, { 1024, 1024, 1024, 1024 } } };
+
+/* Internal declaration */
+
+static uint32_t pacer_hash    (const fr_ipaddr_t *ipaddr);
+static double   pacer_now     (void);
+static void     pacer_refill  (RADIUSPacer *p, const RADIUSPacerConfig *cfg,
+                               double now);
+static int      pacer_resolve (const char *host, fr_ipaddr_t *ipaddr);
+static void     config_copy   (RADIUSPacerConfig *dst,
+                               const RADIUSPacerConfig *src);
+
+/* Implementation */
+
+RADIUSPacer *
+radpacer_get (const fr_ipaddr_t *ipaddr)
+{
+  RADIUSPacer *p = NULL;
+  pthread_condattr_t attr;
+  uint32_t hash;
+
+  if (!ipaddr)
+    return NULL;
+
+  hash = pacer_hash (ipaddr) % RADPACER_BUCKETS;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (p = registry.buckets[hash]; p; p = p->next)
+    {
+      if (fr_ipaddr_cmp (&p->ipaddr, ipaddr) == 0)
+        goto done;
+    }
+
+  p = calloc (1, sizeof (RADIUSPacer));
+  if (!p)
+    goto done;
+
+  memcpy (&p->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  memcpy (&p->config, &registry.config, sizeof (RADIUSPacerConfig));
+  p->last = -1;
+  pthread_mutex_init (&p->mutex, NULL);
+
+  /* Deadlines are monotonic, a clock step must not flush the queues */
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&p->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  p->next = registry.buckets[hash];
+  registry.buckets[hash] = p;
+
+done:
+  pthread_mutex_unlock (&registry.mutex);
+  return p;
+}
+
+RADIUSPacer *
+radpacer_lookup (const char *host)
+{
+  RADIUSPacer *p = NULL;
+  fr_ipaddr_t ipaddr;
+  uint32_t hash;
+
+  if (pacer_resolve (host, &ipaddr) == RADIUSCLIENT_ERR)
+    return NULL;
+
+  hash = pacer_hash (&ipaddr) % RADPACER_BUCKETS;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (p = registry.buckets[hash]; p; p = p->next)
+    {
+      if (fr_ipaddr_cmp (&p->ipaddr, &ipaddr) == 0)
+        break;
+    }
+
+  pthread_mutex_unlock (&registry.mutex);
+  return p;
+}
+
+void
+radpacer_foreach (RADIUSPacerFunc func, void *arg)
+{
+  RADIUSPacer *p = NULL;
+  int i;
+
+  if (!func)
+    return;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (i = 0; i < RADPACER_BUCKETS; i++)
+    {
+      for (p = registry.buckets[i]; p; p = p->next)
+        func (p, arg);
+    }
+
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+void
+radpacer_info (RADIUSPacer *p, RADIUSPacerInfo *info)
+{
+  const RADIUSPacerConfig *cfg = NULL;
+
+  if (!p || !info)
+    return;
+
+  memset (info, 0, sizeof (RADIUSPacerInfo));
+  ip_ntoh (&p->ipaddr, info->host, sizeof (info->host));
+
+  pthread_mutex_lock (&p->mutex);
+
+  cfg = &p->config;
+
+  if (cfg->rate > 0)
+    pacer_refill (p, cfg, pacer_now ());
+
+  info->rate   = cfg->rate;
+  info->burst  = cfg->burst;
+  info->tokens = p->tokens;
+  memcpy (info->queued, p->queued, sizeof (info->queued));
+  memcpy (info->sent, p->sent, sizeof (info->sent));
+  memcpy (info->shed, p->shed, sizeof (info->shed));
+
+  pthread_mutex_unlock (&p->mutex);
+}
+
+void
+radpacer_config_default (RADIUSPacerConfig *config)
+{
+  pthread_mutex_lock (&registry.mutex);
+  memcpy (config, &registry.config, sizeof (RADIUSPacerConfig));
+  pthread_mutex_unlock (&registry.mutex);
+}
+
+/**
+ * Without a host the configuration becomes the process default, with one
+ * it only applies to that server.
+ **/
+int
+radpacer_configure (const char *host, const RADIUSPacerConfig *config)
+{
+  RADIUSPacer *p = NULL;
+  fr_ipaddr_t ipaddr;
+  int i;
+
+  if (!config)
+    return RADIUSCLIENT_ERR;
+
+  if (!host)
+    {
+      pthread_mutex_lock (&registry.mutex);
+      config_copy (&registry.config, config);
+
+      /* Waiting requests recompute their deadline with the new rate */
+      for (i = 0; i < RADPACER_BUCKETS; i++)
+        {
+          for (p = registry.buckets[i]; p; p = p->next)
+            {
+              pthread_mutex_lock (&p->mutex);
+              if (!p->custom)
+                {
+                  memcpy (&p->config, &registry.config,
+                          sizeof (RADIUSPacerConfig));
+                  p->last = -1;
+                }
+              pthread_cond_broadcast (&p->cond);
+              pthread_mutex_unlock (&p->mutex);
+            }
+        }
+
+      pthread_mutex_unlock (&registry.mutex);
+      return RADIUSCLIENT_OK;
+    }
+
+  if (pacer_resolve (host, &ipaddr) == RADIUSCLIENT_ERR)
+    return RADIUSCLIENT_ERR;
+
+  p = radpacer_get (&ipaddr);
+  if (!p)
+    return RADIUSCLIENT_ERR;
+
+  pthread_mutex_lock (&p->mutex);
+  config_copy (&p->config, config);
+  p->custom = 1;
+  p->last   = -1;
+  pthread_cond_broadcast (&p->cond);
+  pthread_mutex_unlock (&p->mutex);
+
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * Wait for a token. A request only takes one when no request of a higher
+ * class is queued, so authentication never waits behind accounting.
+ * Sheds the request when its class queue is full or it queued longer than
+ * max_wait.
+ **/
+int
+radpacer_acquire (RADIUSPacer *p, int cls)
+{
+  const RADIUSPacerConfig *cfg = NULL;
+  struct timespec ts;
+  double now, deadline, wait;
+  int res = RADIUSCLIENT_ERR;
+  int ahead, i;
+
+  if (!p || (cls < 0) || (cls >= RADPACER_CLASSES))
+    return RADIUSCLIENT_OK;
+
+  pthread_mutex_lock (&p->mutex);
+
+  cfg = &p->config;
+
+  if (cfg->rate <= 0)
+    {
+      p->sent[cls]++;
+      pthread_mutex_unlock (&p->mutex);
+      return RADIUSCLIENT_OK;
+    }
+
+  if (p->queued[cls] >= cfg->queue[cls])
+    {
+      p->shed[cls]++;
+      pthread_mutex_unlock (&p->mutex);
+      return RADIUSCLIENT_ERR;
+    }
+
+  p->queued[cls]++;
+
+  now = pacer_now ();
+  deadline = now + cfg->max_wait / 1000.0;
+
+  for (;;)
+    {
+      pacer_refill (p, cfg, now);
+
+      for (ahead = 0, i = 0; i < cls; i++)
+        ahead += p->queued[i];
+
+      if (!ahead && (p->tokens >= 1))
+        {
+          p->tokens -= 1;
+          p->sent[cls]++;
+          res = RADIUSCLIENT_OK;
+          break;
+        }
+
+      if (now >= deadline)
+        {
+          p->shed[cls]++;
+          break;
+        }
+
+      /* Behind a higher class there is nothing to do until it is served */
+      wait = deadline - now;
+      if (!ahead && ((1 - p->tokens) / cfg->rate < wait))
+        wait = (1 - p->tokens) / cfg->rate;
+
+      wait += now;
+      ts.tv_sec  = (time_t) wait;
+      ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+
+      pthread_cond_timedwait (&p->cond, &p->mutex, &ts);
+
+      /* The pacer may have been disabled while we slept */
+      if (cfg->rate <= 0)
+        {
+          p->sent[cls]++;
+          res = RADIUSCLIENT_OK;
+          break;
+        }
+
+      now = pacer_now ();
+    }
+
+  p->queued[cls]--;
+
+  /* Lower classes may be next, or there may be another token */
+  pthread_cond_broadcast (&p->cond);
+  pthread_mutex_unlock (&p->mutex);
+
+  return res;
+}
+
+/**
+ * Same as radpacer_acquire without ever waiting, for an event loop that
+ * cannot block: a request that finds no token, or a higher class queued
+ * ahead of it, is shed at once.
+ **/
+int
+radpacer_try (RADIUSPacer *p, int cls)
+{
+  const RADIUSPacerConfig *cfg = NULL;
+  int res = RADIUSCLIENT_ERR;
+  int ahead, i;
+
+  if (!p || (cls < 0) || (cls >= RADPACER_CLASSES))
+    return RADIUSCLIENT_OK;
+
+  pthread_mutex_lock (&p->mutex);
+
+  cfg = &p->config;
+
+  if (cfg->rate <= 0)
+    {
+      p->sent[cls]++;
+      pthread_mutex_unlock (&p->mutex);
+      return RADIUSCLIENT_OK;
+    }
+
+  pacer_refill (p, cfg, pacer_now ());
+
+  for (ahead = 0, i = 0; i < cls; i++)
+    ahead += p->queued[i];
+
+  if (!ahead && (p->tokens >= 1))
+    {
+      p->tokens -= 1;
+      p->sent[cls]++;
+      res = RADIUSCLIENT_OK;
+    }
+  else
+    {
+      p->shed[cls]++;
+    }
+
+  pthread_mutex_unlock (&p->mutex);
+
+  return res;
+}
+
+const char *
+radpacer_class_name (int cls)
+{
+  switch (cls)
+    {
+      case RADPACER_CLASS_AUTH:
+        return "auth";
+      case RADPACER_CLASS_STOP:
+        return "stop";
+      case RADPACER_CLASS_START:
+        return "start";
+      case RADPACER_CLASS_INTERIM:
+        return "interim";
+      default:
+        return "unknown";
+    }
+}
+
+/* Internal implementation */
+
+static uint32_t
+pacer_hash (const fr_ipaddr_t *ipaddr)
+{
+  if (ipaddr->af == AF_INET)
+    return fr_hash (&ipaddr->ipaddr.ip4addr, sizeof (struct in_addr));
+
+  return fr_hash (&ipaddr->ipaddr.ip6addr, sizeof (struct in6_addr));
+}
+
+static double
+pacer_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+pacer_refill (RADIUSPacer *p, const RADIUSPacerConfig *cfg, double now)
+{
+  /* A new or reconfigured bucket starts full */
+  if (p->last < 0)
+    p->tokens = cfg->burst;
+  else
+    p->tokens += (now - p->last) * cfg->rate;
+
+  if (p->tokens > cfg->burst)
+    p->tokens = cfg->burst;
+
+  p->last = now;
+}
+
+static int
+pacer_resolve (const char *host, fr_ipaddr_t *ipaddr)
+{
+  if (!host)
+    return RADIUSCLIENT_ERR;
+
+  if (ip_hton (host, strchr (host, ':') ? AF_INET6 : AF_INET, ipaddr) < 0)
+    return RADIUSCLIENT_ERR;
+
+  return RADIUSCLIENT_OK;
+}
+
+static void
+config_copy (RADIUSPacerConfig *dst, const RADIUSPacerConfig *src)
+{
+  int i;
+
+  dst->rate     = src->rate > 0 ? src->rate : 0;
+  dst->burst    = src->burst > 0 ? src->burst : (int) src->rate;
+  dst->max_wait = src->max_wait > 0 ? src->max_wait : 0;
+
+  /* A token must fit in the bucket */
+  if (dst->burst < 1)
+    dst->burst = 1;
+
+  for (i = 0; i < RADPACER_CLASSES; i++)
+    dst->queue[i] = src->queue[i] > 0 ? src->queue[i] : 0;
+}
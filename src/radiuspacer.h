@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSPACER_H
+#define _RADIUSPACER_H
+
+#include <freeradius/libradius.h>
+
+typedef struct _RADIUSPacer RADIUSPacer;
+
+/* Priority classes, a lower value is served first */
+enum {
+  RADPACER_CLASS_AUTH = 0,
+  RADPACER_CLASS_STOP,
+  RADPACER_CLASS_START,
+  RADPACER_CLASS_INTERIM,
+  RADPACER_CLASSES
+};
+
+typedef struct _RADIUSPacerConfig {
+  double rate;                    /* requests per second, 0 disables it */
+  int    burst;                   /* bucket size, defaults to the rate */
+  int    max_wait;                /* milliseconds a request may queue */
+  int    queue[RADPACER_CLASSES]; /* queued requests allowed per class */
+} RADIUSPacerConfig;
+
+typedef struct _RADIUSPacerInfo {
+  char          host[INET6_ADDRSTRLEN];
+  double        rate;
+  int           burst;
+  double        tokens;
+  int           queued[RADPACER_CLASSES];
+  unsigned long sent[RADPACER_CLASSES];
+  unsigned long shed[RADPACER_CLASSES];
+} RADIUSPacerInfo;
+
+typedef void (*RADIUSPacerFunc) (RADIUSPacer *p, void *arg);
+
+/**
+ * Token bucket per server address, shared by its authentication and
+ * accounting ports and by every client of the process.
+ **/
+RADIUSPacer *radpacer_get     (const fr_ipaddr_t *ipaddr);
+RADIUSPacer *radpacer_lookup  (const char *host);
+void         radpacer_foreach (RADIUSPacerFunc func, void *arg);
+void         radpacer_info    (RADIUSPacer *p, RADIUSPacerInfo *info);
+
+void radpacer_config_default (RADIUSPacerConfig *config);
+int  radpacer_configure      (const char *host,
+                              const RADIUSPacerConfig *config);
+int  radpacer_acquire        (RADIUSPacer *p, int cls);
+int  radpacer_try            (RADIUSPacer *p, int cls);
+
+const char *radpacer_class_name (int cls);
+
+#endif /* _RADIUSPACER_H */
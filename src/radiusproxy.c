@@ -0,0 +1,1341 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include "radiusclient.h"
+#include "radiusdict.h"
+#include "radiusproxy.h"
+
+#define RADPROXY_UPSTREAMS_MAX  32
+#define RADPROXY_REMOVED_MAX    16
+#define RADPROXY_PASSWORD_MAX   128
+#define RADPROXY_BATCH_DEFAULT  32
+#define RADPROXY_VENDOR_MS      311
+#define RADPROXY_MPPE_SEND_KEY  16
+#define RADPROXY_MPPE_RECV_KEY  17
+
+#if defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)
+typedef struct mmsghdr RADIUSProxyMsg;
+#else
+typedef struct _RADIUSProxyMsg {
+  struct msghdr msg_hdr;
+  unsigned int  msg_len;
+} RADIUSProxyMsg;
+#endif
+
+/**
+ * What the proxy remembers of a request in flight, indexed by the ID used
+ * towards the upstream. Both authenticators are kept since accounting
+ * requests are signed again for the upstream secret.
+ **/
+typedef struct _RADIUSProxySlot {
+  uint8_t  used;
+  uint8_t  id;
+  uint16_t src_len;
+  uint32_t expire;
+  uint8_t  vector[AUTH_VECTOR_LEN];
+  uint8_t  up_vector[AUTH_VECTOR_LEN];
+  union {
+    struct sockaddr     sa;
+    struct sockaddr_in  in4;
+    struct sockaddr_in6 in6;
+  } src;
+} RADIUSProxySlot;
+
+typedef struct _RADIUSProxyUpstream {
+  RADIUSServer   *server;
+  int             fd;
+  int             next_id;
+  RADIUSProxySlot slots[256];
+} RADIUSProxyUpstream;
+
+/**
+ * The hook works on the received buffer. Removed attributes are only
+ * marked and new ones are encoded aside, the forwarded packet is then
+ * assembled from ranges of the original buffer.
+ **/
+struct _RADIUSProxyRequest {
+  RADIUSProxy  *proxy;
+  uint8_t      *data;
+  size_t        len;
+  struct sockaddr_storage *src;
+  socklen_t     src_len;
+  uint8_t       removed[32];
+  unsigned int  vsa_removed[RADPROXY_REMOVED_MAX];
+  int           vsa_count;
+  int           password_len;
+  char          password[RADPROXY_PASSWORD_MAX];
+  size_t        added_len;
+  uint8_t       added[MAX_PACKET_LEN];
+};
+
+typedef struct _RADIUSProxyOut {
+  int       fd;
+  size_t    len;
+  socklen_t sa_len;
+  struct sockaddr_storage sa;
+} RADIUSProxyOut;
+
+struct _RADIUSProxy {
+  int                  fd;
+  int                  dict;
+  char                *secret;
+  int                  batch;
+  int                  timeout;
+  int                  count;
+  int                  next_upstream;
+  RADIUSProxyUpstream *upstreams[RADPROXY_UPSTREAMS_MAX];
+  RADIUSProxyHook      hook;
+  void                *hook_arg;
+  RADIUSProxyStats     stats;
+  RADIUSProxyRequest   req;
+  RADIUSProxyMsg      *msgs;
+  struct iovec        *iov;
+  struct sockaddr_storage *addrs;
+  uint8_t             *in;
+  uint8_t             *out;
+  RADIUSProxyOut      *outs;
+  int                  nouts;
+};
+
+/* Internal declaration */
+
+static uint32_t proxy_now       (void);
+static int      proxy_receive   (RADIUSProxy *p, int fd, int upstream);
+static void     proxy_flush     (RADIUSProxy *p);
+static void     proxy_request   (RADIUSProxy *p, uint8_t *buf, size_t len,
+                                 struct sockaddr_storage *src,
+                                 socklen_t src_len);
+static void     proxy_reply     (RADIUSProxy *p, RADIUSProxyUpstream *u,
+                                 uint8_t *buf, size_t len);
+static int      slot_reserve    (RADIUSProxy *p, RADIUSProxyUpstream *u);
+static size_t   request_build   (RADIUSProxyRequest *req,
+                                 RADIUSProxyUpstream *u, int id,
+                                 uint8_t *out);
+static int      request_verify  (const RADIUSProxy *p, uint8_t *buf,
+                                 size_t len);
+static size_t   vsa_filter      (const RADIUSProxyRequest *req,
+                                 const uint8_t *attr, uint8_t *out);
+static void     added_remove    (RADIUSProxyRequest *req, unsigned int attr);
+static int      packet_check    (const uint8_t *buf, size_t *len);
+static uint8_t *attr_find       (uint8_t *buf, size_t len,
+                                 unsigned int attr);
+static int      ma_verify       (uint8_t *buf, size_t len, uint8_t *ma,
+                                 const uint8_t *vector, const char *secret);
+static void     packet_md5      (uint8_t *digest, const uint8_t *buf,
+                                 size_t len, const char *secret);
+static void     hidden_key      (uint8_t *key, const char *secret,
+                                 const uint8_t *prev, const uint8_t *salt);
+static void     hidden_swap     (uint8_t *value, size_t len,
+                                 const uint8_t *salt, const char *from,
+                                 const uint8_t *from_vector, const char *to,
+                                 const uint8_t *to_vector);
+static void     hidden_crypt    (uint8_t *value, size_t len,
+                                 const char *secret, const uint8_t *vector,
+                                 int decrypt);
+
+/* Implementation */
+
+RADIUSProxy *
+radproxy_new (const char *host, int port, const char *secret, int batch,
+              int timeout, const char **errmsg)
+{
+  RADIUSProxy *p = NULL;
+  fr_ipaddr_t ipaddr;
+  int i;
+
+  if (!host)
+    host = "0.0.0.0";
+
+  if (!secret || !*secret)
+    {
+      *errmsg = "Invalid secret";
+      return NULL;
+    }
+
+  if (ip_hton (host, strchr (host, ':') ? AF_INET6 : AF_INET, &ipaddr) < 0)
+    {
+      *errmsg = "Failed to find IP address for host";
+      return NULL;
+    }
+
+  if (batch <= 0)
+    batch = RADPROXY_BATCH_DEFAULT;
+  else if (batch > RADPROXY_BATCH_MAX)
+    batch = RADPROXY_BATCH_MAX;
+
+  p = calloc (1, sizeof (RADIUSProxy));
+  if (!p)
+    goto nomem;
+
+  p->fd      = -1;
+  p->batch   = batch;
+  p->timeout = timeout > 0 ? timeout : 5000;
+  p->secret  = strdup (secret);
+  p->msgs    = calloc (batch, sizeof (RADIUSProxyMsg));
+  p->iov     = calloc (batch, sizeof (struct iovec));
+  p->addrs   = calloc (batch, sizeof (struct sockaddr_storage));
+  p->in      = malloc (batch * MAX_PACKET_LEN);
+  p->out     = malloc (batch * MAX_PACKET_LEN);
+  p->outs    = calloc (batch, sizeof (RADIUSProxyOut));
+
+  if (!p->secret || !p->msgs || !p->iov || !p->addrs || !p->in ||
+      !p->out || !p->outs)
+    goto nomem;
+
+  for (i = 0; i < batch; i++)
+    {
+      p->iov[i].iov_base = p->in + i * MAX_PACKET_LEN;
+      p->iov[i].iov_len  = MAX_PACKET_LEN;
+      p->msgs[i].msg_hdr.msg_iov    = &p->iov[i];
+      p->msgs[i].msg_hdr.msg_iovlen = 1;
+      p->msgs[i].msg_hdr.msg_name   = &p->addrs[i];
+    }
+
+  /* The hook parses attribute values with the dictionary */
+  if (raddict_acquire (errmsg) == RADIUSCLIENT_ERR)
+    {
+      radproxy_free (p);
+      return NULL;
+    }
+
+  p->dict = 1;
+
+  p->fd = fr_socket (&ipaddr, port);
+  if (p->fd < 0)
+    {
+      *errmsg = "Failed to open the proxy socket";
+      radproxy_free (p);
+      return NULL;
+    }
+
+  return p;
+
+nomem:
+  *errmsg = "Out of memory";
+  radproxy_free (p);
+  return NULL;
+}
+
+void
+radproxy_free (RADIUSProxy *p)
+{
+  int i;
+
+  if (!p)
+    return;
+
+  for (i = 0; i < p->count; i++)
+    {
+      close (p->upstreams[i]->fd);
+      radserver_unref (p->upstreams[i]->server);
+      free (p->upstreams[i]);
+    }
+
+  if (p->fd >= 0)
+    close (p->fd);
+
+  if (p->dict)
+    raddict_release ();
+
+  free (p->secret);
+  free (p->msgs);
+  free (p->iov);
+  free (p->addrs);
+  free (p->in);
+  free (p->out);
+  free (p->outs);
+  free (p);
+}
+
+int
+radproxy_upstream_add (RADIUSProxy *p, RADIUSServer *server)
+{
+  RADIUSProxyUpstream *u = NULL;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+
+  if (!p || !server || (p->count >= RADPROXY_UPSTREAMS_MAX))
+    return RADIUSCLIENT_ERR;
+
+  u = calloc (1, sizeof (RADIUSProxyUpstream));
+  if (!u)
+    return RADIUSCLIENT_ERR;
+
+  u->next_id = fr_rand () & 0xff;
+
+  /* Connected, replies from anyone else never reach the socket */
+  u->fd = socket (radserver_ipaddr (server)->af, SOCK_DGRAM, 0);
+  if ((u->fd < 0) ||
+      !fr_ipaddr2sockaddr (radserver_ipaddr (server), radserver_port (server),
+                           &sa, &sa_len) ||
+      (connect (u->fd, (struct sockaddr *) &sa, sa_len) < 0))
+    {
+      if (u->fd >= 0)
+        close (u->fd);
+      free (u);
+      return RADIUSCLIENT_ERR;
+    }
+
+  u->server = radserver_ref (server);
+  p->upstreams[p->count++] = u;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radproxy_upstreams (RADIUSProxy *p)
+{
+  return p ? p->count : 0;
+}
+
+void
+radproxy_hook_set (RADIUSProxy *p, RADIUSProxyHook hook, void *arg)
+{
+  if (!p)
+    return;
+
+  p->hook     = hook;
+  p->hook_arg = arg;
+}
+
+int
+radproxy_port (RADIUSProxy *p)
+{
+  struct sockaddr_storage sa;
+  socklen_t sa_len = sizeof (sa);
+  fr_ipaddr_t ipaddr;
+  int port = 0;
+
+  if (!p || (getsockname (p->fd, (struct sockaddr *) &sa, &sa_len) < 0))
+    return -1;
+
+  fr_sockaddr2ipaddr (&sa, sa_len, &ipaddr, &port);
+
+  return port;
+}
+
+/**
+ * Wait up to timeout milliseconds, then handle one batch from every socket
+ * that is ready. Returns the number of packets received.
+ **/
+int
+radproxy_run (RADIUSProxy *p, int timeout)
+{
+  struct pollfd pfd[RADPROXY_UPSTREAMS_MAX + 1];
+  int handled = 0;
+  int i;
+
+  if (!p)
+    return -1;
+
+  pfd[0].fd     = p->fd;
+  pfd[0].events = POLLIN;
+
+  for (i = 0; i < p->count; i++)
+    {
+      pfd[i + 1].fd     = p->upstreams[i]->fd;
+      pfd[i + 1].events = POLLIN;
+    }
+
+  if (poll (pfd, p->count + 1, timeout) < 0)
+    return (errno == EINTR) ? 0 : -1;
+
+  /* Replies first, they free IDs for the new requests */
+  for (i = 0; i < p->count; i++)
+    {
+      if (pfd[i + 1].revents)
+        handled += proxy_receive (p, p->upstreams[i]->fd, i);
+    }
+
+  if (pfd[0].revents)
+    handled += proxy_receive (p, p->fd, -1);
+
+  return handled;
+}
+
+void
+radproxy_stats (RADIUSProxy *p, RADIUSProxyStats *stats)
+{
+  if (!p || !stats)
+    return;
+
+  memcpy (stats, &p->stats, sizeof (RADIUSProxyStats));
+}
+
+int
+radproxy_req_code (RADIUSProxyRequest *req)
+{
+  return req ? req->data[0] : 0;
+}
+
+int
+radproxy_req_source (RADIUSProxyRequest *req, char *host, size_t host_len,
+                     int *port)
+{
+  fr_ipaddr_t ipaddr;
+
+  if (!req || !host || !port)
+    return RADIUSCLIENT_ERR;
+
+  if (!fr_sockaddr2ipaddr (req->src, req->src_len, &ipaddr, port))
+    return RADIUSCLIENT_ERR;
+
+  ip_ntoh (&ipaddr, host, host_len);
+
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * Raw value of the attribute as it will be forwarded. Vendor attributes
+ * are given as (vendor << 16) | type, like the dictionary does.
+ **/
+int
+radproxy_req_attr_get (RADIUSProxyRequest *req, unsigned int attr,
+                       const uint8_t **value, size_t *value_len)
+{
+  const uint8_t *a = NULL;
+  const uint8_t *end = NULL;
+  int i;
+
+  if (!req || !value || !value_len)
+    return RADIUSCLIENT_ERR;
+
+  a = attr_find (req->added, req->added_len, attr);
+  if (a)
+    goto found;
+
+  if (attr < 256)
+    {
+      if (req->removed[attr >> 3] & (1 << (attr & 7)))
+        return RADIUSCLIENT_ERR;
+
+      a = attr_find (req->data + AUTH_HDR_LEN, req->len - AUTH_HDR_LEN,
+                     attr);
+      if (a)
+        goto found;
+
+      return RADIUSCLIENT_ERR;
+    }
+
+  for (i = 0; i < req->vsa_count; i++)
+    {
+      if (req->vsa_removed[i] == attr)
+        return RADIUSCLIENT_ERR;
+    }
+
+  a = attr_find (req->data + AUTH_HDR_LEN, req->len - AUTH_HDR_LEN, attr);
+  if (!a)
+    return RADIUSCLIENT_ERR;
+
+found:
+  end = a + a[1];
+  *value     = a + 2;
+  *value_len = end - *value;
+
+  return RADIUSCLIENT_OK;
+}
+
+int
+radproxy_req_password (RADIUSProxyRequest *req, char *buf, size_t buf_len)
+{
+  uint8_t value[RADPROXY_PASSWORD_MAX];
+  uint8_t *a = NULL;
+  size_t len;
+
+  if (!req || !buf || !buf_len)
+    return RADIUSCLIENT_ERR;
+
+  if (req->password_len >= 0)
+    {
+      len = req->password_len;
+      memcpy (value, req->password, len);
+    }
+  else
+    {
+      a = attr_find (req->data + AUTH_HDR_LEN, req->len - AUTH_HDR_LEN,
+                     PW_USER_PASSWORD);
+      if (!a)
+        return RADIUSCLIENT_ERR;
+
+      len = a[1] - 2;
+      if ((len == 0) || (len % AUTH_VECTOR_LEN) || (len > sizeof (value)))
+        return RADIUSCLIENT_ERR;
+
+      memcpy (value, a + 2, len);
+      hidden_crypt (value, len, req->proxy->secret, req->data + 4, 1);
+
+      while ((len > 0) && (value[len - 1] == 0))
+        len--;
+    }
+
+  if (len >= buf_len)
+    return RADIUSCLIENT_ERR;
+
+  memcpy (buf, value, len);
+  buf[len] = '\0';
+
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * Replace every instance of the attribute with the given value, parsed as
+ * the dictionary says. The User-Password is hidden again when forwarded,
+ * other encrypted attributes can not be set.
+ **/
+int
+radproxy_req_attr_set (RADIUSProxyRequest *req, const char *attr,
+                       const char *value)
+{
+  RADIUS_PACKET packet;
+  VALUE_PAIR *vp = NULL;
+  uint8_t buf[MAX_PACKET_LEN];
+  int res = RADIUSCLIENT_ERR;
+  int len;
+
+  if (!req || !attr || !value)
+    return RADIUSCLIENT_ERR;
+
+  vp = pairmake (attr, value, T_OP_EQ);
+  if (!vp)
+    return RADIUSCLIENT_ERR;
+
+  if (vp->attribute == PW_USER_PASSWORD)
+    {
+      len = strlen (value);
+      if (len > RADPROXY_PASSWORD_MAX)
+        goto done;
+
+      radproxy_req_attr_remove (req, PW_USER_PASSWORD);
+      memcpy (req->password, value, len);
+      req->password_len = len;
+      res = RADIUSCLIENT_OK;
+      goto done;
+    }
+
+  if ((vp->attribute == PW_MESSAGE_AUTHENTICATOR) || vp->flags.encrypt)
+    goto done;
+
+  if (radproxy_req_attr_remove (req, vp->attribute) == RADIUSCLIENT_ERR)
+    goto done;
+
+  memset (&packet, 0, sizeof (packet));
+  packet.code = req->data[0];
+  memcpy (packet.vector, req->data + 4, AUTH_VECTOR_LEN);
+
+  len = rad_vp2attr (&packet, NULL, "", vp, buf);
+  if ((len <= 0) || (req->added_len + len > sizeof (req->added)))
+    goto done;
+
+  memcpy (req->added + req->added_len, buf, len);
+  req->added_len += len;
+  res = RADIUSCLIENT_OK;
+
+done:
+  pairfree (&vp);
+  return res;
+}
+
+int
+radproxy_req_attr_remove (RADIUSProxyRequest *req, unsigned int attr)
+{
+  int i;
+
+  if (!req)
+    return RADIUSCLIENT_ERR;
+
+  added_remove (req, attr);
+
+  if (attr < 256)
+    {
+      req->removed[attr >> 3] |= 1 << (attr & 7);
+
+      if (attr == PW_USER_PASSWORD)
+        req->password_len = -1;
+
+      return RADIUSCLIENT_OK;
+    }
+
+  for (i = 0; i < req->vsa_count; i++)
+    {
+      if (req->vsa_removed[i] == attr)
+        return RADIUSCLIENT_OK;
+    }
+
+  if (req->vsa_count >= RADPROXY_REMOVED_MAX)
+    return RADIUSCLIENT_ERR;
+
+  req->vsa_removed[req->vsa_count++] = attr;
+
+  return RADIUSCLIENT_OK;
+}
+
+/* Internal implementation */
+
+static uint32_t
+proxy_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static int
+proxy_receive (RADIUSProxy *p, int fd, int upstream)
+{
+  int n, i;
+
+#ifdef HAVE_RECVMMSG
+  for (i = 0; i < p->batch; i++)
+    p->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+
+  n = recvmmsg (fd, p->msgs, p->batch, MSG_DONTWAIT, NULL);
+  if (n < 0)
+    return 0;
+#else
+  for (n = 0; n < p->batch; n++)
+    {
+      socklen_t sa_len = sizeof (struct sockaddr_storage);
+      ssize_t len;
+
+      len = recvfrom (fd, p->iov[n].iov_base, MAX_PACKET_LEN, MSG_DONTWAIT,
+                      (struct sockaddr *) &p->addrs[n], &sa_len);
+      if (len < 0)
+        break;
+
+      p->msgs[n].msg_len = len;
+      p->msgs[n].msg_hdr.msg_namelen = sa_len;
+    }
+#endif
+
+  p->nouts = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      uint8_t *buf = p->in + i * MAX_PACKET_LEN;
+
+      if (upstream < 0)
+        proxy_request (p, buf, p->msgs[i].msg_len, &p->addrs[i],
+                       p->msgs[i].msg_hdr.msg_namelen);
+      else
+        proxy_reply (p, p->upstreams[upstream], buf, p->msgs[i].msg_len);
+    }
+
+  proxy_flush (p);
+
+  return n;
+}
+
+/**
+ * Send the packets built from the last batch, with one system call per
+ * socket when sendmmsg is available.
+ **/
+static void
+proxy_flush (RADIUSProxy *p)
+{
+  RADIUSProxyOut *o = NULL;
+  int i, j, fd;
+
+  for (i = 0; i < p->nouts; i++)
+    {
+      fd = p->outs[i].fd;
+      if (fd < 0)
+        continue;
+
+#ifdef HAVE_SENDMMSG
+      {
+        int n = 0;
+        int sent = 0;
+        int res;
+
+        for (j = i; j < p->nouts; j++)
+          {
+            o = &p->outs[j];
+            if (o->fd != fd)
+              continue;
+
+            p->iov[n].iov_base = p->out + j * MAX_PACKET_LEN;
+            p->iov[n].iov_len  = o->len;
+            p->msgs[n].msg_hdr.msg_name    = o->sa_len ? &o->sa : NULL;
+            p->msgs[n].msg_hdr.msg_namelen = o->sa_len;
+            n++;
+
+            o->fd = -1;
+          }
+
+        while (sent < n)
+          {
+            res = sendmmsg (fd, p->msgs + sent, n - sent, MSG_DONTWAIT);
+            if (res <= 0)
+              break;
+            sent += res;
+          }
+      }
+#else
+      for (j = i; j < p->nouts; j++)
+        {
+          o = &p->outs[j];
+          if (o->fd != fd)
+            continue;
+
+          sendto (fd, p->out + j * MAX_PACKET_LEN, o->len, MSG_DONTWAIT,
+                  o->sa_len ? (struct sockaddr *) &o->sa : NULL, o->sa_len);
+          o->fd = -1;
+        }
+#endif
+    }
+
+  /* The receive vectors were borrowed for sending */
+  for (i = 0; i < p->batch; i++)
+    {
+      p->iov[i].iov_base = p->in + i * MAX_PACKET_LEN;
+      p->iov[i].iov_len  = MAX_PACKET_LEN;
+      p->msgs[i].msg_hdr.msg_name = &p->addrs[i];
+    }
+
+  p->nouts = 0;
+}
+
+static void
+proxy_request (RADIUSProxy *p, uint8_t *buf, size_t len,
+               struct sockaddr_storage *src, socklen_t src_len)
+{
+  RADIUSProxyRequest  *req = &p->req;
+  RADIUSProxyUpstream *u   = NULL;
+  RADIUSProxySlot     *slot = NULL;
+  RADIUSProxyOut      *o   = NULL;
+  uint8_t *out = p->out + p->nouts * MAX_PACKET_LEN;
+  int route = RADPROXY_ROUTE_DEFAULT;
+  int id;
+
+  p->stats.received++;
+
+  if ((packet_check (buf, &len) == RADIUSCLIENT_ERR) ||
+      (src_len > sizeof (slot->src)) ||
+      (request_verify (p, buf, len) == RADIUSCLIENT_ERR))
+    {
+      p->stats.invalid++;
+      return;
+    }
+
+  req->proxy        = p;
+  req->data         = buf;
+  req->len          = len;
+  req->src          = src;
+  req->src_len      = src_len;
+  req->vsa_count    = 0;
+  req->password_len = -1;
+  req->added_len    = 0;
+  memset (req->removed, 0, sizeof (req->removed));
+
+  if (p->hook)
+    route = p->hook (req, p->hook_arg);
+
+  if (route == RADPROXY_ROUTE_ERROR)
+    {
+      p->stats.hook_errors++;
+      return;
+    }
+
+  if ((route == RADPROXY_ROUTE_DROP) || (p->count == 0))
+    {
+      p->stats.dropped++;
+      return;
+    }
+
+  if ((route < 0) || (route >= p->count))
+    {
+      route = p->next_upstream;
+      p->next_upstream = (p->next_upstream + 1) % p->count;
+    }
+
+  u  = p->upstreams[route];
+  id = slot_reserve (p, u);
+  if (id < 0)
+    {
+      p->stats.busy++;
+      return;
+    }
+
+  o = &p->outs[p->nouts];
+  o->len = request_build (req, u, id, out);
+  if (!o->len)
+    {
+      p->stats.invalid++;
+      return;
+    }
+
+  slot = &u->slots[id];
+  slot->used    = 1;
+  slot->id      = buf[1];
+  slot->expire  = proxy_now () + p->timeout;
+  slot->src_len = src_len;
+  memcpy (slot->vector, buf + 4, AUTH_VECTOR_LEN);
+  memcpy (slot->up_vector, out + 4, AUTH_VECTOR_LEN);
+  memcpy (&slot->src, src, src_len);
+
+  o->fd     = u->fd;
+  o->sa_len = 0;
+  p->nouts++;
+
+  p->stats.forwarded++;
+}
+
+static void
+proxy_reply (RADIUSProxy *p, RADIUSProxyUpstream *u, uint8_t *buf,
+             size_t len)
+{
+  RADIUSProxySlot *slot = &u->slots[buf[1]];
+  RADIUSProxyOut  *o    = NULL;
+  const char *secret = radserver_secret (u->server);
+  uint8_t *out = p->out + p->nouts * MAX_PACKET_LEN;
+  uint8_t *a   = NULL;
+  uint8_t *end = NULL;
+  uint8_t *sub = NULL;
+  uint8_t *ma  = NULL;
+  uint8_t digest[AUTH_VECTOR_LEN];
+  uint8_t saved[AUTH_VECTOR_LEN];
+
+  if ((packet_check (buf, &len) == RADIUSCLIENT_ERR) || !slot->used)
+    {
+      p->stats.invalid++;
+      return;
+    }
+
+  /* Response authenticator, computed over the request authenticator */
+  memcpy (saved, buf + 4, AUTH_VECTOR_LEN);
+  memcpy (buf + 4, slot->up_vector, AUTH_VECTOR_LEN);
+  packet_md5 (digest, buf, len, secret);
+
+  if (memcmp (digest, saved, AUTH_VECTOR_LEN) != 0)
+    {
+      p->stats.invalid++;
+      return;
+    }
+
+  /* Checked before it is signed again with the client secret */
+  ma = attr_find (buf + AUTH_HDR_LEN, len - AUTH_HDR_LEN,
+                  PW_MESSAGE_AUTHENTICATOR);
+  if (ma && ((ma[1] != 18) ||
+             (ma_verify (buf, len, ma, slot->up_vector, secret) ==
+                RADIUSCLIENT_ERR)))
+    {
+      p->stats.invalid++;
+      return;
+    }
+
+  ma = NULL;
+  memcpy (out, buf, len);
+  out[1] = slot->id;
+  end    = out + len;
+
+  /* Everything is relayed as is but what depends on the secret */
+  for (a = out + AUTH_HDR_LEN; a < end; a += a[1])
+    {
+      if ((a[0] == PW_MESSAGE_AUTHENTICATOR) && (a[1] == 18))
+        ma = a;
+      else if ((a[0] == PW_TUNNEL_PASSWORD) && (a[1] >= 5 + 16) &&
+               ((a[1] - 5) % 16 == 0))
+        hidden_swap (a + 5, a[1] - 5, a + 3, secret, slot->up_vector,
+                     p->secret, slot->vector);
+      else if ((a[0] == PW_VENDOR_SPECIFIC) && (a[1] > 6) &&
+               (((a[2] << 24) | (a[3] << 16) | (a[4] << 8) | a[5]) ==
+                  RADPROXY_VENDOR_MS))
+        {
+          for (sub = a + 6; (sub + 2 <= a + a[1]) && (sub[1] >= 2) &&
+                 (sub + sub[1] <= a + a[1]); sub += sub[1])
+            {
+              if (((sub[0] == RADPROXY_MPPE_SEND_KEY) ||
+                   (sub[0] == RADPROXY_MPPE_RECV_KEY)) &&
+                  (sub[1] >= 4 + 16) && ((sub[1] - 4) % 16 == 0))
+                hidden_swap (sub + 4, sub[1] - 4, sub + 2, secret,
+                             slot->up_vector, p->secret, slot->vector);
+            }
+        }
+    }
+
+  memcpy (out + 4, slot->vector, AUTH_VECTOR_LEN);
+
+  if (ma)
+    {
+      memset (ma + 2, 0, AUTH_VECTOR_LEN);
+      fr_hmac_md5 (out, len, (const uint8_t *) p->secret,
+                   strlen (p->secret), ma + 2);
+    }
+
+  packet_md5 (out + 4, out, len, p->secret);
+
+  o = &p->outs[p->nouts++];
+  o->fd     = p->fd;
+  o->len    = len;
+  o->sa_len = slot->src_len;
+  memcpy (&o->sa, &slot->src, slot->src_len);
+
+  slot->used = 0;
+  p->stats.replied++;
+}
+
+/**
+ * IDs of requests that got no reply are taken back once they expire, the
+ * timeouts are counted then.
+ **/
+static int
+slot_reserve (RADIUSProxy *p, RADIUSProxyUpstream *u)
+{
+  RADIUSProxySlot *slot = NULL;
+  uint32_t now = proxy_now ();
+  int i, id;
+
+  for (i = 0; i < 256; i++)
+    {
+      id   = (u->next_id + i) & 0xff;
+      slot = &u->slots[id];
+
+      if (slot->used && ((int32_t) (now - slot->expire) >= 0))
+        {
+          slot->used = 0;
+          p->stats.timeouts++;
+        }
+
+      if (!slot->used)
+        {
+          u->next_id = (id + 1) & 0xff;
+          return id;
+        }
+    }
+
+  return -1;
+}
+
+/**
+ * Forwarded packet: unchanged attributes are copied by ranges from the
+ * received buffer, the User-Password is hidden again for the upstream
+ * secret and the packet is signed again.
+ **/
+static size_t
+request_build (RADIUSProxyRequest *req, RADIUSProxyUpstream *u, int id,
+               uint8_t *out)
+{
+  const char    *secret = radserver_secret (u->server);
+  const uint8_t *in     = req->data;
+  const uint8_t *end    = req->data + req->len;
+  const uint8_t *run    = NULL;
+  const uint8_t *a      = NULL;
+  uint8_t *ma  = NULL;
+  size_t   pos = AUTH_HDR_LEN;
+  size_t   run_len = 0;
+  size_t   len;
+  int      has_ma = 0;
+
+  out[0] = in[0];
+  out[1] = id;
+  memcpy (out + 4, in + 4, AUTH_VECTOR_LEN);
+
+  for (a = in + AUTH_HDR_LEN; a < end; a += a[1])
+    {
+      if (!(req->removed[a[0] >> 3] & (1 << (a[0] & 7))) &&
+          (a[0] != PW_MESSAGE_AUTHENTICATOR) &&
+          (a[0] != PW_USER_PASSWORD) &&
+          ((a[0] != PW_VENDOR_SPECIFIC) || !req->vsa_count))
+        {
+          if (!run)
+            run = a;
+          run_len += a[1];
+          continue;
+        }
+
+      if (run)
+        {
+          memcpy (out + pos, run, run_len);
+          pos += run_len;
+          run  = NULL;
+          run_len = 0;
+        }
+
+      if (req->removed[a[0] >> 3] & (1 << (a[0] & 7)))
+        continue;
+
+      if (a[0] == PW_MESSAGE_AUTHENTICATOR)
+        has_ma = 1;
+      else if (a[0] == PW_VENDOR_SPECIFIC)
+        pos += vsa_filter (req, a, out + pos);
+      else
+        {
+          memcpy (out + pos, a, a[1]);
+
+          if ((a[1] > 2) && ((a[1] - 2) % AUTH_VECTOR_LEN == 0))
+            hidden_swap (out + pos + 2, a[1] - 2, NULL, req->proxy->secret,
+                         in + 4, secret, out + 4);
+
+          pos += a[1];
+        }
+    }
+
+  if (run)
+    {
+      memcpy (out + pos, run, run_len);
+      pos += run_len;
+    }
+
+  len = (req->password_len + AUTH_VECTOR_LEN - 1) & ~(AUTH_VECTOR_LEN - 1);
+  if (!len)
+    len = AUTH_VECTOR_LEN;
+
+  if (pos + req->added_len + (req->password_len >= 0 ? 2 + len : 0) +
+        (has_ma ? 18 : 0) > MAX_PACKET_LEN)
+    return 0;
+
+  memcpy (out + pos, req->added, req->added_len);
+  pos += req->added_len;
+
+  if (req->password_len >= 0)
+    {
+      out[pos]     = PW_USER_PASSWORD;
+      out[pos + 1] = 2 + len;
+      memset (out + pos + 2, 0, len);
+      memcpy (out + pos + 2, req->password, req->password_len);
+      hidden_crypt (out + pos + 2, len, secret, out + 4, 0);
+      pos += 2 + len;
+    }
+
+  if (has_ma)
+    {
+      ma = out + pos;
+      ma[0] = PW_MESSAGE_AUTHENTICATOR;
+      ma[1] = 18;
+      memset (ma + 2, 0, AUTH_VECTOR_LEN);
+      pos += 18;
+    }
+
+  out[2] = (pos >> 8) & 0xff;
+  out[3] = pos & 0xff;
+
+  switch (out[0])
+    {
+      case PW_AUTHENTICATION_REQUEST:
+      case PW_STATUS_SERVER:
+        /* The client's random authenticator is kept */
+        if (ma)
+          fr_hmac_md5 (out, pos, (const uint8_t *) secret, strlen (secret),
+                       ma + 2);
+        break;
+
+      default:
+        memset (out + 4, 0, AUTH_VECTOR_LEN);
+        if (ma)
+          fr_hmac_md5 (out, pos, (const uint8_t *) secret, strlen (secret),
+                       ma + 2);
+        packet_md5 (out + 4, out, pos, secret);
+        break;
+    }
+
+  return pos;
+}
+
+static int
+request_verify (const RADIUSProxy *p, uint8_t *buf, size_t len)
+{
+  static const uint8_t zero[AUTH_VECTOR_LEN];
+  uint8_t digest[AUTH_VECTOR_LEN];
+  uint8_t saved[AUTH_VECTOR_LEN];
+  uint8_t *ma = attr_find (buf + AUTH_HDR_LEN, len - AUTH_HDR_LEN,
+                           PW_MESSAGE_AUTHENTICATOR);
+
+  if (ma && (ma[1] != 18))
+    return RADIUSCLIENT_ERR;
+
+  switch (buf[0])
+    {
+      case PW_AUTHENTICATION_REQUEST:
+      case PW_STATUS_SERVER:
+        if (!ma)
+          return RADIUSCLIENT_OK;
+
+        memcpy (saved, buf + 4, AUTH_VECTOR_LEN);
+        return ma_verify (buf, len, ma, saved, p->secret);
+
+      case PW_ACCOUNTING_REQUEST:
+      case PW_COA_REQUEST:
+      case PW_DISCONNECT_REQUEST:
+        memcpy (saved, buf + 4, AUTH_VECTOR_LEN);
+        memset (buf + 4, 0, AUTH_VECTOR_LEN);
+        packet_md5 (digest, buf, len, p->secret);
+        memcpy (buf + 4, saved, AUTH_VECTOR_LEN);
+
+        if (memcmp (digest, saved, AUTH_VECTOR_LEN) != 0)
+          return RADIUSCLIENT_ERR;
+
+        return ma ? ma_verify (buf, len, ma, zero, p->secret) :
+                    RADIUSCLIENT_OK;
+
+      default:
+        return RADIUSCLIENT_ERR;
+    }
+}
+
+/**
+ * Copy a Vendor-Specific attribute without the removed sub-attributes.
+ * Returns the number of bytes written, 0 when nothing is left.
+ **/
+static size_t
+vsa_filter (const RADIUSProxyRequest *req, const uint8_t *attr, uint8_t *out)
+{
+  const uint8_t *end = attr + attr[1];
+  const uint8_t *sub = NULL;
+  unsigned int vendor;
+  size_t pos = 6;
+  int i, matched = 0;
+
+  if (attr[1] < 8)
+    goto whole;
+
+  vendor = (attr[2] << 24) | (attr[3] << 16) | (attr[4] << 8) | attr[5];
+
+  for (i = 0; i < req->vsa_count; i++)
+    {
+      if ((req->vsa_removed[i] >> 16) == vendor)
+        matched = 1;
+    }
+
+  if (!matched)
+    goto whole;
+
+  memcpy (out, attr, 6);
+
+  for (sub = attr + 6; (sub + 2 <= end) && (sub[1] >= 2) &&
+         (sub + sub[1] <= end); sub += sub[1])
+    {
+      for (i = 0; i < req->vsa_count; i++)
+        {
+          if (req->vsa_removed[i] == ((vendor << 16) | sub[0]))
+            break;
+        }
+
+      if (i < req->vsa_count)
+        continue;
+
+      memcpy (out + pos, sub, sub[1]);
+      pos += sub[1];
+    }
+
+  if (pos == 6)
+    return 0;
+
+  out[1] = pos;
+  return pos;
+
+whole:
+  memcpy (out, attr, attr[1]);
+  return attr[1];
+}
+
+static void
+added_remove (RADIUSProxyRequest *req, unsigned int attr)
+{
+  uint8_t *a = NULL;
+  size_t len;
+
+  while ((a = attr_find (req->added, req->added_len, attr)))
+    {
+      /* A found vendor attribute points inside its own VSA */
+      if (attr >= 256)
+        a -= 6;
+
+      len = a[1];
+      memmove (a, a + len, req->added + req->added_len - (a + len));
+      req->added_len -= len;
+    }
+}
+
+/* Validate the header and the attribute framing, trim the padding */
+static int
+packet_check (const uint8_t *buf, size_t *len)
+{
+  const uint8_t *a = NULL;
+  size_t pkt_len;
+
+  if (*len < AUTH_HDR_LEN)
+    return RADIUSCLIENT_ERR;
+
+  pkt_len = (buf[2] << 8) | buf[3];
+  if ((pkt_len < AUTH_HDR_LEN) || (pkt_len > *len))
+    return RADIUSCLIENT_ERR;
+
+  for (a = buf + AUTH_HDR_LEN; a < buf + pkt_len; a += a[1])
+    {
+      if ((a + 2 > buf + pkt_len) || (a[1] < 2) || (a + a[1] > buf + pkt_len))
+        return RADIUSCLIENT_ERR;
+    }
+
+  *len = pkt_len;
+  return RADIUSCLIENT_OK;
+}
+
+/**
+ * First instance of the attribute in a validated attribute list. Vendor
+ * attributes are found in the usual one byte type and length format.
+ **/
+static uint8_t *
+attr_find (uint8_t *buf, size_t len, unsigned int attr)
+{
+  uint8_t *a   = NULL;
+  uint8_t *end = buf + len;
+  uint8_t *sub = NULL;
+  unsigned int vendor = attr >> 16;
+
+  for (a = buf; a + 2 <= end; a += a[1])
+    {
+      if (!vendor)
+        {
+          if (a[0] == attr)
+            return a;
+          continue;
+        }
+
+      if ((a[0] != PW_VENDOR_SPECIFIC) || (a[1] < 8) ||
+          (((a[2] << 24) | (a[3] << 16) | (a[4] << 8) | a[5]) != vendor))
+        continue;
+
+      for (sub = a + 6; (sub + 2 <= a + a[1]) && (sub[1] >= 2) &&
+             (sub + sub[1] <= a + a[1]); sub += sub[1])
+        {
+          if (sub[0] == (attr & 0xffff))
+            return sub;
+        }
+    }
+
+  return NULL;
+}
+
+static int
+ma_verify (uint8_t *buf, size_t len, uint8_t *ma, const uint8_t *vector,
+           const char *secret)
+{
+  uint8_t digest[AUTH_VECTOR_LEN];
+  uint8_t saved_ma[AUTH_VECTOR_LEN];
+  uint8_t saved_vector[AUTH_VECTOR_LEN];
+
+  memcpy (saved_ma, ma + 2, AUTH_VECTOR_LEN);
+  memcpy (saved_vector, buf + 4, AUTH_VECTOR_LEN);
+
+  memset (ma + 2, 0, AUTH_VECTOR_LEN);
+  memcpy (buf + 4, vector, AUTH_VECTOR_LEN);
+  fr_hmac_md5 (buf, len, (const uint8_t *) secret, strlen (secret), digest);
+
+  memcpy (ma + 2, saved_ma, AUTH_VECTOR_LEN);
+  memcpy (buf + 4, saved_vector, AUTH_VECTOR_LEN);
+
+  return memcmp (digest, saved_ma, AUTH_VECTOR_LEN) == 0 ?
+           RADIUSCLIENT_OK : RADIUSCLIENT_ERR;
+}
+
+static void
+packet_md5 (uint8_t *digest, const uint8_t *buf, size_t len,
+            const char *secret)
+{
+  FR_MD5_CTX ctx;
+
+  fr_MD5Init (&ctx);
+  fr_MD5Update (&ctx, buf, len);
+  fr_MD5Update (&ctx, (const uint8_t *) secret, strlen (secret));
+  fr_MD5Final (digest, &ctx);
+}
+
+static void
+hidden_key (uint8_t *key, const char *secret, const uint8_t *prev,
+            const uint8_t *salt)
+{
+  FR_MD5_CTX ctx;
+
+  fr_MD5Init (&ctx);
+  fr_MD5Update (&ctx, (const uint8_t *) secret, strlen (secret));
+  fr_MD5Update (&ctx, prev, AUTH_VECTOR_LEN);
+  if (salt)
+    fr_MD5Update (&ctx, salt, 2);
+  fr_MD5Final (key, &ctx);
+}
+
+/**
+ * Move a hidden value (RFC 2865 5.2, RFC 2868 3.5 when salted) from one
+ * secret and authenticator to another without keeping the clear text.
+ **/
+static void
+hidden_swap (uint8_t *value, size_t len, const uint8_t *salt,
+             const char *from, const uint8_t *from_vector, const char *to,
+             const uint8_t *to_vector)
+{
+  uint8_t from_prev[AUTH_VECTOR_LEN];
+  uint8_t to_prev[AUTH_VECTOR_LEN];
+  uint8_t from_key[AUTH_VECTOR_LEN];
+  uint8_t to_key[AUTH_VECTOR_LEN];
+  size_t i, j;
+
+  memcpy (from_prev, from_vector, AUTH_VECTOR_LEN);
+  memcpy (to_prev, to_vector, AUTH_VECTOR_LEN);
+
+  for (i = 0; i + AUTH_VECTOR_LEN <= len; i += AUTH_VECTOR_LEN)
+    {
+      hidden_key (from_key, from, from_prev, i ? NULL : salt);
+      hidden_key (to_key, to, to_prev, i ? NULL : salt);
+
+      memcpy (from_prev, value + i, AUTH_VECTOR_LEN);
+
+      for (j = 0; j < AUTH_VECTOR_LEN; j++)
+        value[i + j] ^= from_key[j] ^ to_key[j];
+
+      memcpy (to_prev, value + i, AUTH_VECTOR_LEN);
+    }
+}
+
+static void
+hidden_crypt (uint8_t *value, size_t len, const char *secret,
+              const uint8_t *vector, int decrypt)
+{
+  uint8_t prev[AUTH_VECTOR_LEN];
+  uint8_t key[AUTH_VECTOR_LEN];
+  size_t i, j;
+
+  memcpy (prev, vector, AUTH_VECTOR_LEN);
+
+  for (i = 0; i + AUTH_VECTOR_LEN <= len; i += AUTH_VECTOR_LEN)
+    {
+      hidden_key (key, secret, prev, NULL);
+
+      if (decrypt)
+        memcpy (prev, value + i, AUTH_VECTOR_LEN);
+
+      for (j = 0; j < AUTH_VECTOR_LEN; j++)
+        value[i + j] ^= key[j];
+
+      if (!decrypt)
+        memcpy (prev, value + i, AUTH_VECTOR_LEN);
+    }
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSPROXY_H
+#define _RADIUSPROXY_H
+
+#include <freeradius/libradius.h>
+#include "radiusserver.h"
+
+#define RADPROXY_BATCH_MAX  256
+
+typedef struct _RADIUSProxy        RADIUSProxy;
+typedef struct _RADIUSProxyRequest RADIUSProxyRequest;
+
+/* Hook results besides the index of an upstream */
+enum {
+  RADPROXY_ROUTE_ERROR   = -3,
+  RADPROXY_ROUTE_DROP    = -2,
+  RADPROXY_ROUTE_DEFAULT = -1
+};
+
+typedef int (*RADIUSProxyHook) (RADIUSProxyRequest *req, void *arg);
+
+typedef struct _RADIUSProxyStats {
+  unsigned long received;     /* requests from clients */
+  unsigned long forwarded;    /* requests sent upstream */
+  unsigned long replied;      /* replies relayed to clients */
+  unsigned long dropped;      /* dropped by the hook */
+  unsigned long hook_errors;  /* the hook failed, the request was dropped */
+  unsigned long invalid;      /* malformed or badly signed packets */
+  unsigned long busy;         /* no free ID towards the upstream */
+  unsigned long timeouts;     /* upstream never replied */
+} RADIUSProxyStats;
+
+/* UDP proxy API, a proxy is driven by a single thread */
+RADIUSProxy *radproxy_new          (const char *host, int port,
+                                    const char *secret, int batch,
+                                    int timeout, const char **errmsg);
+void         radproxy_free         (RADIUSProxy *p);
+int          radproxy_upstream_add (RADIUSProxy *p, RADIUSServer *server);
+int          radproxy_upstreams    (RADIUSProxy *p);
+void         radproxy_hook_set     (RADIUSProxy *p, RADIUSProxyHook hook,
+                                    void *arg);
+int          radproxy_port         (RADIUSProxy *p);
+int          radproxy_run          (RADIUSProxy *p, int timeout);
+void         radproxy_stats        (RADIUSProxy *p, RADIUSProxyStats *stats);
+
+/* Request seen by the hook, only valid while the hook runs */
+int radproxy_req_code       (RADIUSProxyRequest *req);
+int radproxy_req_source     (RADIUSProxyRequest *req, char *host,
+                             size_t host_len, int *port);
+int radproxy_req_attr_get   (RADIUSProxyRequest *req, unsigned int attr,
+                             const uint8_t **value, size_t *value_len);
+int radproxy_req_password   (RADIUSProxyRequest *req, char *buf,
+                             size_t buf_len);
+int radproxy_req_attr_set   (RADIUSProxyRequest *req, const char *attr,
+                             const char *value);
+int radproxy_req_attr_remove (RADIUSProxyRequest *req, unsigned int attr);
+
+#endif /* _RADIUSPROXY_H */
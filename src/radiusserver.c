@@ -0,0 +1,159 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include "radiusclient.h"
+#include "radiusserver.h"
+
+struct _RADIUSServer {
+  fr_ipaddr_t ipaddr;
+  int         port;
+  int         refs;
+  const char *hostname;
+  char        secret[];
+};
+
+static pthread_mutex_t refs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Implementation */
+
+RADIUSServer *
+radserver_new (const char *hostname, int port, const char *secret,
+               int force_af, const char **errmsg)
+{
+  RADIUSServer *s = NULL;
+  fr_ipaddr_t ipaddr;
+  char buffer[256];
+  const char *host = hostname;
+  const char *p = NULL;
+  size_t secret_len;
+  size_t host_len;
+
+  if (!hostname)
+    {
+      *errmsg = "Invalid arguments";
+      return NULL;
+    }
+
+  if (hostname[0] == '[') /* IPv6 URL encoded */
+    {
+      p = strchr (hostname, ']');
+
+      if (!p || ((size_t) (p - hostname) >= sizeof (buffer)))
+        {
+          *errmsg = "Invalid hostname or IP";
+          return NULL;
+        }
+
+      memcpy (buffer, hostname + 1, p - hostname - 1);
+      buffer[p - hostname - 1] = '\0';
+
+      host = buffer;
+    }
+
+  if (ip_hton (host, force_af, &ipaddr) < 0)
+    {
+      *errmsg = "Invalid hostname or IP";
+      return NULL;
+    }
+
+  secret = secret ? secret : "";
+  secret_len = strlen (secret);
+
+  /* rad_encode and friends expect a secret shorter than MAX_STRING_LEN */
+  if (secret_len >= MAX_STRING_LEN)
+    {
+      *errmsg = "Secret is too long";
+      return NULL;
+    }
+
+  /* The name the server certificate must match, without the brackets */
+  host_len = strlen (host);
+
+  s = malloc (sizeof (RADIUSServer) + secret_len + 1 + host_len + 1);
+  if (!s)
+    {
+      *errmsg = "Out of memory";
+      return NULL;
+    }
+
+  s->ipaddr = ipaddr;
+  s->port   = port > 0 ? port : 0;
+  s->refs   = 1;
+  memcpy (s->secret, secret, secret_len + 1);
+  memcpy (s->secret + secret_len + 1, host, host_len + 1);
+  s->hostname = s->secret + secret_len + 1;
+
+  return s;
+}
+
+RADIUSServer *
+radserver_ref (RADIUSServer *s)
+{
+  if (!s)
+    return NULL;
+
+  pthread_mutex_lock (&refs_mutex);
+  s->refs++;
+  pthread_mutex_unlock (&refs_mutex);
+
+  return s;
+}
+
+void
+radserver_unref (RADIUSServer *s)
+{
+  int refs;
+
+  if (!s)
+    return;
+
+  pthread_mutex_lock (&refs_mutex);
+  refs = --s->refs;
+  pthread_mutex_unlock (&refs_mutex);
+
+  if (refs == 0)
+    free (s);
+}
+
+const fr_ipaddr_t *
+radserver_ipaddr (const RADIUSServer *s)
+{
+  return &s->ipaddr;
+}
+
+int
+radserver_port (const RADIUSServer *s)
+{
+  return s->port;
+}
+
+const char *
+radserver_secret (const RADIUSServer *s)
+{
+  return s->secret;
+}
+
+const char *
+radserver_hostname (const RADIUSServer *s)
+{
+  return s->hostname;
+}
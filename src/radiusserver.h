@@ -0,0 +1,42 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSSERVER_H
+#define _RADIUSSERVER_H
+
+#include <freeradius/libradius.h>
+
+typedef struct _RADIUSServer RADIUSServer;
+
+/**
+ * Immutable server configuration, shared by reference between clients.
+ * The last radserver_unref frees it.
+ **/
+RADIUSServer *radserver_new   (const char *hostname, int port,
+                               const char *secret, int force_af,
+                               const char **errmsg);
+RADIUSServer *radserver_ref   (RADIUSServer *s);
+void          radserver_unref (RADIUSServer *s);
+
+const fr_ipaddr_t *radserver_ipaddr   (const RADIUSServer *s);
+int                radserver_port     (const RADIUSServer *s);
+const char        *radserver_secret   (const RADIUSServer *s);
+const char        *radserver_hostname (const RADIUSServer *s);
+
+#endif /* _RADIUSSERVER_H */
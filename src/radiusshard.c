@@ -0,0 +1,439 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <errno.h>
+#include "radiusclient.h"
+#include "radiusshard.h"
+
+#define RADSHARD_CACHELINE  64
+
+enum {
+  RADSHARD_SLOT_FREE = 0,
+  RADSHARD_SLOT_RESERVED,
+  RADSHARD_SLOT_WAITING,
+  RADSHARD_SLOT_DONE,
+  RADSHARD_SLOT_FAILED
+};
+
+typedef struct _RADIUSShardSlot {
+  int      state;
+  int      err;
+  size_t   len;
+  uint8_t *data;
+} RADIUSShardSlot;
+
+/**
+ * Every shard owns a socket with its own source port, hence its own ID
+ * space. Shards are allocated on their own cache lines and only touched
+ * by the threads running on the CPU they are steered to.
+ **/
+struct _RADIUSShard {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  int             fd;
+  int             reading;
+  int             next_id;
+  RADIUSShardSlot slots[256];
+};
+
+/* Keyed on everything the sockets were made with, not only the server */
+struct _RADIUSShardSet {
+  RADIUSShardSet *next;
+  fr_ipaddr_t     ipaddr;
+  int             port;
+  fr_ipaddr_t     src_ipaddr;
+  int             src_port;
+  int             count;
+  int             flags;
+  RADIUSShard    *shards[];
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  RADIUSShardSet *sets;
+} registry = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* Internal declaration */
+
+static long long    shard_now     (void);
+static RADIUSShard *shard_new     (const fr_ipaddr_t *ipaddr, int port,
+                                   const fr_ipaddr_t *src_ipaddr,
+                                   int src_port, int cpu, int flags);
+static void         shard_receive (RADIUSShard *shard, long long deadline);
+
+/* Implementation */
+
+RADIUSShardSet *
+radshard_get (const fr_ipaddr_t *ipaddr, int port,
+              const fr_ipaddr_t *src_ipaddr, int src_port, int count,
+              int flags)
+{
+  RADIUSShardSet *set = NULL;
+  int i;
+
+  if (!ipaddr || !src_ipaddr)
+    return NULL;
+
+  if (count <= 0)
+    count = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (count <= 0)
+    count = 1;
+  else if (count > RADSHARD_MAX)
+    count = RADSHARD_MAX;
+
+  pthread_mutex_lock (&registry.mutex);
+
+  for (set = registry.sets; set; set = set->next)
+    {
+      if ((set->port == port) && (set->src_port == src_port) &&
+          (set->count == count) && (set->flags == flags) &&
+          (fr_ipaddr_cmp (&set->ipaddr, ipaddr) == 0) &&
+          (fr_ipaddr_cmp (&set->src_ipaddr, src_ipaddr) == 0))
+        goto done;
+    }
+
+  set = calloc (1, sizeof (RADIUSShardSet) + count * sizeof (RADIUSShard *));
+  if (!set)
+    goto done;
+
+  memcpy (&set->ipaddr, ipaddr, sizeof (fr_ipaddr_t));
+  memcpy (&set->src_ipaddr, src_ipaddr, sizeof (fr_ipaddr_t));
+  set->port     = port;
+  set->src_port = src_port;
+  set->count    = count;
+  set->flags    = flags;
+
+  for (i = 0; i < count; i++)
+    {
+      int shard_port = src_port;
+
+      /* Distinct source ports, unless they are shared with SO_REUSEPORT */
+      if ((src_port > 0) && !(flags & RADSHARD_REUSEPORT))
+        shard_port = src_port + i;
+
+      set->shards[i] = shard_new (ipaddr, port, src_ipaddr, shard_port, i,
+                                  flags);
+
+      if (!set->shards[i])
+        {
+          while (i-- > 0)
+            {
+              close (set->shards[i]->fd);
+              free (set->shards[i]);
+            }
+
+          free (set);
+          set = NULL;
+          goto done;
+        }
+    }
+
+  set->next = registry.sets;
+  registry.sets = set;
+
+done:
+  pthread_mutex_unlock (&registry.mutex);
+  return set;
+}
+
+RADIUSShard *
+radshard_local (RADIUSShardSet *set)
+{
+  int cpu;
+
+  if (!set)
+    return NULL;
+
+  cpu = sched_getcpu ();
+  if (cpu < 0)
+    cpu = 0;
+
+  return set->shards[cpu % set->count];
+}
+
+int
+radshard_count (RADIUSShardSet *set)
+{
+  return set ? set->count : 0;
+}
+
+int
+radshard_id_reserve (RADIUSShard *shard, int preferred)
+{
+  int i;
+  int id = -1;
+
+  if (!shard)
+    return -1;
+
+  pthread_mutex_lock (&shard->mutex);
+
+  if (shard->slots[preferred & 0xff].state != RADSHARD_SLOT_FREE)
+    preferred = shard->next_id;
+
+  for (i = 0; i < 256; i++)
+    {
+      if (shard->slots[(preferred + i) & 0xff].state == RADSHARD_SLOT_FREE)
+        {
+          id = (preferred + i) & 0xff;
+          shard->slots[id].state = RADSHARD_SLOT_RESERVED;
+          shard->next_id = (id + 1) & 0xff;
+          break;
+        }
+    }
+
+  pthread_mutex_unlock (&shard->mutex);
+
+  return id;
+}
+
+void
+radshard_id_release (RADIUSShard *shard, int id)
+{
+  if (!shard || (id < 0) || (id > 0xff))
+    return;
+
+  pthread_mutex_lock (&shard->mutex);
+
+  free (shard->slots[id].data);
+  memset (&shard->slots[id], 0, sizeof (RADIUSShardSlot));
+
+  pthread_mutex_unlock (&shard->mutex);
+}
+
+int
+radshard_exchange (RADIUSShard *shard, int id, const uint8_t *data,
+                   size_t data_len, int timeout, uint8_t *reply,
+                   size_t *reply_len, const char **errmsg)
+{
+  RADIUSShardSlot *slot = NULL;
+  struct timespec ts;
+  long long deadline;
+  int res = RADIUSCLIENT_E_NONE;
+
+  if (!shard || (id < 0) || (id > 0xff) || !reply || !reply_len)
+    return RADIUSCLIENT_E_INVALID;
+
+  deadline = shard_now () + timeout;
+  slot     = &shard->slots[id];
+
+  pthread_mutex_lock (&shard->mutex);
+
+  slot->state = RADSHARD_SLOT_WAITING;
+
+  if (send (shard->fd, data, data_len, 0) < 0)
+    {
+      *errmsg = "Failed to send packet";
+      res = (errno == ECONNREFUSED) ? RADIUSCLIENT_E_UNREACHABLE :
+                                      RADIUSCLIENT_E_SOCKET;
+      goto done;
+    }
+
+  while (slot->state == RADSHARD_SLOT_WAITING)
+    {
+      if (shard_now () >= deadline)
+        {
+          *errmsg = "Socket error or timeout";
+          res = RADIUSCLIENT_E_TIMEOUT;
+          goto done;
+        }
+
+      if (!shard->reading)
+        {
+          shard_receive (shard, deadline);
+          continue;
+        }
+
+      ts.tv_sec  = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait (&shard->cond, &shard->mutex, &ts);
+    }
+
+  if (slot->state == RADSHARD_SLOT_DONE)
+    {
+      if (slot->len > *reply_len)
+        {
+          *errmsg = "Reply packet is too large";
+          res = RADIUSCLIENT_E_REPLY;
+          goto done;
+        }
+
+      memcpy (reply, slot->data, slot->len);
+      *reply_len = slot->len;
+    }
+  else
+    {
+      *errmsg = "Server is unreachable";
+      res = slot->err;
+    }
+
+done:
+  free (slot->data);
+  memset (slot, 0, sizeof (RADIUSShardSlot));
+
+  pthread_mutex_unlock (&shard->mutex);
+
+  return res;
+}
+
+/* Internal implementation */
+
+/* Monotonic milliseconds, the clock of the cond waits too */
+static long long
+shard_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static RADIUSShard *
+shard_new (const fr_ipaddr_t *ipaddr, int port, const fr_ipaddr_t *src_ipaddr,
+           int src_port, int cpu, int flags)
+{
+  RADIUSShard *shard = NULL;
+  struct sockaddr_storage sa;
+  pthread_condattr_t attr;
+  socklen_t sa_len;
+  int one = 1;
+
+  if (posix_memalign ((void **) &shard, RADSHARD_CACHELINE,
+                      sizeof (RADIUSShard)) != 0)
+    return NULL;
+
+  memset (shard, 0, sizeof (RADIUSShard));
+  pthread_mutex_init (&shard->mutex, NULL);
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&shard->cond, &attr);
+  pthread_condattr_destroy (&attr);
+  shard->next_id = fr_rand () & 0xff;
+
+  shard->fd = socket (ipaddr->af, SOCK_DGRAM, 0);
+  if (shard->fd < 0)
+    goto fail;
+
+#ifdef SO_REUSEPORT
+  if (flags & RADSHARD_REUSEPORT)
+    setsockopt (shard->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one));
+#endif
+
+#ifdef SO_INCOMING_CPU
+  /* Ask the kernel to process the replies on the CPU of the shard */
+  if (flags & RADSHARD_AFFINITY)
+    setsockopt (shard->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof (cpu));
+#endif
+
+  if (!fr_ipaddr2sockaddr (src_ipaddr, src_port, &sa, &sa_len) ||
+      (bind (shard->fd, (struct sockaddr *) &sa, sa_len) < 0))
+    goto fail_fd;
+
+  if (!fr_ipaddr2sockaddr (ipaddr, port, &sa, &sa_len) ||
+      (connect (shard->fd, (struct sockaddr *) &sa, sa_len) < 0))
+    goto fail_fd;
+
+  return shard;
+
+fail_fd:
+  close (shard->fd);
+fail:
+  free (shard);
+  return NULL;
+}
+
+/**
+ * Become the reader of the shard until the deadline or until some reply
+ * arrives. Called and returns with the shard mutex held.
+ **/
+static void
+shard_receive (RADIUSShard *shard, long long deadline)
+{
+  RADIUSShardSlot *slot = NULL;
+  struct pollfd pfd;
+  uint8_t buf[MAX_PACKET_LEN];
+  long long remain = deadline - shard_now ();
+  ssize_t n;
+  int i;
+
+  shard->reading = 1;
+
+  pfd.fd     = shard->fd;
+  pfd.events = POLLIN;
+
+  pthread_mutex_unlock (&shard->mutex);
+  poll (&pfd, 1, remain > 0 ? remain : 0);
+  pthread_mutex_lock (&shard->mutex);
+
+  while ((n = recv (shard->fd, buf, sizeof (buf), MSG_DONTWAIT)) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno != ECONNREFUSED)
+            break;
+
+          /* ICMP error, the server is gone for every request in flight */
+          for (i = 0; i < 256; i++)
+            {
+              if (shard->slots[i].state == RADSHARD_SLOT_WAITING)
+                {
+                  shard->slots[i].state = RADSHARD_SLOT_FAILED;
+                  shard->slots[i].err   = RADIUSCLIENT_E_UNREACHABLE;
+                }
+            }
+
+          break;
+        }
+
+      if ((n < AUTH_HDR_LEN) || (((buf[2] << 8) | buf[3]) > n))
+        continue;
+
+      slot = &shard->slots[buf[1]];
+
+      if (slot->state != RADSHARD_SLOT_WAITING)
+        continue;
+
+      slot->data = malloc (n);
+      if (slot->data)
+        {
+          memcpy (slot->data, buf, n);
+          slot->len   = n;
+          slot->state = RADSHARD_SLOT_DONE;
+        }
+      else
+        {
+          slot->state = RADSHARD_SLOT_FAILED;
+          slot->err   = RADIUSCLIENT_E_REPLY;
+        }
+    }
+
+  shard->reading = 0;
+  pthread_cond_broadcast (&shard->cond);
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _RADIUSSHARD_H
+#define _RADIUSSHARD_H
+
+#include <freeradius/libradius.h>
+
+#define RADSHARD_MAX  256
+
+typedef struct _RADIUSShard    RADIUSShard;
+typedef struct _RADIUSShardSet RADIUSShardSet;
+
+enum {
+  RADSHARD_REUSEPORT = 1 << 0,
+  RADSHARD_AFFINITY  = 1 << 1
+};
+
+/* Sharded UDP transport API */
+RADIUSShardSet *radshard_get        (const fr_ipaddr_t *ipaddr, int port,
+                                     const fr_ipaddr_t *src_ipaddr,
+                                     int src_port, int count, int flags);
+RADIUSShard    *radshard_local      (RADIUSShardSet *set);
+int             radshard_count      (RADIUSShardSet *set);
+
+int  radshard_id_reserve (RADIUSShard *shard, int preferred);
+void radshard_id_release (RADIUSShard *shard, int id);
+int  radshard_exchange   (RADIUSShard *shard, int id, const uint8_t *data,
+                          size_t data_len, int timeout, uint8_t *reply,
+                          size_t *reply_len, const char **errmsg);
+
+#endif /* _RADIUSSHARD_H */
@@ -0,0 +1,34 @@
+require 'radius'
+
+assert (radius.breaker, "radius.breaker is unavailable");
+
+local auth  = radius.auth.new ();
+local state = nil;
+
+assert (auth, "No authen instance created");
+
+radius.breaker.configure { threshold = 3, cooldown = 10 };
+
+-- Nothing listens on this port, every request fails with an ICMP error
+auth:setServer ("127.0.0.1", 9, "testing123");
+auth:setUsername ("test");
+auth:setPassword ("hello");
+
+for i = 1, 5 do
+  auth:send ();
+  print ("Send " .. i .. ": " .. auth:getLastErrCode () .. " " ..
+         auth:getLastErrMsg ());
+end
+
+assert (auth:getLastErrCode () == radius.E_CIRCUIT_OPEN,
+        "Circuit breaker did not open");
+
+state = radius.breaker.state ("127.0.0.1", 9);
+print ("\nBreaker: " .. state.state .. " trips=" .. state.trips ..
+       " rejected=" .. state.rejected);
+
+for _, s in ipairs (radius.breaker.list ()) do
+  print (s.host .. ":" .. s.port .. " " .. s.state);
+end
+
+print ("\nTest Result: OK");
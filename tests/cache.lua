@@ -0,0 +1,35 @@
+require 'radius'
+
+assert (radius.auth.cache, "radius.auth.cache is unavailable");
+
+local auth  = radius.auth.new ();
+local stats = nil;
+local res   = 0;
+
+assert (auth, "No authen instance created");
+
+radius.auth.cache { ttl = 30, max_entries = 1024,
+                    attributes = { "NAS-IP-Address" } };
+
+auth:setServer ("127.0.0.1", 0, "testing123");
+auth:setUsername ("test");
+auth:setPassword ("hello");
+auth:setAttribute ("NAS-IP-Address", "192.168.122.100");
+
+for i = 1, 3 do
+  res = auth:send ();
+  print ("Send " .. i .. ": " .. (res == 1 and "OK" or auth:getLastErrMsg ()));
+end
+
+stats = radius.auth.cacheStats ();
+print ("\nCache: hits=" .. stats.hits .. " misses=" .. stats.misses ..
+       " entries=" .. stats.entries);
+
+if res == 1 then
+  assert (stats.hits == 2, "Repeated authentications were not cached");
+end
+
+radius.auth.cacheFlush ();
+radius.auth.cache (false);
+
+print ("\nTest Result: OK");
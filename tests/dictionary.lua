@@ -0,0 +1,50 @@
+require 'radius'
+
+-- Compile the snapshot first:
+--   raddict-compile /tmp/luaradius-dictionary.snap
+local snapshot = arg and arg[1] or "/tmp/luaradius-dictionary.snap";
+local info = nil;
+
+radius.dictionary { snapshot = snapshot };
+
+local auth = radius.auth.new ();
+assert (auth, "No authen instance created");
+
+info = radius.dictionary ();
+assert (info.loaded, "Dictionary is not loaded");
+
+if info.snapshot then
+  print ("Snapshot " .. info.snapshot .. " (" .. info.hash .. "): " ..
+         info.attributes .. " attributes, " .. info.values .. " values, " ..
+         info.vendors .. " vendors");
+else
+  print ("Snapshot missing or stale, parsed the text dictionaries");
+end
+
+auth:setServer ("127.0.0.1", 0, "testing123");
+auth:setUsername ("test");
+auth:setPassword ("hello");
+auth:setAttribute ("NAS-Port", 1);
+auth:setAttribute ("Service-Type", "Framed-User");
+
+local res = auth:send ();
+print ("Send: " .. (res == 1 and "OK" or auth:getLastErrMsg ()));
+
+-- A relative snapshot path is resolved when configured, FreeRADIUS would
+-- look for its root file under the dictionary directory otherwise
+if info.snapshot then
+  local relative = string.rep ("../", 32) .. info.snapshot:gsub ("^/+", "");
+
+  auth = nil;
+  collectgarbage ();
+  assert (not radius.dictionary ().loaded, "Dictionary is still loaded");
+
+  radius.dictionary { snapshot = relative };
+  auth = radius.auth.new ();
+
+  info = radius.dictionary ();
+  assert (info.snapshot, "Relative snapshot path was not used");
+  print ("Relative snapshot resolved to " .. info.snapshot);
+end
+
+print ("\nTest Result: OK");
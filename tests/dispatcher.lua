@@ -0,0 +1,39 @@
+require 'radius'
+
+assert (radius.dispatcher, "radius.dispatcher is unavailable");
+
+-- Created before forking, every worker gets its own pair of rings
+local dispatcher = radius.dispatcher { workers = 2, slots = 8, retries = 2 };
+local acct  = nil;
+local stats = nil;
+
+assert (dispatcher:spawn (), "Dispatcher was not spawned");
+
+-- Without a fork this process plays worker 1
+assert (dispatcher:attach (1) == 1, "Worker was not attached");
+
+acct = radius.acct.new ();
+assert (acct, "No accounting instance created");
+
+acct:setServer ("127.0.0.1", 0, "testing123");
+acct:setUsername ("test");
+acct:setAttribute ("Acct-Status-Type", "Start");
+acct:setAttribute ("Acct-Session-Id", "dispatcher-test");
+
+for i = 1, 3 do
+  acct:send ();
+  print ("Send " .. i .. ": " .. acct:getLastErrCode () .. " " ..
+         acct:getLastErrMsg ());
+end
+
+stats = dispatcher:stats ();
+print ("\nDispatcher: workers=" .. stats.workers ..
+       " submitted=" .. stats.submitted .. " completed=" .. stats.completed ..
+       " retransmits=" .. stats.retransmits .. " timeouts=" .. stats.timeouts);
+
+assert (stats.submitted == 3, "Requests did not reach the dispatcher");
+assert (stats.completed == 3, "Requests were not completed");
+
+dispatcher:detach ();
+
+print ("\nTest Result: OK");
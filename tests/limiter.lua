@@ -0,0 +1,55 @@
+require 'radius'
+
+assert (radius.limiter, "radius.limiter is unavailable");
+
+local auth  = radius.auth.new ();
+local stats = nil;
+
+assert (auth, "No authentication instance created");
+
+-- Start from 4 requests in flight, shed at once above the limit
+radius.limiter.configure { initial = 4, min = 1, max = 64, tolerance = 2,
+                           backoff = 0.7, policy = "fail", max_wait = 0 };
+
+auth:setServer ("127.0.0.1", 1812, "testing123");
+auth:setUsername ("test");
+auth:setPassword ("test");
+
+for i = 1, 5 do
+  auth:send ();
+  print ("Send " .. i .. ": " .. auth:getLastErrCode () .. " " ..
+         auth:getLastErrMsg ());
+end
+
+stats = radius.limiter.stats ("127.0.0.1", 1812);
+assert (stats, "No limit for the server");
+
+print ("\nLimit: " .. stats.host .. ":" .. stats.port ..
+       " limit=" .. stats.limit .. " inflight=" .. stats.inflight ..
+       " rtt=" .. stats.rtt .. " rtt_base=" .. stats.rtt_base ..
+       " limited=" .. stats.limited);
+
+assert (stats.inflight == 0, "Requests were not released");
+assert (stats.limit >= 1 and stats.limit <= 64, "Limit is out of range");
+
+-- Nobody answers on the discard port, the failure cuts the limit
+local lost = radius.auth.new ();
+
+lost:setServer ("127.0.0.1", 9, "testing123");
+lost:setUsername ("test");
+lost:setPassword ("test");
+
+assert (lost:send () == 0, "Request to the discard port succeeded");
+
+stats = radius.limiter.stats ("127.0.0.1", 9);
+assert (stats and stats.limit < 4, "A failure did not cut the limit");
+assert (stats.inflight == 0, "Failed request was not released");
+
+radius.limiter.configure { initial = 0 };
+
+-- Lua sends one request at a time, the threads of limiter_load go over
+-- the limit: run from the build tree after "make check"
+assert (os.execute ("./limiter_load -t 8 -n 20") == 0,
+        "Concurrent requests were not limited");
+
+print ("\nTest Result: OK");
@@ -0,0 +1,275 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/**
+ * Concurrent senders for tests/limiter.lua, which cannot run two requests
+ * at once from Lua. Several threads of one process send through their own
+ * clients to an in-process server that answers slowly, starting from a
+ * limit of one request in flight with the fail policy. Exits with 0 when
+ * requests were shed by the limit and the limit moved off its start.
+ *
+ * Usage: limiter_load [-t threads] [-n requests] [-d delay_ms]
+ **/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <freeradius/ident.h>
+#include <freeradius/libradius.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "radiusclient.h"
+#include "radiusdest.h"
+
+#define LOAD_SECRET   "testing123"
+#define LOAD_THREADS  8
+#define LOAD_REQUESTS 20
+#define LOAD_DELAY    5
+
+static struct {
+  int           port;
+  int           requests;
+  int           delay;
+  int           running;
+  unsigned long sent;
+  unsigned long shed;
+} load = { 0, LOAD_REQUESTS, LOAD_DELAY, 0, 0, 0 };
+
+/* Internal declaration */
+
+static int   responder_start (void);
+static void *responder       (void *arg);
+static void *sender          (void *arg);
+
+/* Implementation */
+
+int
+main (int argc, char **argv)
+{
+  RADIUSDestLimitConfig config;
+  RADIUSDestInfo info;
+  RADIUSDest *d = NULL;
+  pthread_t threads[64];
+  double start = 0;
+  double moved = 0;
+  int nthreads = LOAD_THREADS;
+  int opt, i;
+
+  while ((opt = getopt (argc, argv, "t:n:d:h")) != -1)
+    {
+      switch (opt)
+        {
+          case 't':
+            nthreads = atoi (optarg);
+            break;
+
+          case 'n':
+            load.requests = atoi (optarg);
+            break;
+
+          case 'd':
+            load.delay = atoi (optarg);
+            break;
+
+          default:
+            fprintf (stderr, "Usage: %s [-t threads] [-n requests] "
+                             "[-d delay_ms]\n", argv[0]);
+            return 2;
+        }
+    }
+
+  if ((nthreads < 2) || (nthreads > 64) || (load.requests < 1))
+    {
+      fprintf (stderr, "Needs 2 to 64 threads and a request at least\n");
+      return 2;
+    }
+
+  if (responder_start () < 0)
+    return 1;
+
+  raddest_limit_config_default (&config);
+  config.initial  = 1;
+  config.min      = 1;
+  config.max      = 16;
+  config.policy   = RADDEST_LIMIT_FAIL;
+  config.max_wait = 0;
+  raddest_limit_configure (&config);
+
+  load.running = nthreads;
+
+  for (i = 0; i < nthreads; i++)
+    {
+      if (pthread_create (&threads[i], NULL, sender, NULL) != 0)
+        {
+          fprintf (stderr, "Could not start the senders\n");
+          return 1;
+        }
+    }
+
+  /* The limit may come back to where it started, watch it move */
+  while (__atomic_load_n (&load.running, __ATOMIC_ACQUIRE) > 0)
+    {
+      d = raddest_lookup ("127.0.0.1", load.port);
+      if (d)
+        {
+          raddest_info (d, &info);
+
+          if (start == 0)
+            start = info.limit;
+          if ((start > 0) && (info.limit != start) && (moved == 0))
+            moved = info.limit;
+        }
+
+      usleep (1000);
+    }
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  d = raddest_lookup ("127.0.0.1", load.port);
+  if (!d)
+    {
+      fprintf (stderr, "No limit for the server\n");
+      return 1;
+    }
+
+  raddest_info (d, &info);
+
+  printf ("sent=%lu shed=%lu limit=%.2f (started at %.2f, moved to %.2f) "
+          "inflight=%d limited=%lu\n", load.sent, load.shed, info.limit,
+          start, moved, info.inflight, info.limited);
+
+  if ((info.limited == 0) || (info.limited != load.shed))
+    {
+      fprintf (stderr, "Requests over the limit were not shed\n");
+      return 1;
+    }
+
+  if ((moved == 0) && (info.limit == start))
+    {
+      fprintf (stderr, "The limit never changed\n");
+      return 1;
+    }
+
+  if (info.inflight != 0)
+    {
+      fprintf (stderr, "Requests were not released\n");
+      return 1;
+    }
+
+  return 0;
+}
+
+/* Internal implementation */
+
+static void *
+sender (void *arg)
+{
+  RADIUSClientCtrl *c = malloc (radclient_ctrl_size ());
+  int i;
+
+  (void) arg;
+
+  if (c && (radclient_ctrl_init (c) == RADIUSCLIENT_OK))
+    {
+      radclient_server_set (c, "127.0.0.1", load.port, LOAD_SECRET);
+      radclient_attr_set (c, "User-Name", "test");
+      radclient_attr_set (c, "User-Password", "test");
+
+      for (i = 0; i < load.requests; i++)
+        {
+          if (radclient_send (c, RADIUSCLIENT_AUTH_REQ) == RADIUSCLIENT_OK)
+            __sync_fetch_and_add (&load.sent, 1);
+          else if (radclient_get_last_err_code (c) == RADIUSCLIENT_E_SHED)
+            __sync_fetch_and_add (&load.shed, 1);
+        }
+
+      radclient_ctrl_free (c);
+    }
+
+  free (c);
+  __atomic_sub_fetch (&load.running, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+/* In-process server, answers every request with an accept after a delay */
+
+static int
+responder_start (void)
+{
+  static int sockfd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  fr_ipaddr_t ipaddr;
+  pthread_t thread;
+
+  ip_hton ("127.0.0.1", AF_INET, &ipaddr);
+
+  sockfd = fr_socket (&ipaddr, 0);
+  if ((sockfd < 0) ||
+      (getsockname (sockfd, (struct sockaddr *) &addr, &addr_len) < 0))
+    {
+      fprintf (stderr, "Could not create the responder socket\n");
+      return -1;
+    }
+
+  load.port = ntohs (((struct sockaddr_in *) &addr)->sin_port);
+
+  if (pthread_create (&thread, NULL, responder, &sockfd) != 0)
+    return -1;
+
+  pthread_detach (thread);
+
+  return 0;
+}
+
+static void *
+responder (void *arg)
+{
+  int sockfd = *(int *) arg;
+  RADIUS_PACKET *request = NULL;
+  RADIUS_PACKET *reply   = NULL;
+
+  for (;;)
+    {
+      request = rad_recv (sockfd, 0);
+      if (!request)
+        continue;
+
+      usleep (load.delay * 1000);
+
+      reply = rad_alloc (0);
+      reply->sockfd     = sockfd;
+      reply->code       = PW_AUTHENTICATION_ACK;
+      reply->id         = request->id;
+      reply->src_ipaddr = request->dst_ipaddr;
+      reply->src_port   = request->dst_port;
+      reply->dst_ipaddr = request->src_ipaddr;
+      reply->dst_port   = request->src_port;
+
+      rad_send (reply, request, LOAD_SECRET);
+
+      rad_free (&reply);
+      rad_free (&request);
+    }
+
+  return NULL;
+}
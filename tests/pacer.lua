@@ -0,0 +1,42 @@
+require 'radius'
+
+assert (radius.pacer, "radius.pacer is unavailable");
+
+local acct  = radius.acct.new ();
+local stats = nil;
+
+assert (acct, "No accounting instance created");
+
+-- One token and no waiting, the second Interim-Update is shed
+radius.pacer.configure { host = "127.0.0.1", rate = 1, burst = 1,
+                         max_wait = 0,
+                         queue = { auth = 16, stop = 8, start = 4,
+                                   interim = 2 } };
+
+acct:setServer ("127.0.0.1", 0, "testing123");
+acct:setUsername ("test");
+acct:setAttribute ("Acct-Status-Type", "Interim-Update");
+acct:setAttribute ("Acct-Session-Id", "pacer-test");
+
+for i = 1, 2 do
+  acct:send ();
+  print ("Send " .. i .. ": " .. acct:getLastErrCode () .. " " ..
+         acct:getLastErrMsg ());
+end
+
+assert (acct:getLastErrCode () == radius.E_SHED, "Request was not shed");
+
+stats = radius.pacer.stats ("127.0.0.1");
+print ("\nPacer: rate=" .. stats.rate .. " burst=" .. stats.burst ..
+       " tokens=" .. stats.tokens);
+
+for _, cls in ipairs { "auth", "stop", "start", "interim" } do
+  print (cls .. ": queued=" .. stats[cls].queued .. " sent=" ..
+         stats[cls].sent .. " shed=" .. stats[cls].shed);
+end
+
+assert (stats.interim.shed == 1, "Shed count is wrong");
+
+radius.pacer.configure { host = "127.0.0.1", rate = 0 };
+
+print ("\nTest Result: OK");
@@ -0,0 +1,49 @@
+require 'radius'
+
+assert (radius.proxy, "radius.proxy is unavailable");
+
+-- Forwards to the local server, try it with:
+--   radtest test hello 127.0.0.1:18120 0 proxysecret
+local proxy = radius.proxy {
+  listen = "127.0.0.1",
+  port = 18120,
+  secret = "proxysecret",
+  upstreams = {
+    radius.server { host = "127.0.0.1", port = 1812, secret = "testing123" },
+  },
+  hook = function (req)
+    local user = req:getAttribute ("User-Name");
+    local host, port = req:getSource ();
+
+    print ("Request " .. req:getCode () .. " from " .. host .. ":" .. port ..
+           " for " .. tostring (user));
+
+    if user == "blocked" then
+      return false;
+    end
+
+    req:setAttribute ("NAS-Identifier", "luaradius-proxy");
+    req:removeAttribute ("Called-Station-Id");
+
+    return 1;
+  end
+};
+
+assert (proxy, "No proxy instance created");
+
+print ("Proxy listening on port " .. proxy:port ());
+
+for i = 1, 30 do
+  proxy:run (1);
+end
+
+local stats = proxy:stats ();
+print ("\nreceived=" .. stats.received .. " forwarded=" .. stats.forwarded ..
+       " replied=" .. stats.replied .. " dropped=" .. stats.dropped ..
+       " hook_errors=" .. stats.hook_errors .. " invalid=" .. stats.invalid .. " timeouts=" .. stats.timeouts);
+
+if proxy:getLastErrMsg () ~= "" then
+  print ("Hook error: " .. proxy:getLastErrMsg ());
+end
+
+print ("\nTest Result: OK");
@@ -0,0 +1,38 @@
+require 'radius'
+
+-- Run from the build tree after "make check", the stand-in server
+-- answers every request over TLS with the RadSec secret.
+os.execute ("./radsec_server -p 12083 -n 1 &");
+os.execute ("sleep 1");
+
+local auth = radius.auth.new ();
+local acct = radius.acct.new ();
+local res  = 0;
+local msg  = "OK";
+
+assert (auth and acct, "No instances created");
+
+auth:enableDebug ();
+
+auth:setServer ("127.0.0.1", 12083, "",
+                { transport = "tls", verify = false });
+auth:setUsername ("test");
+auth:setPassword ("hello");
+
+acct:setServer ("127.0.0.1", 12083, "",
+                { transport = "tls", verify = false });
+acct:setUsername ("test");
+acct:setAttribute ("Acct-Status-Type", "Start");
+
+-- Both clients share the same persistent connection
+for i = 1, 3 do
+  if auth:send () ~= 1 then
+    msg = "Failed: " .. auth:getLastErrMsg ();
+  end
+
+  if acct:send () ~= 1 then
+    msg = "Failed: " .. acct:getLastErrMsg ();
+  end
+end
+
+print ("\nTest Result: " .. msg);
@@ -0,0 +1,283 @@
+/**
+ * Copyright (C) 2012  Neutron Soutmun <neo.neutron@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/**
+ * A stand-in RADIUS over TCP/TLS server for the test suite.
+ * It accepts every request, Access-Request with an Access-Accept and
+ * Accounting-Request with an Accounting-Response, using a throw-away
+ * self-signed certificate.
+ *
+ * Usage: radsec_server [-t] [-p port] [-s secret] [-n connections]
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/ec.h>
+
+#define HDR_LEN  20
+#define MAX_LEN  4096
+
+static EVP_PKEY *make_key  (void);
+static X509     *make_cert (EVP_PKEY *pkey);
+static int       serve     (SSL *ssl, int fd, const char *secret);
+static int       read_full (SSL *ssl, int fd, unsigned char *buf, size_t len);
+static int       write_full (SSL *ssl, int fd, const unsigned char *buf,
+                             size_t len);
+
+int
+main (int argc, char **argv)
+{
+  const char *secret = "radsec";
+  int port  = 2083;
+  int tls   = 1;
+  int count = -1;
+  int opt;
+  int one = 1;
+  int lfd;
+  struct sockaddr_in addr;
+  SSL_CTX  *ctx  = NULL;
+  EVP_PKEY *pkey = NULL;
+  X509     *cert = NULL;
+
+  while ((opt = getopt (argc, argv, "tp:s:n:")) != -1)
+    {
+      switch (opt)
+        {
+          case 't':
+            tls = 0;
+            break;
+          case 'p':
+            port = atoi (optarg);
+            break;
+          case 's':
+            secret = optarg;
+            break;
+          case 'n':
+            count = atoi (optarg);
+            break;
+          default:
+            fprintf (stderr, "Usage: %s [-t] [-p port] [-s secret] "
+                     "[-n connections]\n", argv[0]);
+            return 1;
+        }
+    }
+
+  if (tls)
+    {
+      pkey = make_key ();
+      cert = make_cert (pkey);
+      ctx  = SSL_CTX_new (SSLv23_server_method ());
+
+      if (!pkey || !cert || !ctx ||
+          (SSL_CTX_use_certificate (ctx, cert) != 1) ||
+          (SSL_CTX_use_PrivateKey (ctx, pkey) != 1))
+        {
+          fprintf (stderr, "Could not set up the TLS context\n");
+          return 1;
+        }
+
+      SSL_CTX_set_session_id_context (ctx, (const unsigned char *) "radsec",
+                                      6);
+    }
+
+  lfd = socket (AF_INET, SOCK_STREAM, 0);
+  setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if ((bind (lfd, (struct sockaddr *) &addr, sizeof (addr)) < 0) ||
+      (listen (lfd, 16) < 0))
+    {
+      perror ("listen");
+      return 1;
+    }
+
+  while (count != 0)
+    {
+      SSL *ssl = NULL;
+      int fd = accept (lfd, NULL, NULL);
+
+      if (fd < 0)
+        continue;
+
+      if (tls)
+        {
+          ssl = SSL_new (ctx);
+          SSL_set_fd (ssl, fd);
+
+          if (SSL_accept (ssl) != 1)
+            {
+              SSL_free (ssl);
+              close (fd);
+              continue;
+            }
+
+          fprintf (stderr, "Accepted TLS connection%s\n",
+                   SSL_session_reused (ssl) ? " (resumed)" : "");
+        }
+
+      serve (ssl, fd, secret);
+
+      if (ssl)
+        {
+          SSL_shutdown (ssl);
+          SSL_free (ssl);
+        }
+
+      close (fd);
+
+      if (count > 0)
+        count--;
+    }
+
+  close (lfd);
+  SSL_CTX_free (ctx);
+
+  return 0;
+}
+
+static EVP_PKEY *
+make_key (void)
+{
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id (EVP_PKEY_EC, NULL);
+  EVP_PKEY *pkey = NULL;
+
+  if (!pctx ||
+      (EVP_PKEY_keygen_init (pctx) <= 0) ||
+      (EVP_PKEY_CTX_set_ec_paramgen_curve_nid (pctx,
+                                               NID_X9_62_prime256v1) <= 0) ||
+      (EVP_PKEY_keygen (pctx, &pkey) <= 0))
+    pkey = NULL;
+
+  EVP_PKEY_CTX_free (pctx);
+  return pkey;
+}
+
+static X509 *
+make_cert (EVP_PKEY *pkey)
+{
+  X509 *cert = X509_new ();
+  X509_NAME *name = NULL;
+
+  if (!cert || !pkey)
+    return NULL;
+
+  X509_set_version (cert, 2);
+  ASN1_INTEGER_set (X509_get_serialNumber (cert), 1);
+  X509_gmtime_adj (X509_get_notBefore (cert), 0);
+  X509_gmtime_adj (X509_get_notAfter (cert), 86400);
+  X509_set_pubkey (cert, pkey);
+
+  name = X509_get_subject_name (cert);
+  X509_NAME_add_entry_by_txt (name, "CN", MBSTRING_ASC,
+                              (const unsigned char *) "localhost", -1, -1, 0);
+  X509_set_issuer_name (cert, name);
+
+  if (!X509_sign (cert, pkey, EVP_sha256 ()))
+    {
+      X509_free (cert);
+      return NULL;
+    }
+
+  return cert;
+}
+
+/**
+ * Answer every request of the connection, in order, until it is closed.
+ **/
+static int
+serve (SSL *ssl, int fd, const char *secret)
+{
+  unsigned char buf[MAX_LEN + 64];
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int  digest_len;
+  size_t len;
+  EVP_MD_CTX *md = EVP_MD_CTX_new ();
+
+  while (read_full (ssl, fd, buf, 4) == 0)
+    {
+      len = (buf[2] << 8) | buf[3];
+      if ((len < HDR_LEN) || (len > MAX_LEN) ||
+          (read_full (ssl, fd, buf + 4, len - 4) < 0))
+        break;
+
+      /* Reply without attributes, the request authenticator stays */
+      buf[0] = buf[0] == 4 ? 5 : 2;
+      buf[2] = 0;
+      buf[3] = HDR_LEN;
+
+      EVP_DigestInit_ex (md, EVP_md5 (), NULL);
+      EVP_DigestUpdate (md, buf, HDR_LEN);
+      EVP_DigestUpdate (md, secret, strlen (secret));
+      EVP_DigestFinal_ex (md, digest, &digest_len);
+      memcpy (buf + 4, digest, 16);
+
+      if (write_full (ssl, fd, buf, HDR_LEN) < 0)
+        break;
+    }
+
+  EVP_MD_CTX_free (md);
+  return 0;
+}
+
+static int
+read_full (SSL *ssl, int fd, unsigned char *buf, size_t len)
+{
+  int n;
+
+  while (len > 0)
+    {
+      n = ssl ? SSL_read (ssl, buf, len) : (int) read (fd, buf, len);
+      if (n <= 0)
+        return -1;
+
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+static int
+write_full (SSL *ssl, int fd, const unsigned char *buf, size_t len)
+{
+  int n;
+
+  while (len > 0)
+    {
+      n = ssl ? SSL_write (ssl, buf, len) : (int) write (fd, buf, len);
+      if (n <= 0)
+        return -1;
+
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+require 'radius'
+
+local acct    = radius.acct.new ();
+local results = nil;
+
+assert (acct, "No accounting instance created");
+
+-- The primary plus two replicas, the request succeeds on 2 of 3 answers
+acct:setServer ("127.0.0.1", 0, "testing123");
+assert (acct:setReplicas ({ radius.server { host = "127.0.0.1", port = 1823,
+                                            secret = "testing456" },
+                            { host = "127.0.0.1", port = 1833,
+                              secret = "testing789" } }, "quorum") == 1,
+        "Replicas were not set");
+
+acct:setUsername ("test");
+acct:setAttribute ("Acct-Status-Type", "Start");
+acct:setAttribute ("Acct-Session-Id", "replicas-test");
+
+acct:send ();
+print ("Send: " .. acct:getLastErrCode () .. " " .. acct:getLastErrMsg ());
+
+results = acct:getResults ();
+assert (#results == 3, "Wrong number of targets");
+
+for i, r in ipairs (results) do
+  print (i .. ": " .. r.host .. ":" .. r.port .. " " .. r.state ..
+         " code=" .. r.code .. " rtt=" .. r.rtt .. " " .. r.msg);
+end
+
+acct:setReplicas ();
+assert (#acct:getResults () == 1, "Replicas were not cleared");
+
+print ("\nTest Result: OK");
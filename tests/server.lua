@@ -0,0 +1,33 @@
+require 'radius'
+
+assert (radius.server, "radius.server is unavailable");
+
+local server = radius.server { host = "127.0.0.1", port = 1812,
+                               secret = "testing123" };
+local clients = {};
+local res = 0;
+
+-- Every client references the same server configuration
+for i = 1, 1000 do
+  local auth = radius.auth.new ();
+
+  assert (auth, "No authen instance created");
+  auth:setServer (server);
+  clients[i] = auth;
+end
+
+print ("Memory with 1000 clients: " .. collectgarbage ("count") .. " KB");
+
+clients[1]:setUsername ("test");
+clients[1]:setPassword ("hello");
+
+res = clients[1]:send ();
+print ("Send: " .. (res == 1 and "OK" or clients[1]:getLastErrMsg ()));
+
+-- The clients keep the configuration alive after the object is collected
+server = nil;
+collectgarbage ();
+
+res = clients[1]:send ();
+print ("Send after collect: " ..
+       (res == 1 and "OK" or clients[1]:getLastErrMsg ()));
@@ -0,0 +1,54 @@
+require 'radius'
+
+assert (radius.acct.session, "radius.acct.session is unavailable");
+
+local acct = radius.acct.new ();
+local sess = nil;
+local res  = 0;
+local msg  = "";
+
+assert (acct, "No accounting instance created");
+
+acct:enableDebug ();
+acct:setServer ("127.0.0.1", 0, "testing123");
+
+sess = radius.acct.session {
+  acct       = acct,
+  username   = "test",
+  attributes = {
+    ["NAS-IP-Address"] = "192.168.122.100",
+    ["NAS-Port"]       = 1,
+  },
+};
+
+assert (sess, "No accounting session created");
+
+res = sess:start ();
+res = res == 1 and sess:interim { in_octets = 5000000000, out_octets = 1024 };
+res = res == 1 and sess:stop { in_octets = 6000000000, out_octets = 2048,
+                               cause = "User-Request" };
+
+if res == 1 then
+  msg = "OK";
+else
+  msg = "Failed:" .. acct:getLastErrMsg ();
+end
+
+-- Encrypted attributes cannot be part of the block encoded in advance
+assert (radius.acct.session {
+          acct       = acct,
+          attributes = { ["User-Password"] = "hello" },
+        } == nil, "Session created with an encrypted attribute");
+
+-- Nobody listens on the discard port, the Start is left unanswered and
+-- the session must stay idle so that it can be started again
+local lost = radius.acct.new ();
+
+lost:setServer ("127.0.0.1", 9, "testing123");
+
+sess = radius.acct.session { acct = lost, username = "test" };
+
+assert (sess:start () == 0, "Unanswered Start succeeded");
+assert (pcall (sess.start, sess), "Session started without an answer");
+
+print ("\nTest Result: " .. msg);
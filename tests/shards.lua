@@ -0,0 +1,22 @@
+require 'radius'
+
+local auth = radius.auth.new ();
+local res  = 0;
+local msg  = "OK";
+
+assert (auth, "No authen instance created");
+
+-- One socket per CPU, each with its own source port and ID space
+auth:setServer ("127.0.0.1", 0, "testing123",
+                { shards = "cpu", affinity = true });
+auth:setUsername ("test");
+auth:setPassword ("hello");
+
+for i = 1, 10 do
+  res = auth:send ();
+  if res ~= 1 then
+    msg = "Failed: " .. auth:getLastErrMsg ();
+  end
+end
+
+print ("\nTest Result: " .. msg);
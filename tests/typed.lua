@@ -0,0 +1,42 @@
+require 'radius'
+
+local auth = radius.auth.new ();
+local res  = 0;
+local v    = nil;
+
+assert (auth, "No authen instance created");
+
+auth:setServer ("127.0.0.1", 0, "testing123");
+auth:setUsername ("test");
+auth:setPassword ("hello");
+
+-- Numbers are stored as native integers/addresses, no string parsing
+auth:setAttribute ("NAS-Port", 42);
+auth:setAttribute ("NAS-IP-Address", 3232266852);   -- 192.168.122.100
+
+-- Numbers the attribute type cannot hold are refused, not truncated
+assert (auth:setAttribute ("NAS-Port-Type", 1.5) == nil,
+        "Fractional value accepted");
+assert (auth:setAttribute ("Session-Timeout", -1) == nil,
+        "Negative value accepted");
+assert (auth:getLastErrMsg () == "Invalid value", "Wrong error message");
+auth:setAttributeRaw ("Calling-Station-Id", "00:11:22:33:44:55");
+auth:setAttributeRaw ("Class", "\0\1\2\3");
+
+res = auth:send ();
+if res == 1 then
+  print ("Authentication OK");
+
+  v = auth:getValue ("Session-Timeout");
+  if v then
+    assert (type (v) == "number", "Session-Timeout is not a number");
+    print ("Session-Timeout: " .. v);
+  end
+
+  v = auth:getValue ("Reply-Message");
+  if v then
+    print ("Reply-Message: " .. v);
+  end
+else
+  print ("Authentication failed: " .. auth:getLastErrMsg ());
+end